@@ -0,0 +1,95 @@
+// A bump pointer allocator. Everything allocated from an arena is freed at
+// once by arena_free, so it suits data which all dies at the same time, like
+// the AST of a program once its bytecode has been generated.
+//
+// Usage:
+//
+// Arena arena = {};
+// arena_init(&arena);
+//
+// Thing* t = (Thing*) arena_alloc(&arena, sizeof(Thing));
+//
+// arena_free(&arena);
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT (16)
+
+struct ArenaBlock {
+  ArenaBlock* next;
+
+  psize size;
+  psize used;
+};
+
+struct Arena {
+  ArenaBlock* head;
+
+  // Total bytes handed out, for debugging.
+  psize allocated;
+};
+
+void arena_init(Arena* arena) {
+  arena->head = 0;
+  arena->allocated = 0;
+}
+
+psize arena_align(psize size) {
+  return (size + ARENA_ALIGNMENT - 1) & ~((psize) ARENA_ALIGNMENT - 1);
+}
+
+// Returns size bytes of uninitialised memory which live until arena is freed.
+// If arena is 0 the memory comes from malloc instead, and is never freed.
+void* arena_alloc(Arena* arena, psize size) {
+  if (arena == 0) {
+    return malloc(size);
+  }
+
+  size = arena_align(size);
+
+  ArenaBlock* block = arena->head;
+
+  if (block == 0 || block->used + size > block->size) {
+    // NOTE: allocations bigger than a block get a block of their
+    // own, behind the current one so that it can keep being filled.
+    bool large = size > ARENA_BLOCK_SIZE;
+    psize blockSize = large ? size : ARENA_BLOCK_SIZE;
+
+    block = (ArenaBlock*) malloc(arena_align(sizeof(ArenaBlock)) + blockSize);
+    block->size = blockSize;
+    block->used = 0;
+
+    if (large && arena->head != 0) {
+      block->next = arena->head->next;
+      arena->head->next = block;
+    } else {
+      block->next = arena->head;
+      arena->head = block;
+    }
+  }
+
+  void* ptr = (uint8*) block + arena_align(sizeof(ArenaBlock)) + block->used;
+  block->used += size;
+
+  arena->allocated += size;
+
+  return ptr;
+}
+
+// Frees everything allocated from arena.
+void arena_free(Arena* arena) {
+  ArenaBlock* block = arena->head;
+
+  while (block != 0) {
+    ArenaBlock* next = block->next;
+
+    free(block);
+
+    block = next;
+  }
+
+  arena_init(arena);
+}
+
+// The arena which the current compilation allocates its AST and scratch data
+// from. loaf_compile sets it up and frees it when it's done.
+Arena* compiler_arena = 0;
@@ -17,6 +17,9 @@
 //
 //    return 0;
 // }
+//
+// array_int_initIn(arena) makes an array which lives in arena instead, and is
+// freed along with it.
 
 // TODO(harrison): Give up and rewrite this with generics
 
@@ -25,6 +28,9 @@
 struct ArrayHeader {
   psize count;
   psize capacity;
+
+  // Where the array is allocated from, or 0 for the heap.
+  Arena* arena;
 };
 
 #define array(Type) Type*
@@ -34,23 +40,37 @@ struct ArrayHeader {
 
 // Hear be dragons...
 #define array_for_name(Type, name) \
-Type* array_ ## name ## _init() { \
+Type* array_ ## name ## _initIn(Arena* arena) { \
   int initialCapacity = ARRAY_CAPACITY_GROW(0); \
+  psize size = sizeof(ArrayHeader) + sizeof(Type) * initialCapacity; \
 \
-  ArrayHeader* header = (ArrayHeader*) realloc(0, sizeof(ArrayHeader) + sizeof(Type) * initialCapacity); \
+  ArrayHeader* header = (ArrayHeader*) (arena != 0 ? arena_alloc(arena, size) : realloc(0, size)); \
   header->count = 0; \
   header->capacity = initialCapacity; \
+  header->arena = arena; \
 \
   return (Type*) (header + 1); \
 } \
 \
+Type* array_ ## name ## _init() { \
+  return array_ ## name ## _initIn(0); \
+} \
+\
 \
 void array_## name ## _add (Type** array, Type value) { \
   ArrayHeader* header = array_header(*array); \
 \
   if (header->capacity < header->count + 1) { \
     header->capacity = ARRAY_CAPACITY_GROW(header->capacity); \
-    header = (ArrayHeader*) realloc(header, sizeof(*header) + (header->capacity * sizeof(Type))); \
+    psize size = sizeof(*header) + (header->capacity * sizeof(Type)); \
+\
+    if (header->arena != 0) { \
+      ArrayHeader* grown = (ArrayHeader*) arena_alloc(header->arena, size); \
+      memcpy(grown, header, sizeof(*header) + header->count * sizeof(Type)); \
+      header = grown; \
+    } else { \
+      header = (ArrayHeader*) realloc(header, size); \
+    } \
 \
     *array = (Type*) (header + 1); \
   } \
@@ -6,84 +6,193 @@ struct Variable {
   int slot;
 };
 
-#define MAX_SYMBOLS (10)
+array_for(int);
+
+// A slot with no variable in it.
+#define SCOPE_SLOT_FREE (-1)
+
+// Parameters keep their slots for the whole function, as their uses aren't
+// counted.
+#define SCOPE_SLOT_KEEP (INT32_MAX)
+
+// The variables which can be seen while generating code, and the slots they
+// live in.
+//
+// NOTE: a variable's slot is given back as soon as the statement
+// holding its last use has been generated, not just when its scope ends, so
+// later variables can reuse it. loaf has no loops, so code after that
+// statement can never run before it.
 struct Scope {
-  int count;
-  Variable variables[MAX_SYMBOLS];
+  // Name to slot.
+  Bindings variables;
 
-  Scope* parent;
+  // For each slot of the function being generated, the number of uses the
+  // variable in it has left, or SCOPE_SLOT_FREE. Slots whose variable has no
+  // uses left are freed by scope_freeDead.
+  array(int) slots;
+
+  // How many times the variable made by each declaration is used, by node.
+  // See ast_countUses.
+  uint32* uses;
+
+  // The hunk the program starts in, which holds its globals.
+  Hunk* program;
 };
 
-void scope_init(Scope* s) {
-  s->count = 0;
-  s->parent = 0;
+void scope_init(Scope* s, Hunk* program, uint32* uses) {
+  bindings_init(&s->variables);
+  bindings_push(&s->variables);
+
+  s->slots = array_int_initIn(compiler_arena);
+  s->uses = uses;
+  s->program = program;
 }
 
-void scope_init(Scope* s, Scope *p) {
-  scope_init(s);
+void scope_free(Scope* s) {
+  bindings_free(&s->variables);
+}
 
-  s->parent = p;
+// Opens a block's scope. Slots taken by its variables are given back when it
+// is popped, if they haven't been already.
+void scope_push(Scope* s) {
+  bindings_push(&s->variables);
 }
 
-int scope_getNextSlot(Scope *s) {
-  int n = s->count;
-  if (s->parent != 0) {
-    n += scope_getNextSlot(s->parent);
+void scope_pop(Scope* s) {
+  for (int i = bindings_first(&s->variables); i < bindings_count(&s->variables); i++) {
+    s->slots[s->variables.stack[i].value] = SCOPE_SLOT_FREE;
   }
 
-  return n;
+  bindings_pop(&s->variables);
 }
 
-bool scope_get(Scope* s, char* name, int len, int* slot) {
-  for (int i = 0; i < s->count; i++) {
-    Variable v = s->variables[i];
+// Opens a function's scope. Its slots start from 0, and the variables of the
+// code around it can't be seen. Returns the slots of the code around it, to
+// be passed to scope_popFunction.
+array(int) scope_pushFunction(Scope* s) {
+  array(int) outer = s->slots;
 
-    if (v.len != len) {
-      continue;
-    }
+  s->slots = array_int_initIn(compiler_arena);
+  bindings_push(&s->variables, true);
 
-    if (memcmp(name, v.start, len) == 0) {
-      *slot = v.slot;
+  return outer;
+}
 
-      return true;
+void scope_popFunction(Scope* s, array(int) outer) {
+  scope_pop(s);
+
+  s->slots = outer;
+}
+
+// Returns the index of the global called name.
+int scope_getGlobal(Scope* s, char* name, int len) {
+  return hunk_addGlobal(s->program, name, len);
+}
+
+// Returns the index of the global which the function h is declared as. If it
+// is the only declaration of that name, calls to it can be direct.
+int scope_declareFunction(Scope* s, char* name, int len, Hunk* h) {
+  int global = scope_getGlobal(s, name, len);
+
+  if (s->program->globals[global].declarations == 1) {
+    s->program->globals[global].function = h;
+  }
+
+  return global;
+}
+
+// Can calls to global jump straight to the function it is declared as?
+bool scope_isDirect(Scope* s, int global) {
+  return s->program->globals[global].function != 0;
+}
+
+// The slot the next variable declared will be given: the lowest free one.
+int scope_getNextSlot(Scope *s) {
+  int count = (int) array_count(s->slots);
+
+  for (int i = 0; i < count; i++) {
+    if (s->slots[i] == SCOPE_SLOT_FREE) {
+      return i;
     }
   }
 
-  if (s->parent != 0) {
-    return scope_get(s->parent, name, len, slot);
+  return count;
+}
+
+// Does slot hold no variable? Only free slots can be written before the
+// statement being generated has finished reading variables.
+bool scope_isFree(Scope* s, int slot) {
+  return slot >= (int) array_count(s->slots) || s->slots[slot] == SCOPE_SLOT_FREE;
+}
+
+// One past the highest slot with a variable in it.
+int scope_getTop(Scope* s) {
+  int top = (int) array_count(s->slots);
+
+  while (top > 0 && s->slots[top - 1] == SCOPE_SLOT_FREE) {
+    top -= 1;
   }
 
-  return false;
+  return top;
 }
 
-bool scope_get(Scope* s, Token ident, int* slot) {
-  return scope_get(s, ident.start, ident.len, slot);
+// The first slot temporary values can use while a result is computed into
+// target: above every variable, and above target.
+int scope_getScratch(Scope* s, int target) {
+  int top = scope_getTop(s);
+
+  return top > target ? top : target + 1;
 }
 
-int scope_set(Scope* s, Variable* var) {
-  for (int i = 0; i < s->count; i++) {
-    Variable v = s->variables[i];
+// Finds the slot of the variable called name, and records a use of it.
+bool scope_use(Scope* s, char* name, int len, int* slot) {
+  if (!bindings_get(&s->variables, string_intern(name, len), slot)) {
+    return false;
+  }
 
-    if (v.len != var->len) {
-      break;
-    }
+  // NOTE: ast_countUses counted every call made here, so a
+  // variable can't be used after it runs out.
+  assert(s->slots[*slot] > 0);
 
-    if (strncmp(v.start, var->start, v.len) == 0) {
-      return false;
-    }
+  if (s->slots[*slot] != SCOPE_SLOT_KEEP) {
+    s->slots[*slot] -= 1;
   }
 
-  assert(s->count < MAX_SYMBOLS);
+  return true;
+}
+
+// Gives var the next free slot, for a variable which will be used uses
+// times. Returns -1 if a variable of the same name is already in the
+// innermost scope.
+int scope_set(Scope* s, Variable* var, int uses) {
+  int slot = scope_getNextSlot(s);
 
-  var->slot = scope_getNextSlot(s);
+  if (!bindings_add(&s->variables, string_intern(var->start, var->len), slot)) {
+    return -1;
+  }
+
+  if (slot == (int) array_count(s->slots)) {
+    array_int_add(&s->slots, uses);
+  } else {
+    s->slots[slot] = uses;
+  }
 
-  s->variables[s->count] = *var;
-  s->count += 1;
+  var->slot = slot;
 
   return var->slot;
 }
 
-enum ASTNodeType : uint32 {
+// Frees the slots of variables with no uses left. Called between statements,
+// as the statement which used them last might still be reading them.
+void scope_freeDead(Scope* s) {
+  for (psize i = 0; i < array_count(s->slots); i++) {
+    if (s->slots[i] == 0) {
+      s->slots[i] = SCOPE_SLOT_FREE;
+    }
+  }
+}
+
+enum ASTNodeType : uint8 {
   AST_NODE_INVALID,
   AST_NODE_ROOT,
   AST_NODE_ASSIGNMENT,
@@ -108,26 +217,45 @@ enum ASTNodeType : uint32 {
   AST_NODE_LOG,
   AST_NODE_DECLARATION,
   AST_NODE_RETURN,
+  AST_NODE_BLOCK,
 };
 
-struct ASTNode;
+// NOTE: The AST is flat. Nodes are indexes into a set of parallel
+// arrays held by an AST, rather than pointers to each other: the kind,
+// position, payload and resolved type of node n are kinds[n], positions[n],
+// data[n] and types[n]. Lists of nodes (the statements of a block, the arguments of a
+// call) are runs of ids in lists. Names are spans of the source instead of
+// tokens.
+typedef uint32 ASTNodeId;
+
+// Id 0 is never given to a node, so it stands in for a missing one (ie. the
+// else block of an if without one).
+#define AST_NODE_NONE ((ASTNodeId) 0)
+
+// A piece of the source, as an offset from its start.
+struct Span {
+  uint32 offset;
+  uint32 len;
+};
 
-array_for_name(ASTNode*, ASTNodep);
+// Children are lists[first] to lists[first + count - 1].
 struct ASTNode_Root {
-  array(ASTNode*) children;
+  uint32 first;
+  uint32 count;
 };
 
 struct ASTNode_Binary {
-  ASTNode *left; // Must be an identifier
-  ASTNode *right; // Must be an expression (which returns a number)
+  ASTNodeId left; // Must be an identifier
+  ASTNodeId right; // Must be an expression (which returns a number)
 };
 
 struct ASTNode_Identifier {
-  Token token;
+  Span name;
 };
 
+// Values are kept in AST::values, as they're as big as a node on their own.
 struct ASTNode_Value {
-  Value val;
+  uint32 index;
 };
 
 struct ASTNode_Number {
@@ -135,128 +263,230 @@ struct ASTNode_Number {
 };
 
 struct ASTNode_If {
-  ASTNode* condition;
+  ASTNodeId condition;
 
-  ASTNode* block;
-  ASTNode* elseBlock;
+  ASTNodeId block;
+  ASTNodeId elseBlock;
 };
 
 struct Parameter {
-  Token identifier;
-  Token type;
+  Span identifier;
+  Span type;
 };
 
 struct ASTNode_Declaration {
-  Token identifier;
-  Token type;
+  Span identifier;
+  Span type;
 };
 
-array_for(Parameter);
-
+// The rest of a function declaration lives in AST::functions.
 struct ASTNode_Function {
-  Token identifier;
+  Span identifier;
 
-  Token returnType;
+  uint32 index;
+};
 
-  ASTNode* block;
+struct ASTFunction {
+  Span returnType;
 
-  array(Parameter) parameters;
+  ASTNodeId block;
+
+  // Parameters are AST::parameters[firstParameter] onwards.
+  uint32 firstParameter;
+  uint32 parameterCount;
 };
 
+// Arguments are lists[firstArg] to lists[firstArg + argCount - 1].
 struct ASTNode_FunctionCall {
-  Token identifier;
+  Span identifier;
 
-  array(ASTNode) args;
+  uint32 firstArg;
+  uint32 argCount;
 };
 
 struct ASTNode_Return {
-  ASTNode* child;
+  ASTNodeId child;
 };
 
-struct ASTNode_Log {};
+// A block with its own scope. The parser never makes these; they are left
+// behind when ast_fold removes an if statement but keeps one of its blocks.
+struct ASTNode_Block {
+  ASTNodeId block;
+};
 
-struct ASTNode {
-  ASTNodeType type;
+union ASTNodeData {
+  ASTNode_Root root;
+  ASTNode_Binary assignmentDeclaration;
+  ASTNode_Binary assignment;
 
-  int line;
+  ASTNode_Binary binary;
 
-  union {
-    ASTNode_Root root;
-    ASTNode_Binary assignmentDeclaration;
-    ASTNode_Binary assignment;
+  ASTNode_Return Return;
 
-    ASTNode_Binary binary;
+  ASTNode_Value value;
 
-    ASTNode_Binary add;
-    ASTNode_Binary subtract;
-    ASTNode_Binary multiply;
-    ASTNode_Binary divide;
+  ASTNode_Identifier identifier;
+  ASTNode_Number number;
 
-    ASTNode_Binary And;
-    ASTNode_Binary Or;
+  ASTNode_If cIf;
 
-    ASTNode_Return Return;
+  ASTNode_Function functionDeclaration;
+  ASTNode_FunctionCall functionCall;
 
-    ASTNode_Binary equality;
+  ASTNode_Declaration declaration;
 
-    ASTNode_Value value;
+  ASTNode_Block block;
+};
 
-    ASTNode_Identifier identifier;
-    ASTNode_Number number;
+array_for(uint8);
+array_for(ASTNodeId);
+array_for(ASTNodeData);
+array_for(Parameter);
+array_for(ASTFunction);
 
-    ASTNode_If cIf;
+struct AST {
+  // The program the spans point into.
+  char* source;
 
-    ASTNode_Function functionDeclaration;
-    ASTNode_FunctionCall functionCall;
+  array(uint8) kinds;
+  // The source position (see lines.cpp) each node was parsed from.
+  array(uint32) positions;
+  array(ASTNodeData) data;
 
-    ASTNode_Log log;
+  // The type of an expression once typeCheck has resolved it, if it's an
+  // atomic type. VALUE_NIL if the type isn't known.
+  array(uint8) types;
 
-    ASTNode_Declaration declaration;
-  };
+  array(ASTNodeId) lists;
+  array(Value) values;
+  array(Parameter) parameters;
+  array(ASTFunction) functions;
 };
 
-void ast_root_add(ASTNode* parent, ASTNode child) {
-  assert(parent->type == AST_NODE_ROOT);
+// Sets up an empty AST for source, allocated from the compiler's arena.
+void ast_init(AST* ast, char* source) {
+  ast->source = source;
+
+  ast->kinds = array_uint8_initIn(compiler_arena);
+  ast->positions = array_uint32_initIn(compiler_arena);
+  ast->data = array_ASTNodeData_initIn(compiler_arena);
+  ast->types = array_uint8_initIn(compiler_arena);
+
+  ast->lists = array_ASTNodeId_initIn(compiler_arena);
+  ast->values = array_Value_initIn(compiler_arena);
+  ast->parameters = array_Parameter_initIn(compiler_arena);
+  ast->functions = array_ASTFunction_initIn(compiler_arena);
+
+  // Take id 0, so that it is never a real node.
+  ASTNodeData none = {};
 
-  ASTNode* c = (ASTNode*) malloc(sizeof(child));
-  *c = child;
+  array_uint8_add(&ast->kinds, AST_NODE_INVALID);
+  array_uint32_add(&ast->positions, 0);
+  array_ASTNodeData_add(&ast->data, none);
+  array_uint8_add(&ast->types, VALUE_NIL);
+}
 
-  array_ASTNodep_add(&parent->root.children, c);
+ASTNodeType ast_kind(AST* ast, ASTNodeId node) {
+  return (ASTNodeType) ast->kinds[node];
 }
 
-ASTNode ast_makeRoot() {
-  ASTNode node = {};
-  node.type = AST_NODE_ROOT;
+Span ast_span(AST* ast, Token t) {
+  Span span = {};
 
-  node.root.children = array_ASTNodep_init();
+  if (t.len != 0) {
+    span.offset = t.pos;
+    span.len = (uint32) t.len;
+  }
 
-  return node;
+  return span;
+}
+
+char* ast_text(AST* ast, Span span) {
+  return ast->source + span.offset;
 }
 
-ASTNode ast_makeIdentifier(Token t) {
-  ASTNode node = {};
-  node.line = t.line;
-  node.type = AST_NODE_IDENTIFIER;
-  node.identifier.token = t;
+ASTNodeId ast_add(AST* ast, ASTNodeType kind, uint32 pos, ASTNodeData data) {
+  ASTNodeId node = (ASTNodeId) array_count(ast->kinds);
+
+  array_uint8_add(&ast->kinds, kind);
+  array_uint32_add(&ast->positions, pos);
+  array_ASTNodeData_add(&ast->data, data);
+  array_uint8_add(&ast->types, VALUE_NIL);
 
   return node;
 }
 
-ASTNode ast_makeValue(Value v, Token t) {
-  ASTNode node = {};
-  node.type = AST_NODE_VALUE;
+// Overwrites node with a copy of with. Whatever node held before is left
+// unreachable in the arena.
+void ast_replace(AST* ast, ASTNodeId node, ASTNodeId with) {
+  ast->kinds[node] = ast->kinds[with];
+  ast->positions[node] = ast->positions[with];
+  ast->data[node] = ast->data[with];
+  ast->types[node] = ast->types[with];
+}
+
+// Copies count ids into the AST's lists, returning where they start.
+uint32 ast_addList(AST* ast, ASTNodeId* nodes, psize count) {
+  uint32 first = (uint32) array_count(ast->lists);
 
-  node.line = t.line;
+  for (psize i = 0; i < count; i++) {
+    array_ASTNodeId_add(&ast->lists, nodes[i]);
+  }
 
-  node.value.val = v;
+  return first;
+}
 
-  return node;
+ASTNodeId ast_child(AST* ast, ASTNodeId root, uint32 i) {
+  return ast->lists[ast->data[root].root.first + i];
+}
+
+ASTNodeId ast_arg(AST* ast, ASTNodeId call, uint32 i) {
+  return ast->lists[ast->data[call].functionCall.firstArg + i];
+}
+
+ASTFunction* ast_function(AST* ast, ASTNodeId node) {
+  return &ast->functions[ast->data[node].functionDeclaration.index];
+}
+
+Value ast_value(AST* ast, ASTNodeId node) {
+  return ast->values[ast->data[node].value.index];
+}
+
+ASTNodeId ast_makeRoot(AST* ast, ASTNodeId* children, psize count) {
+  ASTNodeData data = {};
+  data.root.first = ast_addList(ast, children, count);
+  data.root.count = (uint32) count;
+
+  return ast_add(ast, AST_NODE_ROOT, 0, data);
+}
+
+ASTNodeId ast_makeIdentifier(AST* ast, Span name, uint32 pos) {
+  ASTNodeData data = {};
+  data.identifier.name = name;
+
+  return ast_add(ast, AST_NODE_IDENTIFIER, pos, data);
+}
+
+ASTNodeId ast_makeIdentifier(AST* ast, Token t) {
+  return ast_makeIdentifier(ast, ast_span(ast, t), t.pos);
+}
+
+ASTNodeId ast_makeValue(AST* ast, Value v, uint32 pos) {
+  ASTNodeData data = {};
+  data.value.index = (uint32) array_count(ast->values);
+
+  array_Value_add(&ast->values, v);
+
+  return ast_add(ast, AST_NODE_VALUE, pos, data);
 }
 
-ASTNode ast_makeOperator(ASTNodeType op, Token t) {
-  ASTNode node = {};
-  node.line = t.line;
+ASTNodeId ast_makeValue(AST* ast, Value v, Token t) {
+  return ast_makeValue(ast, v, t.pos);
+}
 
+// Makes an operator without operands. They are filled in with
+// ast_setOperands once the parser knows what they are.
+ASTNodeId ast_makeOperator(AST* ast, ASTNodeType op, Token t) {
   switch (op) {
     case AST_NODE_ADD:
     case AST_NODE_SUBTRACT:
@@ -271,7 +501,7 @@ ASTNode ast_makeOperator(ASTNodeType op, Token t) {
     case AST_NODE_TEST_AND:
     case AST_NODE_TEST_OR:
       {
-        node.type = op;
+        // Good to go.
       } break;
     default:
       {
@@ -279,454 +509,1434 @@ ASTNode ast_makeOperator(ASTNodeType op, Token t) {
       } break;
   }
 
-  return node;
+  ASTNodeData data = {};
+
+  return ast_add(ast, op, t.pos, data);
 }
 
-ASTNode ast_makeOperatorWith(ASTNodeType op, ASTNode left, ASTNode right, Token t) {
-  ASTNode node = ast_makeOperator(op, t);
+void ast_setOperands(AST* ast, ASTNodeId op, ASTNodeId left, ASTNodeId right) {
+  ast->data[op].binary.left = left;
+  ast->data[op].binary.right = right;
+}
 
-  // TODO(harrison): free!
-  ASTNode* l = (ASTNode*) malloc(sizeof(left));
-  ASTNode* r = (ASTNode*) malloc(sizeof(right));
+bool ast_isBinary(ASTNodeType kind) {
+  switch (kind) {
+    case AST_NODE_ADD:
+    case AST_NODE_SUBTRACT:
+    case AST_NODE_MULTIPLY:
+    case AST_NODE_DIVIDE:
+    case AST_NODE_TEST_EQUAL:
+    case AST_NODE_TEST_GREATER:
+    case AST_NODE_TEST_GREATER_EQUAL:
+    case AST_NODE_TEST_LESSER:
+    case AST_NODE_TEST_LESSER_EQUAL:
+    case AST_NODE_TEST_AND:
+    case AST_NODE_TEST_OR:
+      {
+        return true;
+      } break;
+    default:
+      {
+        return false;
+      } break;
+  }
+}
 
-  *l = left;
-  *r = right;
+// Binary operators which evaluate both sides and then combine them, ie. all
+// of them but && and ||.
+bool ast_isStrict(ASTNodeType kind) {
+  return ast_isBinary(kind) && kind != AST_NODE_TEST_AND && kind != AST_NODE_TEST_OR;
+}
 
-  node.add.left = l;
-  node.add.right = r;
+bool ast_isAnd(ASTNodeType kind) {
+  return kind == AST_NODE_TEST_AND;
+}
 
-  return node;
+bool ast_isOr(ASTNodeType kind) {
+  return kind == AST_NODE_TEST_OR;
 }
 
-ASTNode ast_makeNumber(int n, Token t) {
-  ASTNode node = {};
-  node.line = t.line;
-  node.type = AST_NODE_NUMBER;
-  node.number.number = n;
+// NOTE: operators of the same power group to the left, so a long
+// chain like a + 1 + 2 + 3 is a tree as deep as it is long. The passes over
+// the AST walk down its left hand side in a loop rather than recursing once
+// per operator, which would run out of stack.
+//
+// ast_leftSpine returns node followed by each left operand below it for which
+// follow holds. The operand at the bottom is the left hand side of the last
+// one. Allocated from compiler_arena.
+array(ASTNodeId) ast_leftSpine(AST* ast, ASTNodeId node, bool (*follow)(ASTNodeType kind)) {
+  array(ASTNodeId) spine = array_ASTNodeId_initIn(compiler_arena);
 
-  return node;
-}
+  array_ASTNodeId_add(&spine, node);
 
-ASTNode ast_makeAssignmentDeclaration(ASTNode left, ASTNode right, Token t) {
-  ASTNode node = {};
-  node.line = t.line;
-  node.type = AST_NODE_ASSIGNMENT_DECLARATION;
+  while (follow(ast_kind(ast, ast->data[node].binary.left))) {
+    node = ast->data[node].binary.left;
 
-  // TODO(harrison): free!
-  ASTNode* l = (ASTNode*) malloc(sizeof(left));
-  ASTNode* r = (ASTNode*) malloc(sizeof(right));
+    array_ASTNodeId_add(&spine, node);
+  }
 
-  *l = left;
-  *r = right;
+  return spine;
+}
 
-  node.assignmentDeclaration.left = l;
-  node.assignmentDeclaration.right = r;
+ASTNodeId ast_makeNumber(AST* ast, int n, Token t) {
+  ASTNodeData data = {};
+  data.number.number = n;
 
-  return node;
-};
+  return ast_add(ast, AST_NODE_NUMBER, t.pos, data);
+}
+
+ASTNodeId ast_makeAssignmentDeclaration(AST* ast, ASTNodeId left, ASTNodeId right, uint32 pos) {
+  ASTNodeData data = {};
+  data.assignmentDeclaration.left = left;
+  data.assignmentDeclaration.right = right;
+
+  return ast_add(ast, AST_NODE_ASSIGNMENT_DECLARATION, pos, data);
+}
 
-ASTNode ast_makeAssignment(ASTNode left, ASTNode right, Token t) {
-  ASTNode node = {};
-  node.line = t.line;
-  node.type = AST_NODE_ASSIGNMENT;
+ASTNodeId ast_makeAssignment(AST* ast, ASTNodeId left, ASTNodeId right, Token t) {
+  ASTNodeData data = {};
+  data.assignment.left = left;
+  data.assignment.right = right;
 
-  // TODO(harrison): free!
-  ASTNode* l = (ASTNode*) malloc(sizeof(left));
-  ASTNode* r = (ASTNode*) malloc(sizeof(right));
+  return ast_add(ast, AST_NODE_ASSIGNMENT, t.pos, data);
+}
 
-  *l = left;
-  *r = right;
+ASTNodeId ast_makeIf(AST* ast, Token t, ASTNodeId condition, ASTNodeId block, ASTNodeId elseBlock = AST_NODE_NONE) {
+  assert(ast_kind(ast, block) == AST_NODE_ROOT);
+  assert(elseBlock == AST_NODE_NONE || ast_kind(ast, elseBlock) == AST_NODE_ROOT);
 
-  node.assignment.left = l;
-  node.assignment.right = r;
+  ASTNodeData data = {};
+  data.cIf.condition = condition;
+  data.cIf.block = block;
+  data.cIf.elseBlock = elseBlock;
 
-  return node;
+  return ast_add(ast, AST_NODE_IF, t.pos, data);
 }
 
-ASTNode ast_makeIf(ASTNode condition, ASTNode block) {
-  assert(block.type == AST_NODE_ROOT);
+ASTNodeId ast_makeFunctionDeclaration(AST* ast, Token ident, ASTNodeId block, Parameter* params, psize paramCount, Token ret) {
+  assert(ast_kind(ast, block) == AST_NODE_ROOT);
 
-  ASTNode node = {};
-  node.type = AST_NODE_IF;
+  ASTFunction function = {};
+  function.returnType = ast_span(ast, ret);
+  function.block = block;
+  function.firstParameter = (uint32) array_count(ast->parameters);
+  function.parameterCount = (uint32) paramCount;
 
-  node.cIf.condition = (ASTNode*) malloc(sizeof(condition));
-  *node.cIf.condition = condition;
+  for (psize i = 0; i < paramCount; i++) {
+    array_Parameter_add(&ast->parameters, params[i]);
+  }
 
-  node.cIf.block = (ASTNode*) malloc(sizeof(block));
-  *node.cIf.block = block;
+  ASTNodeData data = {};
+  data.functionDeclaration.identifier = ast_span(ast, ident);
+  data.functionDeclaration.index = (uint32) array_count(ast->functions);
 
-  node.cIf.elseBlock = 0;
+  array_ASTFunction_add(&ast->functions, function);
 
-  return node;
+  return ast_add(ast, AST_NODE_FUNCTION_DECLARATION, ident.pos, data);
 }
 
-ASTNode ast_makeIf(ASTNode condition, ASTNode block, ASTNode elseBlock) {
-  assert(block.type == AST_NODE_ROOT && elseBlock.type == AST_NODE_ROOT);
+ASTNodeId ast_makeFunctionCall(AST* ast, Token t, ASTNodeId* args, psize argCount) {
+  ASTNodeData data = {};
+  data.functionCall.identifier = ast_span(ast, t);
+  data.functionCall.firstArg = ast_addList(ast, args, argCount);
+  data.functionCall.argCount = (uint32) argCount;
 
-  ASTNode node = {};
-  node.type = AST_NODE_IF;
+  return ast_add(ast, AST_NODE_FUNCTION_CALL, t.pos, data);
+}
 
-  node.cIf.condition = (ASTNode*) malloc(sizeof(condition));
-  *node.cIf.condition = condition;
+ASTNodeId ast_makeLog(AST* ast, Token t) {
+  ASTNodeData data = {};
 
-  node.cIf.block = (ASTNode*) malloc(sizeof(block));
-  *node.cIf.block = block;
+  return ast_add(ast, AST_NODE_LOG, t.pos, data);
+}
 
-  node.cIf.elseBlock = (ASTNode*) malloc(sizeof(elseBlock));
-  *node.cIf.elseBlock = elseBlock;
+ASTNodeId ast_makeDeclaration(AST* ast, Span ident, Span type, uint32 pos) {
+  ASTNodeData data = {};
+  data.declaration.identifier = ident;
+  data.declaration.type = type;
 
-  return node;
+  return ast_add(ast, AST_NODE_DECLARATION, pos, data);
 }
 
-ASTNode ast_makeFunctionDeclaration(Token ident, ASTNode block, array(Parameter) params, Token ret) {
-  assert(block.type == AST_NODE_ROOT);
+ASTNodeId ast_makeDeclaration(AST* ast, Token ident, Token type) {
+  return ast_makeDeclaration(ast, ast_span(ast, ident), ast_span(ast, type), ident.pos);
+}
 
-  ASTNode node = {};
-  node.type = AST_NODE_FUNCTION_DECLARATION;
+ASTNodeId ast_makeReturn(AST* ast, ASTNodeId expr, Token t) {
+  ASTNodeData data = {};
+  data.Return.child = expr;
 
-  node.functionDeclaration.parameters = params;
+  return ast_add(ast, AST_NODE_RETURN, t.pos, data);
+}
 
-  node.functionDeclaration.returnType = ret;
+ASTNodeId ast_makeBlock(AST* ast, ASTNodeId block, uint32 pos) {
+  assert(ast_kind(ast, block) == AST_NODE_ROOT);
 
-  node.functionDeclaration.identifier = ident;
-  node.functionDeclaration.block = (ASTNode*) malloc(sizeof(block));
-  *node.functionDeclaration.block = block;
+  ASTNodeData data = {};
+  data.block.block = block;
 
-  return node;
+  return ast_add(ast, AST_NODE_BLOCK, pos, data);
 }
 
-ASTNode ast_makeFunctionCall(Token t, array(ASTNode) args) {
-  ASTNode node = {};
-  node.line = t.line;
-  node.type = AST_NODE_FUNCTION_CALL;
-  node.functionCall.identifier = t;
-  node.functionCall.args = args;
+// Is node known to be of the given type at compile time?
+bool ast_isType(AST* ast, ASTNodeId node, ValueType type) {
+  if (ast->types[node] != VALUE_NIL) {
+    return ast->types[node] == type;
+  }
 
-  return node;
-}
+  if (ast_kind(ast, node) == AST_NODE_NUMBER) {
+    return type == VALUE_NUMBER;
+  }
 
-ASTNode ast_makeLog() {
-  ASTNode node = {};
-  node.type = AST_NODE_LOG;
+  if (ast_kind(ast, node) == AST_NODE_VALUE) {
+    return value_type(ast_value(ast, node)) == type;
+  }
 
-  return node;
+  return false;
 }
 
-ASTNode ast_makeDeclaration(Token ident, Token type) {
-  ASTNode node = {};
-  node.line = ident.line;
-  node.type = AST_NODE_DECLARATION;
-  node.declaration.identifier = ident;
-  node.declaration.type = type;
+// Picks the unchecked version of a binary instruction if both operands are
+// known to be of type operands, and the checked one otherwise.
+Instruction ast_typedOp(AST* ast, ASTNodeId node, ValueType operands, Instruction checked, Instruction typed) {
+  if (ast_isType(ast, ast->data[node].binary.left, operands) && ast_isType(ast, ast->data[node].binary.right, operands)) {
+    return typed;
+  }
 
-  return node;
+  return checked;
 }
 
-ASTNode ast_makeReturn(ASTNode expr, Token t) {
-  ASTNode node = {};
-  node.type = AST_NODE_RETURN;
+// Like ast_typedOp, for == which works on both numbers and bools.
+Instruction ast_equalityOp(AST* ast, ASTNodeId node, Instruction checked, Instruction numbers, Instruction bools) {
+  Instruction op = ast_typedOp(ast, node, VALUE_NUMBER, checked, numbers);
 
-  node.line = t.line;
-
-  node.Return.child = (ASTNode*) malloc(sizeof(expr));
-  *node.Return.child = expr;
+  if (op == checked) {
+    op = ast_typedOp(ast, node, VALUE_BOOL, checked, bools);
+  }
 
-  return node;
+  return op;
 }
 
-// TODO(harrison): properly propogate errors
-bool ast_writeBytecode(ASTNode* node, Hunk* hunk, Scope* scope) {
-  switch (node->type) {
-    case AST_NODE_INVALID:
+// The instruction which combines the operands of node, one of the
+// ast_isStrict operators, in the stack or register format.
+Instruction ast_binaryOp(AST* ast, ASTNodeId node, bool registers) {
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_TEST_EQUAL:
       {
-        logf("reached an invalid source path\n");
-
-        return false;
+        return registers ? ast_equalityOp(ast, node, OP_R_TEST_EQ, OP_R_TEST_EQ_NUM, OP_R_TEST_EQ_BOOL) : ast_equalityOp(ast, node, OP_TEST_EQ, OP_TEST_EQ_NUM, OP_TEST_EQ_BOOL);
       } break;
-    case AST_NODE_ROOT:
+    case AST_NODE_TEST_GREATER:
       {
-        for (psize i = 0; i < array_count(node->root.children); i++) {
-          ASTNode* child = node->root.children[i];
-
-          if (!ast_writeBytecode(child, hunk, scope)) {
-            return false;
-          }
-        }
+        return registers ? ast_typedOp(ast, node, VALUE_NUMBER, OP_R_TEST_GT, OP_R_TEST_GT_NUM) : ast_typedOp(ast, node, VALUE_NUMBER, OP_TEST_GT, OP_TEST_GT_NUM);
       } break;
-    case AST_NODE_ASSIGNMENT:
+    case AST_NODE_TEST_LESSER:
       {
-        ASTNode* left = node->assignmentDeclaration.left;
-        assert(left->type == AST_NODE_IDENTIFIER);
-
-        ASTNode* right = node->assignmentDeclaration.right;
-
-        // write instructions to push right side onto stack
-        if (!ast_writeBytecode(right, hunk, scope)) {
-          return false;
-        }
-
-        int slot = -1;
-        if (!scope_get(scope, left->identifier.token.start, left->identifier.token.len, &slot)) {
-          logf("ERROR: variable doesn't exist2!\n");
-
-          return false;
-        }
-
-        hunk_write(hunk, OP_SET_LOCAL, node->line);
-        hunk_write(hunk, slot, node->line);
+        return registers ? ast_typedOp(ast, node, VALUE_NUMBER, OP_R_TEST_LT, OP_R_TEST_LT_NUM) : ast_typedOp(ast, node, VALUE_NUMBER, OP_TEST_LT, OP_TEST_LT_NUM);
       } break;
-    case AST_NODE_ASSIGNMENT_DECLARATION:
+    case AST_NODE_TEST_GREATER_EQUAL:
+      {
+        return registers ? ast_typedOp(ast, node, VALUE_NUMBER, OP_R_TEST_GTE, OP_R_TEST_GTE_NUM) : ast_typedOp(ast, node, VALUE_NUMBER, OP_TEST_GTE, OP_TEST_GTE_NUM);
+      } break;
+    case AST_NODE_TEST_LESSER_EQUAL:
+      {
+        return registers ? ast_typedOp(ast, node, VALUE_NUMBER, OP_R_TEST_LTE, OP_R_TEST_LTE_NUM) : ast_typedOp(ast, node, VALUE_NUMBER, OP_TEST_LTE, OP_TEST_LTE_NUM);
+      } break;
+    case AST_NODE_ADD:
+      {
+        return registers ? ast_typedOp(ast, node, VALUE_NUMBER, OP_R_ADD, OP_R_ADD_NUM) : ast_typedOp(ast, node, VALUE_NUMBER, OP_ADD, OP_ADD_NUM);
+      } break;
+    case AST_NODE_SUBTRACT:
+      {
+        return registers ? ast_typedOp(ast, node, VALUE_NUMBER, OP_R_SUBTRACT, OP_R_SUBTRACT_NUM) : ast_typedOp(ast, node, VALUE_NUMBER, OP_SUBTRACT, OP_SUBTRACT_NUM);
+      } break;
+    case AST_NODE_MULTIPLY:
+      {
+        return registers ? ast_typedOp(ast, node, VALUE_NUMBER, OP_R_MULTIPLY, OP_R_MULTIPLY_NUM) : ast_typedOp(ast, node, VALUE_NUMBER, OP_MULTIPLY, OP_MULTIPLY_NUM);
+      } break;
+    case AST_NODE_DIVIDE:
+      {
+        return registers ? ast_typedOp(ast, node, VALUE_NUMBER, OP_R_DIVIDE, OP_R_DIVIDE_NUM) : ast_typedOp(ast, node, VALUE_NUMBER, OP_DIVIDE, OP_DIVIDE_NUM);
+      } break;
+    default:
       {
-        ASTNode* left = node->assignmentDeclaration.left;
-        assert(left->type == AST_NODE_IDENTIFIER);
+        assert(!"ast_binaryOp must be given one of the ast_isStrict operators");
+      } break;
+  }
+
+  return 0;
+}
 
-        ASTNode* right = node->assignmentDeclaration.right;
+// Writes the instructions to push v onto the stack. Small integers and bools
+// are written as immediates, anything else goes through the constant pool.
+void ast_writeConstant(Hunk* hunk, Value v, uint32 pos) {
+  Instruction immediate = 0;
 
-        // write instructions to push right side onto stack
-        if (!ast_writeBytecode(right, hunk, scope)) {
-          return false;
-        }
+  if (hunk_immediate(v, &immediate)) {
+    hunk_write(hunk, VALUE_IS_BOOL(v) ? OP_CONSTANT_BOOL : OP_CONSTANT_INT, pos);
+    hunk_write(hunk, immediate, pos);
 
-        Variable var = {};
-        var.start = left->identifier.token.start;
-        var.len = left->identifier.token.len;
+    return;
+  }
 
-        if (scope_set(scope, &var) == -1) {
-          logf("Variable already exists\n");
+  hunk_write(hunk, OP_CONSTANT, pos);
+  hunk_write(hunk, hunk_addConstant(hunk, v), pos);
+}
 
-          return false;
+// TODO(harrison): properly propogate errors
+// Counts the function declarations for each global in program, before any
+// code is written. Calls can only be resolved when compiling if there is just
+// one function a name could refer to.
+void ast_declareGlobals(AST* ast, ASTNodeId node, Hunk* program) {
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_ROOT:
+      {
+        for (uint32 i = 0; i < ast->data[node].root.count; i++) {
+          ast_declareGlobals(ast, ast_child(ast, node, i), program);
         }
+      } break;
+    case AST_NODE_BLOCK:
+      {
+        ast_declareGlobals(ast, ast->data[node].block.block, program);
+      } break;
+    case AST_NODE_IF:
+      {
+        ast_declareGlobals(ast, ast->data[node].cIf.block, program);
 
-        hunk_write(hunk, OP_SET_LOCAL, node->line);
-        hunk_write(hunk, var.slot, node->line);
+        if (ast->data[node].cIf.elseBlock != AST_NODE_NONE) {
+          ast_declareGlobals(ast, ast->data[node].cIf.elseBlock, program);
+        }
       } break;
     case AST_NODE_FUNCTION_DECLARATION:
       {
-        Token ident = node->functionDeclaration.identifier;
-        Value nameVal = value_make(ident.start, ident.len);
-
-        Hunk* h = (Hunk*) malloc(sizeof(Hunk));
-        hunk_init(h);
-
-        Scope s = {};
-        scope_init(&s);
+        Span ident = ast->data[node].functionDeclaration.identifier;
+        int global = hunk_addGlobal(program, ast_text(ast, ident), ident.len);
 
-        for (psize i = 0; i < array_count(node->functionDeclaration.parameters); i++) {
-          Parameter p = node->functionDeclaration.parameters[i];
-          Variable var = {};
-          var.start = p.identifier.start;
-          var.len = p.identifier.len;
+        program->globals[global].declarations += 1;
 
-          if (scope_set(&s, &var) == -1) {
-            logf("can't set parameter. something weird is happening.\n");
+        ast_declareGlobals(ast, ast_function(ast, node)->block, program);
+      } break;
+    default:
+      {
+        // Declarations are only ever statements.
+      } break;
+  }
+}
 
-            return false;
-          }
+// Counts the uses of each variable into uses, indexed by the node which
+// declares it. names maps variable names to those nodes; parameters map to
+// AST_NODE_NONE, as they keep their slots anyway.
+//
+// NOTE: names are resolved in the same order and the same scopes as
+// code generation resolves them, and each use counted here is exactly one
+// call to scope_use there.
+void ast_countUses(AST* ast, ASTNodeId node, Bindings* names, uint32* uses) {
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_ROOT:
+      {
+        for (uint32 i = 0; i < ast->data[node].root.count; i++) {
+          ast_countUses(ast, ast_child(ast, node, i), names, uses);
         }
+      } break;
+    case AST_NODE_IDENTIFIER:
+      {
+        Span name = ast->data[node].identifier.name;
 
-        if (!ast_writeBytecode(node->functionDeclaration.block, h, &s)) {
-          return false;
+        int decl = AST_NODE_NONE;
+        if (bindings_get(names, string_intern(ast_text(ast, name), name.len), &decl) && decl != AST_NODE_NONE) {
+          uses[decl] += 1;
         }
+      } break;
+    case AST_NODE_ASSIGNMENT:
+      {
+        ast_countUses(ast, ast->data[node].assignment.right, names, uses);
+        ast_countUses(ast, ast->data[node].assignment.left, names, uses);
+      } break;
+    case AST_NODE_ASSIGNMENT_DECLARATION:
+      {
+        // The right hand side can't see the variable being declared.
+        ast_countUses(ast, ast->data[node].assignmentDeclaration.right, names, uses);
 
-        hunk_write(h, OP_RETURN, 0);
-        hunk_write(h, 0, 0);
+        Span name = ast->data[ast->data[node].assignmentDeclaration.left].identifier.name;
+        bindings_add(names, string_intern(ast_text(ast, name), name.len), (int) node);
+      } break;
+    case AST_NODE_FUNCTION_DECLARATION:
+      {
+        ASTFunction* function = ast_function(ast, node);
 
-        Value funcVal = value_make(h);
+        bindings_push(names, true);
 
-        int name = hunk_addConstant(hunk, nameVal);
-        int func = hunk_addConstant(hunk, funcVal);
+        for (uint32 i = 0; i < function->parameterCount; i++) {
+          Span name = ast->parameters[function->firstParameter + i].identifier;
+          bindings_add(names, string_intern(ast_text(ast, name), name.len), AST_NODE_NONE);
+        }
 
-        hunk_write(hunk, OP_CONSTANT, node->line);
-        hunk_write(hunk, name, node->line);
-        hunk_write(hunk, OP_CONSTANT, node->line);
-        hunk_write(hunk, func, node->line);
+        ast_countUses(ast, function->block, names, uses);
 
-        hunk_write(hunk, OP_SET_GLOBAL, node->line);
+        bindings_pop(names);
       } break;
     case AST_NODE_FUNCTION_CALL:
       {
-        // Get all parameters and push them onto stack
-        for (psize i = 0; i < array_count(node->functionCall.args); i++) {
-          ASTNode* arg = &node->functionCall.args[i];
-
-          if (!ast_writeBytecode(arg, hunk, scope)) {
-            return false;
-          }
+        for (uint32 i = 0; i < ast->data[node].functionCall.argCount; i++) {
+          ast_countUses(ast, ast_arg(ast, node, i), names, uses);
         }
-
-        Token ident = node->functionCall.identifier;
-        Value nameVal = value_make(ident.start, ident.len);
-
-        int name = hunk_addConstant(hunk, nameVal);
-        hunk_write(hunk, OP_CONSTANT, node->line);
-        hunk_write(hunk, name, node->line);
-
-        hunk_write(hunk, OP_GET_GLOBAL, node->line);
-
-        hunk_write(hunk, OP_CALL, node->line);
-        hunk_write(hunk, (Instruction) array_count(node->functionCall.args), node->line);
       } break;
     case AST_NODE_IF:
-       {
-        if (!ast_writeBytecode(node->cIf.condition, hunk, scope)) {
-          return false;
-        }
-
-        Scope inner = {};
-        scope_init(&inner, scope);
+      {
+        ast_countUses(ast, ast->data[node].cIf.condition, names, uses);
 
-        hunk_write(hunk, OP_JUMP_IF_FALSE, 0);
-        hunk_write(hunk, 0, 0);
+        bindings_push(names);
+        ast_countUses(ast, ast->data[node].cIf.block, names, uses);
+        bindings_pop(names);
 
-        Instruction nextStatementPos = hunk_getCount(hunk) - 1;
+        if (ast->data[node].cIf.elseBlock != AST_NODE_NONE) {
+          bindings_push(names);
+          ast_countUses(ast, ast->data[node].cIf.elseBlock, names, uses);
+          bindings_pop(names);
+        }
+      } break;
+    case AST_NODE_BLOCK:
+      {
+        bindings_push(names);
+        ast_countUses(ast, ast->data[node].block.block, names, uses);
+        bindings_pop(names);
+      } break;
+    case AST_NODE_RETURN:
+      {
+        ast_countUses(ast, ast->data[node].Return.child, names, uses);
+      } break;
+    case AST_NODE_ADD:
+    case AST_NODE_SUBTRACT:
+    case AST_NODE_MULTIPLY:
+    case AST_NODE_DIVIDE:
+    case AST_NODE_TEST_EQUAL:
+    case AST_NODE_TEST_GREATER:
+    case AST_NODE_TEST_GREATER_EQUAL:
+    case AST_NODE_TEST_LESSER:
+    case AST_NODE_TEST_LESSER_EQUAL:
+    case AST_NODE_TEST_AND:
+    case AST_NODE_TEST_OR:
+      {
+        array(ASTNodeId) spine = ast_leftSpine(ast, node, ast_isBinary);
+        int last = (int) array_count(spine) - 1;
+
+        ast_countUses(ast, ast->data[spine[last]].binary.left, names, uses);
+
+        for (int i = last; i >= 0; i--) {
+          ast_countUses(ast, ast->data[spine[i]].binary.right, names, uses);
+        }
+      } break;
+    default:
+      {
+        // Nothing in it can use a variable.
+      } break;
+  }
+}
+
+// Returns the number of uses of each variable in the program at root, indexed
+// by the node which declares it. Allocated from compiler_arena.
+uint32* ast_findUses(AST* ast, ASTNodeId root) {
+  psize count = array_count(ast->kinds);
+
+  uint32* uses = (uint32*) arena_alloc(compiler_arena, count * sizeof(uint32));
+  memset(uses, 0, count * sizeof(uint32));
+
+  Bindings names = {};
+  bindings_init(&names);
+  bindings_push(&names);
+
+  ast_countUses(ast, root, &names, uses);
+
+  bindings_free(&names);
+
+  return uses;
+}
+
+// Which compare-and-branch instruction node can be written as. Returns false
+// if it isn't a comparison of two numbers.
+bool ast_branchOp(AST* ast, ASTNodeId node, bool registers, Instruction* op) {
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_TEST_EQUAL:         { *op = registers ? OP_R_JUMP_IF_NOT_EQ : OP_JUMP_IF_NOT_EQ; } break;
+    case AST_NODE_TEST_GREATER:       { *op = registers ? OP_R_JUMP_IF_NOT_GT : OP_JUMP_IF_NOT_GT; } break;
+    case AST_NODE_TEST_LESSER:        { *op = registers ? OP_R_JUMP_IF_NOT_LT : OP_JUMP_IF_NOT_LT; } break;
+    case AST_NODE_TEST_GREATER_EQUAL: { *op = registers ? OP_R_JUMP_IF_NOT_GTE : OP_JUMP_IF_NOT_GTE; } break;
+    case AST_NODE_TEST_LESSER_EQUAL:  { *op = registers ? OP_R_JUMP_IF_NOT_LTE : OP_JUMP_IF_NOT_LTE; } break;
+    default:
+      {
+        return false;
+      } break;
+  }
+
+  return ast_isType(ast, ast->data[node].binary.left, VALUE_NUMBER) && ast_isType(ast, ast->data[node].binary.right, VALUE_NUMBER);
+}
+
+// Finishes a conditional jump whose opcode and other operands have been
+// written, and which is taken when its condition doesn't hold. If when is
+// true the branch should be taken when it does hold instead, so it jumps over
+// an OP_JUMP which is taken otherwise.
+//
+// The offset is left for ast_patchJumps, and where it is added to jumps.
+void ast_writeJumpOffset(Hunk* hunk, bool when, array(int)* jumps, uint32 pos) {
+  if (when) {
+    hunk_write(hunk, 2, pos);
+    hunk_write(hunk, OP_JUMP, pos);
+  }
+
+  hunk_write(hunk, 0, pos);
+
+  array_int_add(jumps, hunk_getCount(hunk) - 1);
+}
+
+// Points the jump offset at offset at the next instruction to be written.
+// Returns false if it is too far away for the offset to hold.
+bool ast_patchJump(Hunk* hunk, int offset) {
+  int distance = hunk_getCount(hunk) - 1 - offset;
+
+  if (distance > UINT16_MAX) {
+    logf("ERROR: too much code to jump over\n");
+
+    return false;
+  }
+
+  hunk->code[offset] = (Instruction) distance;
+
+  return true;
+}
+
+// Points every jump offset in jumps at the next instruction to be written.
+bool ast_patchJumps(Hunk* hunk, array(int) jumps) {
+  for (psize i = 0; i < array_count(jumps); i++) {
+    if (!ast_patchJump(hunk, jumps[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
 
-        if (!ast_writeBytecode(node->cIf.block, hunk, &inner)) {
+bool ast_writeBytecode(AST* ast, ASTNodeId node, Hunk* hunk, Scope* scope);
+
+// Writes code which jumps if node evaluates to when, and otherwise carries on
+// to whatever is written next. Where the offsets of the jumps are is added to
+// jumps.
+//
+// The right hand side of && and || is only evaluated if the left doesn't
+// decide the result. Comparisons of numbers jump on the result directly
+// rather than pushing it first.
+bool ast_writeBranch(AST* ast, ASTNodeId node, Hunk* hunk, Scope* scope, bool when, array(int)* jumps) {
+  ASTNodeType kind = ast_kind(ast, node);
+  uint32 pos = ast->positions[node];
+
+  if (kind == AST_NODE_TEST_AND || kind == AST_NODE_TEST_OR) {
+    ASTNodeId left = ast->data[node].binary.left;
+    ASTNodeId right = ast->data[node].binary.right;
+
+    // The value of the left hand side which is the result on its own.
+    bool decides = kind == AST_NODE_TEST_OR;
+
+    // NOTE: either side deciding is enough, so every operand of a
+    // chain like a || b || c branches straight to the same place.
+    if (when == decides) {
+      array(ASTNodeId) spine = ast_leftSpine(ast, node, decides ? ast_isOr : ast_isAnd);
+      int last = (int) array_count(spine) - 1;
+
+      if (!ast_writeBranch(ast, ast->data[spine[last]].binary.left, hunk, scope, when, jumps)) {
+        return false;
+      }
+
+      for (int i = last; i >= 0; i--) {
+        if (!ast_writeBranch(ast, ast->data[spine[i]].binary.right, hunk, scope, when, jumps)) {
           return false;
         }
+      }
+
+      return true;
+    }
+
+    array(int) decided = array_int_initIn(compiler_arena);
+
+    if (!ast_writeBranch(ast, left, hunk, scope, decides, &decided) || !ast_writeBranch(ast, right, hunk, scope, when, jumps)) {
+      return false;
+    }
+
+    return ast_patchJumps(hunk, decided);
+  }
+
+  Instruction op;
+
+  if (ast_branchOp(ast, node, false, &op)) {
+    if (!ast_writeBytecode(ast, ast->data[node].binary.left, hunk, scope) || !ast_writeBytecode(ast, ast->data[node].binary.right, hunk, scope)) {
+      return false;
+    }
 
-        if (node->cIf.elseBlock != 0) {
-          Scope elseInner = {};
-          scope_init(&elseInner, scope);
+    hunk_write(hunk, op, pos);
+  } else {
+    if (!ast_writeBytecode(ast, node, hunk, scope)) {
+      return false;
+    }
 
-          hunk_write(hunk, OP_JUMP, 0);
-          hunk_write(hunk, 0, 0);
+    hunk_write(hunk, OP_JUMP_IF_FALSE, pos);
+  }
 
-          Instruction exitBlockPos = hunk_getCount(hunk) - 1;
+  ast_writeJumpOffset(hunk, when, jumps, pos);
 
-          hunk->code[nextStatementPos] = hunk_getCount(hunk) - 1 - nextStatementPos;
+  return true;
+}
 
-          if (!ast_writeBytecode(node->cIf.elseBlock, hunk, &elseInner)) {
+// Does node leave a value behind, rather than being a statement?
+bool ast_isExpression(AST* ast, ASTNodeId node) {
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_INVALID:
+    case AST_NODE_ROOT:
+    case AST_NODE_DECLARATION:
+    case AST_NODE_ASSIGNMENT:
+    case AST_NODE_ASSIGNMENT_DECLARATION:
+    case AST_NODE_FUNCTION_DECLARATION:
+    case AST_NODE_IF:
+    case AST_NODE_BLOCK:
+    case AST_NODE_LOG:
+    case AST_NODE_RETURN:
+      {
+        return false;
+      } break;
+    default:
+      {
+        return true;
+      } break;
+  }
+}
+
+bool ast_writeBytecode(AST* ast, ASTNodeId node, Hunk* hunk, Scope* scope) {
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_INVALID:
+      {
+        logf("reached an invalid source path\n");
+
+        return false;
+      } break;
+    case AST_NODE_ROOT:
+      {
+        uint32 count = ast->data[node].root.count;
+
+        for (uint32 i = 0; i < count; i++) {
+          ASTNodeId child = ast_child(ast, node, i);
+
+          if (!ast_writeBytecode(ast, child, hunk, scope)) {
             return false;
           }
 
-          Instruction endOfElsePos = hunk_getCount(hunk) - 1;
-          hunk->code[exitBlockPos] = endOfElsePos - exitBlockPos;
-        } else {
-          Instruction ifEndPos = hunk_getCount(hunk) - 1;
+          // The value of an expression statement is dropped once a 'log'
+          // straight after it has printed it, so every path leaves the stack
+          // as it found it.
+          if (ast_isExpression(ast, child)) {
+            if (i + 1 < count && ast_kind(ast, ast_child(ast, node, i + 1)) == AST_NODE_LOG) {
+              i += 1;
+
+              hunk_write(hunk, OP_LOG, ast->positions[ast_child(ast, node, i)]);
+            }
+
+            hunk_write(hunk, OP_POP, ast->positions[child]);
+          }
 
-          hunk->code[nextStatementPos] = ifEndPos - nextStatementPos;
+          scope_freeDead(scope);
+        }
+      } break;
+    case AST_NODE_ASSIGNMENT:
+      {
+        ASTNodeId left = ast->data[node].assignmentDeclaration.left;
+        assert(ast_kind(ast, left) == AST_NODE_IDENTIFIER);
+
+        ASTNodeId right = ast->data[node].assignmentDeclaration.right;
+
+        // write instructions to push right side onto stack
+        if (!ast_writeBytecode(ast, right, hunk, scope)) {
+          return false;
+        }
+
+        int slot = -1;
+        Span name = ast->data[left].identifier.name;
+        if (!scope_use(scope, ast_text(ast, name), name.len, &slot)) {
+          logf("ERROR: variable doesn't exist2!\n");
+
+          return false;
+        }
+
+        hunk_write(hunk, OP_SET_LOCAL, ast->positions[node]);
+        hunk_write(hunk, slot, ast->positions[node]);
+      } break;
+    case AST_NODE_ASSIGNMENT_DECLARATION:
+      {
+        ASTNodeId left = ast->data[node].assignmentDeclaration.left;
+        assert(ast_kind(ast, left) == AST_NODE_IDENTIFIER);
+
+        ASTNodeId right = ast->data[node].assignmentDeclaration.right;
+
+        // write instructions to push right side onto stack
+        if (!ast_writeBytecode(ast, right, hunk, scope)) {
+          return false;
+        }
+
+        Variable var = {};
+        var.start = ast_text(ast, ast->data[left].identifier.name);
+        var.len = ast->data[left].identifier.name.len;
+
+        if (scope_set(scope, &var, scope->uses[node]) == -1) {
+          logf("Variable already exists\n");
+
+          return false;
+        }
+
+        hunk_useSlot(hunk, var.slot);
+
+        hunk_write(hunk, OP_SET_LOCAL, ast->positions[node]);
+        hunk_write(hunk, var.slot, ast->positions[node]);
+      } break;
+    case AST_NODE_FUNCTION_DECLARATION:
+      {
+        Span ident = ast->data[node].functionDeclaration.identifier;
+        ASTFunction* function = ast_function(ast, node);
+
+        Hunk* h = (Hunk*) malloc(sizeof(Hunk));
+        hunk_init(h);
+
+        int global = scope_declareFunction(scope, ast_text(ast, ident), ident.len, h);
+
+        array(int) outer = scope_pushFunction(scope);
+
+        for (uint32 i = 0; i < function->parameterCount; i++) {
+          Parameter p = ast->parameters[function->firstParameter + i];
+          Variable var = {};
+          var.start = ast_text(ast, p.identifier);
+          var.len = p.identifier.len;
+
+          if (scope_set(scope, &var, SCOPE_SLOT_KEEP) == -1) {
+            logf("can't set parameter. something weird is happening.\n");
+
+            return false;
+          }
+
+          hunk_useSlot(h, var.slot);
+        }
+
+        if (!ast_writeBytecode(ast, function->block, h, scope)) {
+          return false;
+        }
+
+        scope_popFunction(scope, outer);
+
+        hunk_write(h, OP_RETURN, 0);
+        hunk_write(h, 0, 0);
+
+        int func = hunk_addConstant(hunk, value_make(h));
+
+        hunk_write(hunk, OP_CONSTANT, ast->positions[node]);
+        hunk_write(hunk, func, ast->positions[node]);
+
+        hunk_write(hunk, OP_SET_GLOBAL, ast->positions[node]);
+        hunk_write(hunk, global, ast->positions[node]);
+      } break;
+    case AST_NODE_FUNCTION_CALL:
+      {
+        // Get all parameters and push them onto stack
+        for (uint32 i = 0; i < ast->data[node].functionCall.argCount; i++) {
+          ASTNodeId arg = ast_arg(ast, node, i);
+
+          if (!ast_writeBytecode(ast, arg, hunk, scope)) {
+            return false;
+          }
+        }
+
+        Span ident = ast->data[node].functionCall.identifier;
+        int global = scope_getGlobal(scope, ast_text(ast, ident), ident.len);
+        Instruction arity = (Instruction) ast->data[node].functionCall.argCount;
+
+        if (scope_isDirect(scope, global)) {
+          hunk_write(hunk, OP_CALL_DIRECT, ast->positions[node]);
+          hunk_write(hunk, global, ast->positions[node]);
+          hunk_write(hunk, arity, ast->positions[node]);
+
+          break;
+        }
+
+        hunk_write(hunk, OP_GET_GLOBAL, ast->positions[node]);
+        hunk_write(hunk, global, ast->positions[node]);
+
+        hunk_write(hunk, OP_CALL, ast->positions[node]);
+        hunk_write(hunk, arity, ast->positions[node]);
+      } break;
+    case AST_NODE_IF:
+       {
+        array(int) skipBlock = array_int_initIn(compiler_arena);
+
+        if (!ast_writeBranch(ast, ast->data[node].cIf.condition, hunk, scope, false, &skipBlock)) {
+          return false;
+        }
+
+        scope_push(scope);
+
+        if (!ast_writeBytecode(ast, ast->data[node].cIf.block, hunk, scope)) {
+          return false;
+        }
+
+        scope_pop(scope);
+
+        if (ast->data[node].cIf.elseBlock != AST_NODE_NONE) {
+          scope_push(scope);
+
+          hunk_write(hunk, OP_JUMP, ast->positions[node]);
+          hunk_write(hunk, 0, ast->positions[node]);
+
+          int exitBlock = hunk_getCount(hunk) - 1;
+
+          if (!ast_patchJumps(hunk, skipBlock)) {
+            return false;
+          }
+
+          if (!ast_writeBytecode(ast, ast->data[node].cIf.elseBlock, hunk, scope)) {
+            return false;
+          }
+
+          scope_pop(scope);
+
+          if (!ast_patchJump(hunk, exitBlock)) {
+            return false;
+          }
+        } else if (!ast_patchJumps(hunk, skipBlock)) {
+          return false;
         }
        } break;
+    case AST_NODE_BLOCK:
+      {
+        scope_push(scope);
+
+        if (!ast_writeBytecode(ast, ast->data[node].block.block, hunk, scope)) {
+          return false;
+        }
+
+        scope_pop(scope);
+      } break;
     case AST_NODE_NUMBER:
       {
-        int constant = hunk_addConstant(hunk, value_make((float) node->number.number));
-        hunk_write(hunk, OP_CONSTANT, node->line);
-        hunk_write(hunk, constant, node->line);
+        ast_writeConstant(hunk, value_make((double) ast->data[node].number.number), ast->positions[node]);
       } break;
     case AST_NODE_VALUE:
       {
-        int constant = hunk_addConstant(hunk, node->value.val);
-        hunk_write(hunk, OP_CONSTANT, node->line);
-        hunk_write(hunk, constant, node->line);
+        ast_writeConstant(hunk, ast_value(ast, node), ast->positions[node]);
       } break;
     case AST_NODE_IDENTIFIER:
       {
         int slot = -1;
-        if (!scope_get(scope, node->identifier.token.start, node->identifier.token.len, &slot)) {
+        Span name = ast->data[node].identifier.name;
+        if (!scope_use(scope, ast_text(ast, name), name.len, &slot)) {
           logf("ERROR: variable doesn't exist1!\n");
 
           return false;
         }
 
-        hunk_write(hunk, OP_GET_LOCAL, node->line);
-        hunk_write(hunk, slot, node->line);
+        hunk_write(hunk, OP_GET_LOCAL, ast->positions[node]);
+        hunk_write(hunk, slot, ast->positions[node]);
       } break;
-#define BINARY_POP() \
-       do { \
-         ASTNode* left = node->binary.left; \
-         ASTNode* right = node->binary.right; \
-         if (!ast_writeBytecode(left, hunk, scope)) { \
-           return false; \
-         } \
-         if (!ast_writeBytecode(right, hunk, scope)) { \
-           return false; \
-         } \
-       } while (false);
     case AST_NODE_TEST_EQUAL:
+    case AST_NODE_TEST_GREATER:
+    case AST_NODE_TEST_LESSER:
+    case AST_NODE_TEST_GREATER_EQUAL:
+    case AST_NODE_TEST_LESSER_EQUAL:
+    case AST_NODE_ADD:
+    case AST_NODE_SUBTRACT:
+    case AST_NODE_MULTIPLY:
+    case AST_NODE_DIVIDE:
       {
-        BINARY_POP();
+        // See ast_leftSpine. The bottom operand is pushed first, then each
+        // operator up the chain pushes its right hand side and combines them.
+        array(ASTNodeId) spine = ast_leftSpine(ast, node, ast_isStrict);
+        int last = (int) array_count(spine) - 1;
+
+        if (!ast_writeBytecode(ast, ast->data[spine[last]].binary.left, hunk, scope)) {
+          return false;
+        }
+
+        for (int i = last; i >= 0; i--) {
+          if (!ast_writeBytecode(ast, ast->data[spine[i]].binary.right, hunk, scope)) {
+            return false;
+          }
 
-        hunk_write(hunk, OP_TEST_EQ, node->line);
+          hunk_write(hunk, ast_binaryOp(ast, spine[i], false), ast->positions[spine[i]]);
+        }
       } break;
-    case AST_NODE_TEST_GREATER:
+    case AST_NODE_TEST_AND:
+    case AST_NODE_TEST_OR:
+      {
+        // If the left hand side decides the result, that is pushed instead
+        // of evaluating the right.
+        bool decides = ast_kind(ast, node) == AST_NODE_TEST_OR;
+        array(int) decided = array_int_initIn(compiler_arena);
+
+        if (!ast_writeBranch(ast, ast->data[node].binary.left, hunk, scope, decides, &decided)) {
+          return false;
+        }
+
+        if (!ast_writeBytecode(ast, ast->data[node].binary.right, hunk, scope)) {
+          return false;
+        }
+
+        hunk_write(hunk, OP_JUMP, ast->positions[node]);
+        hunk_write(hunk, 0, ast->positions[node]);
+
+        int end = hunk_getCount(hunk) - 1;
+
+        if (!ast_patchJumps(hunk, decided)) {
+          return false;
+        }
+
+        ast_writeConstant(hunk, value_make(decides), ast->positions[node]);
+
+        if (!ast_patchJump(hunk, end)) {
+          return false;
+        }
+      } break;
+    case AST_NODE_LOG:
       {
-        BINARY_POP();
+        logf("ERROR: nothing to log\n");
 
-        hunk_write(hunk, OP_TEST_GT, node->line);
+        return false;
       } break;
-    case AST_NODE_TEST_LESSER:
+    case AST_NODE_RETURN:
       {
-        BINARY_POP();
+        if (!ast_writeBytecode(ast, ast->data[node].Return.child, hunk, scope)) {
+          return false;
+        }
 
-        hunk_write(hunk, OP_TEST_LT, node->line);
+        hunk_write(hunk, OP_RETURN, ast->positions[node]);
+        hunk_write(hunk, 1, ast->positions[node]);
       } break;
-    case AST_NODE_TEST_GREATER_EQUAL:
+    default:
+      {
+        logf("ERROR: Don't know how to get bytecode from node type %d\n", ast_kind(ast, node));
+
+        return false;
+      }
+  }
+
+  return true;
+}
+
+// Register counterpart to ast_writeConstant, which loads v into slot target.
+void ast_writeRegisterConstant(Hunk* hunk, int target, Value v, uint32 pos) {
+  Instruction immediate = 0;
+
+  if (hunk_immediate(v, &immediate)) {
+    hunk_write(hunk, VALUE_IS_BOOL(v) ? OP_R_CONSTANT_BOOL : OP_R_CONSTANT_INT, pos);
+    hunk_write(hunk, target, pos);
+    hunk_write(hunk, immediate, pos);
+
+    return;
+  }
+
+  hunk_write(hunk, OP_R_CONSTANT, pos);
+  hunk_write(hunk, target, pos);
+  hunk_write(hunk, hunk_addConstant(hunk, v), pos);
+}
+
+// Writes the value in slot from into slot to, if they differ.
+void ast_writeRegisterMove(Hunk* hunk, int to, int from, uint32 pos) {
+  if (to == from) {
+    return;
+  }
+
+  hunk_useSlot(hunk, to);
+
+  hunk_write(hunk, OP_R_MOVE, pos);
+  hunk_write(hunk, to, pos);
+  hunk_write(hunk, from, pos);
+}
+
+bool ast_writeRegisterExpression(AST* ast, ASTNodeId node, Hunk* hunk, Scope* scope, int target, int top, int* out);
+
+// Register counterpart to ast_writeBranch. Slots from top upwards may be used
+// as scratch space.
+bool ast_writeRegisterBranch(AST* ast, ASTNodeId node, Hunk* hunk, Scope* scope, int top, bool when, array(int)* jumps) {
+  ASTNodeType kind = ast_kind(ast, node);
+  uint32 pos = ast->positions[node];
+
+  if (kind == AST_NODE_TEST_AND || kind == AST_NODE_TEST_OR) {
+    ASTNodeId left = ast->data[node].binary.left;
+    ASTNodeId right = ast->data[node].binary.right;
+
+    bool decides = kind == AST_NODE_TEST_OR;
+
+    if (when == decides) {
+      array(ASTNodeId) spine = ast_leftSpine(ast, node, decides ? ast_isOr : ast_isAnd);
+      int last = (int) array_count(spine) - 1;
+
+      if (!ast_writeRegisterBranch(ast, ast->data[spine[last]].binary.left, hunk, scope, top, when, jumps)) {
+        return false;
+      }
+
+      for (int i = last; i >= 0; i--) {
+        if (!ast_writeRegisterBranch(ast, ast->data[spine[i]].binary.right, hunk, scope, top, when, jumps)) {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    array(int) decided = array_int_initIn(compiler_arena);
+
+    if (!ast_writeRegisterBranch(ast, left, hunk, scope, top, decides, &decided) || !ast_writeRegisterBranch(ast, right, hunk, scope, top, when, jumps)) {
+      return false;
+    }
+
+    return ast_patchJumps(hunk, decided);
+  }
+
+  Instruction op;
+
+  if (ast_branchOp(ast, node, true, &op)) {
+    int left = -1;
+    int right = -1;
+
+    if (!ast_writeRegisterExpression(ast, ast->data[node].binary.left, hunk, scope, top, top + 1, &left)) {
+      return false;
+    }
+
+    if (!ast_writeRegisterExpression(ast, ast->data[node].binary.right, hunk, scope, top + 1, top + 2, &right)) {
+      return false;
+    }
+
+    hunk_write(hunk, op, pos);
+    hunk_write(hunk, left, pos);
+    hunk_write(hunk, right, pos);
+  } else {
+    int condition = -1;
+
+    if (!ast_writeRegisterExpression(ast, node, hunk, scope, top, top + 1, &condition)) {
+      return false;
+    }
+
+    hunk_write(hunk, OP_R_JUMP_IF_FALSE, pos);
+    hunk_write(hunk, condition, pos);
+  }
+
+  ast_writeJumpOffset(hunk, when, jumps, pos);
+
+  return true;
+}
+
+// NOTE: The register emitter treats frame slots as registers. Slots
+// below scope_getTop hold variables, or are free slots between them; every
+// slot from there up is free for temporary values while a statement is being
+// evaluated.
+//
+// ast_writeRegisterExpression evaluates node and reports the slot holding the
+// result in out. If the result has to be computed it is written to target,
+// otherwise (ie. for a variable) out is the variable's own slot and no code is
+// written. Slots from top upwards may be used as scratch space.
+bool ast_writeRegisterExpression(AST* ast, ASTNodeId node, Hunk* hunk, Scope* scope, int target, int top, int* out) {
+  // NOTE: the highest slot used is always top + 1 (for the right
+  // hand side of a binary operation) or an argument slot below top.
+  if (target >= VM_LOCALS_MAX || top + 1 >= VM_LOCALS_MAX) {
+    logf("ERROR: expression needs more than %d registers\n", VM_LOCALS_MAX);
+
+    return false;
+  }
+
+  hunk_useSlot(hunk, target);
+
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_NUMBER:
+      {
+        ast_writeRegisterConstant(hunk, target, value_make((double) ast->data[node].number.number), ast->positions[node]);
+
+        *out = target;
+      } break;
+    case AST_NODE_VALUE:
+      {
+        ast_writeRegisterConstant(hunk, target, ast_value(ast, node), ast->positions[node]);
+
+        *out = target;
+      } break;
+    case AST_NODE_IDENTIFIER:
       {
-        BINARY_POP();
+        int slot = -1;
+        Span name = ast->data[node].identifier.name;
+        if (!scope_use(scope, ast_text(ast, name), name.len, &slot)) {
+          logf("ERROR: variable doesn't exist1!\n");
 
-        hunk_write(hunk, OP_TEST_GTE, node->line);
+          return false;
+        }
+
+        *out = slot;
       } break;
+    case AST_NODE_FUNCTION_CALL:
+      {
+        // Arguments go into consecutive slots starting at top, which then
+        // become the first slots of the called function.
+        int arity = (int) ast->data[node].functionCall.argCount;
+
+        if (top + arity >= VM_LOCALS_MAX) {
+          logf("ERROR: call needs more than %d registers\n", VM_LOCALS_MAX);
+
+          return false;
+        }
+
+        for (int i = 0; i < arity; i++) {
+          ASTNodeId arg = ast_arg(ast, node, i);
+          int argSlot = top + i;
+
+          int result = -1;
+          if (!ast_writeRegisterExpression(ast, arg, hunk, scope, argSlot, argSlot + 1, &result)) {
+            return false;
+          }
+
+          if (result != argSlot) {
+            hunk_write(hunk, OP_R_MOVE, ast->positions[node]);
+            hunk_write(hunk, argSlot, ast->positions[node]);
+            hunk_write(hunk, result, ast->positions[node]);
+          }
+        }
+
+        Span ident = ast->data[node].functionCall.identifier;
+        int global = scope_getGlobal(scope, ast_text(ast, ident), ident.len);
+
+        if (scope_isDirect(scope, global)) {
+          hunk_write(hunk, OP_R_CALL_DIRECT, ast->positions[node]);
+          hunk_write(hunk, target, ast->positions[node]);
+          hunk_write(hunk, global, ast->positions[node]);
+          hunk_write(hunk, top, ast->positions[node]);
+        } else {
+          hunk_write(hunk, OP_R_CALL, ast->positions[node]);
+          hunk_write(hunk, target, ast->positions[node]);
+          hunk_write(hunk, global, ast->positions[node]);
+          hunk_write(hunk, arity, ast->positions[node]);
+          hunk_write(hunk, top, ast->positions[node]);
+        }
+
+        *out = target;
+      } break;
+    case AST_NODE_TEST_EQUAL:
+    case AST_NODE_TEST_GREATER:
+    case AST_NODE_TEST_LESSER:
+    case AST_NODE_TEST_GREATER_EQUAL:
     case AST_NODE_TEST_LESSER_EQUAL:
+    case AST_NODE_ADD:
+    case AST_NODE_SUBTRACT:
+    case AST_NODE_MULTIPLY:
+    case AST_NODE_DIVIDE:
       {
-        BINARY_POP();
+        // NOTE: the left hand side is computed straight into target
+        // unless it is a variable, which the right hand side might still read.
+        // Down a chain like a + 1 + 2 + 3 (see ast_leftSpine) every operator
+        // but the last one works in leftTarget, so it needs the same two
+        // slots however long it is.
+        array(ASTNodeId) spine = ast_leftSpine(ast, node, ast_isStrict);
+        int last = (int) array_count(spine) - 1;
+
+        int leftTarget = target;
+        int scratch = target >= top ? target + 1 : top;
+
+        if (!scope_isFree(scope, target)) {
+          leftTarget = top;
+          scratch = top + 1;
+        }
+
+        int left = -1;
+        if (!ast_writeRegisterExpression(ast, ast->data[spine[last]].binary.left, hunk, scope, leftTarget, scratch, &left)) {
+          return false;
+        }
+
+        for (int i = last; i >= 0; i--) {
+          int right = -1;
+          if (!ast_writeRegisterExpression(ast, ast->data[spine[i]].binary.right, hunk, scope, scratch, scratch + 1, &right)) {
+            return false;
+          }
+
+          int result = i == 0 ? target : leftTarget;
+          uint32 pos = ast->positions[spine[i]];
+
+          hunk_write(hunk, ast_binaryOp(ast, spine[i], true), pos);
+          hunk_write(hunk, result, pos);
+          hunk_write(hunk, left, pos);
+          hunk_write(hunk, right, pos);
 
-        hunk_write(hunk, OP_TEST_LTE, node->line);
+          left = result;
+        }
+
+        *out = target;
       } break;
     case AST_NODE_TEST_AND:
+    case AST_NODE_TEST_OR:
       {
-        BINARY_POP();
+        // See ast_writeBytecode. Each path writes target once, at its end.
+        bool decides = ast_kind(ast, node) == AST_NODE_TEST_OR;
+        array(int) decided = array_int_initIn(compiler_arena);
+
+        if (!ast_writeRegisterBranch(ast, ast->data[node].binary.left, hunk, scope, top, decides, &decided)) {
+          return false;
+        }
+
+        int right = -1;
+        if (!ast_writeRegisterExpression(ast, ast->data[node].binary.right, hunk, scope, target, top, &right)) {
+          return false;
+        }
+
+        ast_writeRegisterMove(hunk, target, right, ast->positions[node]);
+
+        hunk_write(hunk, OP_JUMP, ast->positions[node]);
+        hunk_write(hunk, 0, ast->positions[node]);
+
+        int end = hunk_getCount(hunk) - 1;
+
+        if (!ast_patchJumps(hunk, decided)) {
+          return false;
+        }
+
+        ast_writeRegisterConstant(hunk, target, value_make(decides), ast->positions[node]);
 
-        hunk_write(hunk, OP_TEST_AND, node->line);
+        if (!ast_patchJump(hunk, end)) {
+          return false;
+        }
+
+        *out = target;
       } break;
-    case AST_NODE_TEST_OR:
+    default:
       {
-        BINARY_POP();
+        logf("ERROR: Don't know how to get a register from node type %d\n", ast_kind(ast, node));
+
+        return false;
+      }
+  }
+
+  return true;
+}
 
-        hunk_write(hunk, OP_TEST_OR, node->line);
+// Register counterpart to ast_writeBytecode. Statements are the same, but
+// expressions are evaluated with ast_writeRegisterExpression.
+//
+// 'log' prints the value of the expression statement directly before it.
+bool ast_writeRegisterBytecode(AST* ast, ASTNodeId node, Hunk* hunk, Scope* scope) {
+  int top = scope_getTop(scope);
+
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_INVALID:
+      {
+        logf("reached an invalid source path\n");
+
+        return false;
       } break;
-    case AST_NODE_ADD:
+    case AST_NODE_ROOT:
       {
-        BINARY_POP();
+        int lastExpression = -1;
+
+        for (uint32 i = 0; i < ast->data[node].root.count; i++) {
+          ASTNodeId child = ast_child(ast, node, i);
+
+          // NOTE: this is after the statement before, rather than
+          // after each statement, as expression statements continue straight
+          // on to the next one.
+          scope_freeDead(scope);
+
+          switch (ast_kind(ast, child)) {
+            case AST_NODE_LOG:
+              {
+                if (lastExpression == -1) {
+                  logf("ERROR: nothing to log\n");
+
+                  return false;
+                }
+
+                hunk_write(hunk, OP_R_LOG, ast->positions[child]);
+                hunk_write(hunk, lastExpression, ast->positions[child]);
+              } break;
+            case AST_NODE_IDENTIFIER:
+            case AST_NODE_FUNCTION_CALL:
+              {
+                int next = scope_getNextSlot(scope);
+
+                if (!ast_writeRegisterExpression(ast, child, hunk, scope, next, scope_getScratch(scope, next), &lastExpression)) {
+                  return false;
+                }
+
+                continue;
+              } break;
+            default:
+              {
+                if (!ast_writeRegisterBytecode(ast, child, hunk, scope)) {
+                  return false;
+                }
+              } break;
+          }
 
-        hunk_write(hunk, OP_ADD, node->line);
+          lastExpression = -1;
+        }
       } break;
-    case AST_NODE_SUBTRACT:
+    case AST_NODE_ASSIGNMENT:
       {
-        BINARY_POP();
+        ASTNodeId left = ast->data[node].assignment.left;
+        assert(ast_kind(ast, left) == AST_NODE_IDENTIFIER);
 
-        hunk_write(hunk, OP_SUBTRACT, node->line);
+        int slot = -1;
+        Span name = ast->data[left].identifier.name;
+        if (!scope_use(scope, ast_text(ast, name), name.len, &slot)) {
+          logf("ERROR: variable doesn't exist2!\n");
+
+          return false;
+        }
+
+        // NOTE: only the last instruction of the right hand side
+        // writes to target, so it is safe for it to read the variable too.
+        int result = -1;
+        if (!ast_writeRegisterExpression(ast, ast->data[node].assignment.right, hunk, scope, slot, top, &result)) {
+          return false;
+        }
+
+        ast_writeRegisterMove(hunk, slot, result, ast->positions[node]);
       } break;
-    case AST_NODE_MULTIPLY:
+    case AST_NODE_ASSIGNMENT_DECLARATION:
       {
-        BINARY_POP();
+        ASTNodeId left = ast->data[node].assignmentDeclaration.left;
+        assert(ast_kind(ast, left) == AST_NODE_IDENTIFIER);
+
+        // The variable will be given the next free slot once it is declared,
+        // so the right hand side can be computed straight into it. Nothing
+        // still to be used is in that slot.
+        int slot = scope_getNextSlot(scope);
+
+        int result = -1;
+        if (!ast_writeRegisterExpression(ast, ast->data[node].assignmentDeclaration.right, hunk, scope, slot, scope_getScratch(scope, slot), &result)) {
+          return false;
+        }
+
+        Variable var = {};
+        var.start = ast_text(ast, ast->data[left].identifier.name);
+        var.len = ast->data[left].identifier.name.len;
+
+        if (scope_set(scope, &var, scope->uses[node]) == -1) {
+          logf("Variable already exists\n");
+
+          return false;
+        }
+
+        assert(var.slot == slot);
 
-        hunk_write(hunk, OP_MULTIPLY, node->line);
+        ast_writeRegisterMove(hunk, var.slot, result, ast->positions[node]);
       } break;
-    case AST_NODE_DIVIDE:
+    case AST_NODE_FUNCTION_DECLARATION:
       {
-        BINARY_POP();
+        Span ident = ast->data[node].functionDeclaration.identifier;
+        ASTFunction* function = ast_function(ast, node);
+
+        Hunk* h = (Hunk*) malloc(sizeof(Hunk));
+        hunk_init(h, BYTECODE_REGISTER);
+
+        int global = scope_declareFunction(scope, ast_text(ast, ident), ident.len, h);
+
+        array(int) outer = scope_pushFunction(scope);
+
+        for (uint32 i = 0; i < function->parameterCount; i++) {
+          Parameter p = ast->parameters[function->firstParameter + i];
+          Variable var = {};
+          var.start = ast_text(ast, p.identifier);
+          var.len = p.identifier.len;
+
+          if (scope_set(scope, &var, SCOPE_SLOT_KEEP) == -1) {
+            logf("can't set parameter. something weird is happening.\n");
+
+            return false;
+          }
+
+          hunk_useSlot(h, var.slot);
+        }
 
-        hunk_write(hunk, OP_DIVIDE, node->line);
+        if (!ast_writeRegisterBytecode(ast, function->block, h, scope)) {
+          return false;
+        }
+
+        scope_popFunction(scope, outer);
+
+        hunk_write(h, OP_R_RETURN, 0);
+        hunk_write(h, 0, 0);
+        hunk_write(h, 0, 0);
+
+        int func = hunk_addConstant(hunk, value_make(h));
+
+        hunk_write(hunk, OP_R_SET_GLOBAL, ast->positions[node]);
+        hunk_write(hunk, global, ast->positions[node]);
+        hunk_write(hunk, func, ast->positions[node]);
       } break;
-#undef BINARY_POP
-    case AST_NODE_LOG:
+    case AST_NODE_IF:
+      {
+        array(int) skipBlock = array_int_initIn(compiler_arena);
+
+        if (!ast_writeRegisterBranch(ast, ast->data[node].cIf.condition, hunk, scope, top, false, &skipBlock)) {
+          return false;
+        }
+
+        scope_push(scope);
+
+        if (!ast_writeRegisterBytecode(ast, ast->data[node].cIf.block, hunk, scope)) {
+          return false;
+        }
+
+        scope_pop(scope);
+
+        if (ast->data[node].cIf.elseBlock != AST_NODE_NONE) {
+          scope_push(scope);
+
+          hunk_write(hunk, OP_JUMP, ast->positions[node]);
+          hunk_write(hunk, 0, ast->positions[node]);
+
+          int exitBlock = hunk_getCount(hunk) - 1;
+
+          if (!ast_patchJumps(hunk, skipBlock)) {
+            return false;
+          }
+
+          if (!ast_writeRegisterBytecode(ast, ast->data[node].cIf.elseBlock, hunk, scope)) {
+            return false;
+          }
+
+          scope_pop(scope);
+
+          if (!ast_patchJump(hunk, exitBlock)) {
+            return false;
+          }
+        } else if (!ast_patchJumps(hunk, skipBlock)) {
+          return false;
+        }
+      } break;
+    case AST_NODE_BLOCK:
       {
-        hunk_write(hunk, OP_LOG, node->line);
+        scope_push(scope);
+
+        if (!ast_writeRegisterBytecode(ast, ast->data[node].block.block, hunk, scope)) {
+          return false;
+        }
+
+        scope_pop(scope);
       } break;
     case AST_NODE_RETURN:
       {
-        if (!ast_writeBytecode(node->Return.child, hunk, scope)) {
+        int result = -1;
+        if (!ast_writeRegisterExpression(ast, ast->data[node].Return.child, hunk, scope, top, top + 1, &result)) {
           return false;
         }
 
-        hunk_write(hunk, OP_RETURN, node->line);
-        hunk_write(hunk, 1, node->line);
+        hunk_write(hunk, OP_R_RETURN, ast->positions[node]);
+        hunk_write(hunk, 1, ast->positions[node]);
+        hunk_write(hunk, result, ast->positions[node]);
       } break;
-    default:
+    case AST_NODE_LOG:
       {
-        logf("ERROR: Don't know how to get bytecode from node type %d\n", node->type);
+        logf("ERROR: nothing to log\n");
 
         return false;
+      } break;
+    default:
+      {
+        // Anything else is an expression whose value isn't used.
+        int result = -1;
+        if (!ast_writeRegisterExpression(ast, node, hunk, scope, top, top + 1, &result)) {
+          return false;
+        }
       }
   }
 
@@ -0,0 +1,662 @@
+#include <loaf.cpp>
+
+#include <time.h> // clock_gettime
+
+// Benchmarks for the interpreter. Every benchmark compiles its programs once
+// and then times repeated runs of the same Hunk, so only the part being
+// measured changes between results.
+//
+// Usage:
+//
+// loaf-bench dispatch [-n iterations] file.ls...
+// loaf-bench optimize [-n iterations] file.ls...
+// loaf-bench profile file.ls... (needs a build with VM_PROFILE defined)
+// loaf-bench table [-n iterations]
+// loaf-bench lex [-n iterations]
+
+#define BENCH_DEFAULT_ITERATIONS (20)
+
+uint64 bench_now() {
+  timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((uint64) ts.tv_sec) * 1000000000 + (uint64) ts.tv_nsec;
+}
+
+// Runs hunk iterations times with the given dispatch mode. Returns the
+// average time of a run in nanoseconds, or 0 if the program failed.
+uint64 bench_runHunk(Hunk* hunk, VMDispatch dispatch, int iterations) {
+  static VM vm = {};
+
+  uint64 total = 0;
+
+  for (int i = 0; i < iterations; i++) {
+    if (!vm_load(&vm, hunk)) {
+      return 0;
+    }
+
+    uint64 start = bench_now();
+    ProgramResult res = vm_runWith(&vm, dispatch);
+    total += bench_now() - start;
+
+    vm_free(&vm);
+
+    if (res != PROGRAM_RESULT_OK) {
+      logf("ERROR: program failed during benchmark\n");
+
+      return 0;
+    }
+  }
+
+  return total / iterations;
+}
+
+// Times hunk under each dispatch mode. baseline is the time to compare the
+// switch mode against; pass 0 to compare against this hunk's own switch time.
+// Returns the switch time, or 0 on failure.
+uint64 bench_dispatchModes(Hunk* hunk, int iterations, uint64 baseline) {
+  uint64 switchTime = bench_runHunk(hunk, VM_DISPATCH_SWITCH, iterations);
+  if (switchTime == 0) {
+    return 0;
+  }
+
+  if (baseline == 0) {
+    baseline = switchTime;
+  }
+
+  printf("    %-10s %10.3f ms/run (%.2fx)\n", "switch", switchTime / 1000000.0, (double) baseline / switchTime);
+
+#ifdef VM_COMPUTED_GOTO
+  uint64 threadedTime = bench_runHunk(hunk, VM_DISPATCH_THREADED, iterations);
+  if (threadedTime == 0) {
+    return 0;
+  }
+
+  printf("    %-10s %10.3f ms/run (%.2fx)\n", "threaded", threadedTime / 1000000.0, (double) baseline / threadedTime);
+#else
+  printf("    %-10s not available in this build\n", "threaded");
+#endif
+
+  return switchTime;
+}
+
+// Compiles path to both the stack and register instruction sets and times
+// each under every dispatch mode. Speedups are relative to the stack VM with
+// switch dispatch.
+bool bench_dispatch(const char* path, int iterations) {
+  psize mapped = 0;
+  char* source = loaf_mapFile(path, &mapped);
+  if (source == 0) {
+    return false;
+  }
+
+  Hunk stack = {};
+  Hunk registers = {};
+
+  bool compiled = loaf_compile(source, &stack, BYTECODE_STACK) && loaf_compile(source, &registers, BYTECODE_REGISTER);
+
+  loaf_unmapFile(source, mapped);
+
+  if (!compiled) {
+    return false;
+  }
+
+  printf("%s (%d iterations)\n", path, iterations);
+
+  printf("  stack (%d instructions)\n", hunk_countInstructions(&stack));
+
+  uint64 baseline = bench_dispatchModes(&stack, iterations, 0);
+  if (baseline == 0) {
+    return false;
+  }
+
+  printf("  register (%d instructions)\n", hunk_countInstructions(&registers));
+
+  if (bench_dispatchModes(&registers, iterations, baseline) == 0) {
+    return false;
+  }
+
+  return true;
+}
+
+// Compiles path with and without the peephole optimizer and reports the
+// instruction counts and run times of each, for both instruction sets.
+bool bench_optimize(const char* path, int iterations) {
+  psize mapped = 0;
+  char* source = loaf_mapFile(path, &mapped);
+  if (source == 0) {
+    return false;
+  }
+
+  BytecodeFormat formats[] = { BYTECODE_STACK, BYTECODE_REGISTER };
+  const char* names[] = { "stack", "register" };
+
+  Hunk plain[2] = {};
+  Hunk optimized[2] = {};
+
+  bool compiled = true;
+
+  for (int i = 0; i < 2 && compiled; i++) {
+    compiled = loaf_compile(source, &plain[i], formats[i], false) && loaf_compile(source, &optimized[i], formats[i], true);
+  }
+
+  loaf_unmapFile(source, mapped);
+
+  if (!compiled) {
+    return false;
+  }
+
+  printf("%s (%d iterations)\n", path, iterations);
+
+  for (int i = 0; i < 2; i++) {
+
+    uint64 plainTime = bench_runHunk(&plain[i], VM_DISPATCH_DEFAULT, iterations);
+    uint64 optimizedTime = bench_runHunk(&optimized[i], VM_DISPATCH_DEFAULT, iterations);
+
+    if (plainTime == 0 || optimizedTime == 0) {
+      return false;
+    }
+
+    printf("  %s\n", names[i]);
+    printf("    %-10s %5d instructions %10.3f ms/run (1.00x)\n", "plain", hunk_countInstructions(&plain[i]), plainTime / 1000000.0);
+    printf("    %-10s %5d instructions %10.3f ms/run (%.2fx)\n", "optimized", hunk_countInstructions(&optimized[i]), optimizedTime / 1000000.0, (double) plainTime / optimizedTime);
+  }
+
+  return true;
+}
+
+#ifdef VM_PROFILE
+#define BENCH_PROFILE_TOP (10)
+
+// A run of instructions and how many times it ran.
+struct BenchSequence {
+  Instruction ops[3];
+  int count;
+
+  uint64 runs;
+};
+
+// Adds sequence to top, which holds the most common sequences seen so far,
+// most common first.
+void bench_profileKeep(BenchSequence* top, BenchSequence sequence) {
+  for (int i = 0; i < BENCH_PROFILE_TOP; i++) {
+    if (sequence.runs <= top[i].runs) {
+      continue;
+    }
+
+    BenchSequence bumped = top[i];
+    top[i] = sequence;
+    sequence = bumped;
+  }
+}
+
+void bench_profilePrint(const char* title, BenchSequence* top, uint64 dispatches) {
+  printf("    %s\n", title);
+
+  for (int i = 0; i < BENCH_PROFILE_TOP && top[i].runs > 0; i++) {
+    printf("      %10llu (%5.2f%%) ", (unsigned long long) top[i].runs, 100.0 * top[i].runs / dispatches);
+
+    for (int j = 0; j < top[i].count; j++) {
+      printf(" %s", opcode_name(top[i].ops[j]));
+    }
+
+    printf("\n");
+  }
+}
+
+// Runs hunk once, counting the instructions it dispatches. Prints the pairs
+// and triples of instructions which run most often, and how many dispatches
+// each superinstruction saved.
+bool bench_profileHunk(Hunk* hunk) {
+  memset(&vm_profile, 0, sizeof(vm_profile));
+
+  if (bench_runHunk(hunk, VM_DISPATCH_SWITCH, 1) == 0) {
+    return false;
+  }
+
+  uint64 dispatches = 0;
+
+  for (int a = 0; a < OP_COUNT; a++) {
+    dispatches += vm_profile.ops[a];
+  }
+
+  BenchSequence pairs[BENCH_PROFILE_TOP] = {};
+  BenchSequence triples[BENCH_PROFILE_TOP] = {};
+
+  for (int a = 0; a < OP_COUNT; a++) {
+    for (int b = 0; b < OP_COUNT; b++) {
+      BenchSequence pair = { { (Instruction) a, (Instruction) b }, 2, vm_profile.pairs[a][b] };
+      bench_profileKeep(pairs, pair);
+
+      for (int c = 0; c < OP_COUNT; c++) {
+        BenchSequence triple = { { (Instruction) a, (Instruction) b, (Instruction) c }, 3, vm_profile.triples[a][b][c] };
+        bench_profileKeep(triples, triple);
+      }
+    }
+  }
+
+  printf("    %llu dispatches\n", (unsigned long long) dispatches);
+
+  bench_profilePrint("pairs", pairs, dispatches);
+  bench_profilePrint("triples", triples, dispatches);
+
+  // Every run of a superinstruction is one dispatch fewer than running its
+  // pair would have been.
+  uint64 saved = 0;
+
+  for (int i = 0; i < SUPERINSTRUCTION_COUNT; i++) {
+    saved += vm_profile.ops[superinstructions[i].op];
+  }
+
+  printf("    superinstructions: %llu dispatches saved (%.2f%% of %llu)\n", (unsigned long long) saved, 100.0 * saved / (dispatches + saved), (unsigned long long) (dispatches + saved));
+
+  for (int i = 0; i < SUPERINSTRUCTION_COUNT; i++) {
+    uint64 runs = vm_profile.ops[superinstructions[i].op];
+
+    if (runs > 0) {
+      printf("      %10llu (%5.2f%%)  %s\n", (unsigned long long) runs, 100.0 * runs / (dispatches + saved), opcode_name(superinstructions[i].op));
+    }
+  }
+
+  return true;
+}
+#endif
+
+// Compiles path to both instruction sets and profiles a run of each. See
+// bench_profileHunk.
+bool bench_profile(const char* path) {
+#ifdef VM_PROFILE
+  psize mapped = 0;
+  char* source = loaf_mapFile(path, &mapped);
+  if (source == 0) {
+    return false;
+  }
+
+  Hunk stack = {};
+  Hunk registers = {};
+
+  bool compiled = loaf_compile(source, &stack, BYTECODE_STACK) && loaf_compile(source, &registers, BYTECODE_REGISTER);
+
+  loaf_unmapFile(source, mapped);
+
+  if (!compiled) {
+    return false;
+  }
+
+  printf("%s\n", path);
+
+  printf("  stack\n");
+
+  if (!bench_profileHunk(&stack)) {
+    return false;
+  }
+
+  printf("  register\n");
+
+  return bench_profileHunk(&registers);
+#else
+  logf("ERROR: profiling needs a build with VM_PROFILE defined\n");
+
+  return false;
+#endif
+}
+
+#define BENCH_TABLE_LOOKUPS (1 << 20)
+
+// Interns "<prefix><n>".
+String bench_tableKey(const char* prefix, int n) {
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "%s%d", prefix, n);
+
+  return *string_intern(buf, len);
+}
+
+// Times table lookups at a few sizes, so the tables end up at different load
+// factors, with different ratios of hits to misses.
+bool bench_table(int iterations) {
+  int sizes[] = { 100, 1000, 1500, 1750, 3500, 50000, 100000 };
+  int hitPercents[] = { 100, 50, 0 };
+
+  printf("table (%d iterations, %d lookups each)\n", iterations, BENCH_TABLE_LOOKUPS);
+
+  for (int size : sizes) {
+    String* keys = (String*) malloc(sizeof(String) * size);
+    String* misses = (String*) malloc(sizeof(String) * size);
+
+    Table t = {};
+    table_init(&t);
+
+    for (int i = 0; i < size; i++) {
+      keys[i] = bench_tableKey("key", i);
+      misses[i] = bench_tableKey("miss", i);
+
+      table_set(&t, keys[i], value_make((double) i));
+    }
+
+    printf("  %6d keys, capacity %6d (load %.2f)\n", t.count, t.capacity, (double) t.count / t.capacity);
+
+    for (int percent : hitPercents) {
+      uint64 total = 0;
+      int found = 0;
+      int expected = 0;
+
+      for (int it = 0; it < iterations; it++) {
+        uint64 start = bench_now();
+
+        for (int i = 0; i < BENCH_TABLE_LOOKUPS; i++) {
+          // NOTE: spread the keys around so consecutive lookups
+          // don't hit the same slots.
+          int n = (int) (((uint64) i * 2654435761u) % size);
+          bool hit = (i % 100) < percent;
+
+          if (table_get(&t, hit ? keys[n] : misses[n], 0)) {
+            found += 1;
+          }
+
+          expected += hit;
+        }
+
+        total += bench_now() - start;
+      }
+
+      if (found != expected) {
+        logf("ERROR: table lookups found %d keys, expected %d\n", found, expected);
+
+        return false;
+      }
+
+      printf("    %3d%% hits %10.2f ns/lookup\n", percent, (double) total / iterations / BENCH_TABLE_LOOKUPS);
+    }
+
+    // Deleting every other key leaves tombstones for lookups to step over.
+    for (int i = 0; i < size; i += 2) {
+      table_delete(&t, keys[i]);
+    }
+
+    uint64 start = bench_now();
+    int found = 0;
+    int expected = 0;
+
+    for (int it = 0; it < iterations; it++) {
+      for (int i = 0; i < BENCH_TABLE_LOOKUPS; i++) {
+        int n = (int) (((uint64) i * 2654435761u) % size);
+
+        if (table_get(&t, keys[n], 0)) {
+          found += 1;
+        }
+
+        expected += n % 2;
+      }
+    }
+
+    if (found != expected) {
+      logf("ERROR: table lookups found %d keys after deleting, expected %d\n", found, expected);
+
+      return false;
+    }
+
+    printf("    half deleted %7.2f ns/lookup\n", (double) (bench_now() - start) / iterations / BENCH_TABLE_LOOKUPS);
+
+    table_free(&t);
+    free(keys);
+    free(misses);
+  }
+
+  return true;
+}
+
+uint32 bench_random(uint32* state) {
+  *state = *state * 1664525u + 1013904223u;
+
+  return *state >> 8;
+}
+
+const char* bench_lexWord(uint32* state) {
+  static const char* words[] = {
+    "x", "total", "counter_2", "n", "aVeryLongIdentifierNameForTesting", "fib",
+    "value", "i", "accumulated_result_of_everything", "y1",
+  };
+
+  return words[bench_random(state) % (sizeof(words) / sizeof(words[0]))];
+}
+
+// The kinds of source bench_lexSource can make.
+enum BenchLexSource {
+  // Declarations and assignments, with a comment every so often.
+  BENCH_LEX_CODE,
+
+  // The same, with a few lines of block comment above every line.
+  BENCH_LEX_DOCUMENTED,
+
+  // Lines of nothing but keywords and identifiers.
+  BENCH_LEX_WORDS,
+
+  BENCH_LEX_SOURCE_COUNT
+};
+
+const char* bench_lexSourceNames[] = { "code", "documented", "words" };
+
+// Appends a made up line of the given kind of source to *p. state is the
+// generator's seed.
+void bench_lexLine(char** p, uint32* state, BenchLexSource kind) {
+  static const char* ops[] = { " + ", " - ", " * ", " / ", " == ", " < ", " >= ", " && ", " || " };
+
+  int indent = bench_random(state) % 4;
+  for (int i = 0; i < indent; i++) {
+    *p += sprintf(*p, (bench_random(state) % 2) ? "    " : "\t");
+  }
+
+  if (kind == BENCH_LEX_WORDS) {
+    int words = 4 + bench_random(state) % 8;
+
+    for (int i = 0; i < words; i++) {
+      const char* word = (bench_random(state) % 2) ? keywords[bench_random(state) % KEYWORD_COUNT].text : bench_lexWord(state);
+
+      *p += sprintf(*p, "%s%s", i == 0 ? "" : " ", word);
+    }
+
+    *p += sprintf(*p, "\n");
+
+    return;
+  }
+
+  if (kind == BENCH_LEX_DOCUMENTED) {
+    int lines = 1 + bench_random(state) % 6;
+
+    *p += sprintf(*p, "/*\n");
+    for (int i = 0; i < lines; i++) {
+      *p += sprintf(*p, "%*s * %s has to be worked out before anything else uses it.\n", indent * 4, "", bench_lexWord(state));
+    }
+    *p += sprintf(*p, "%*s */\n%*s", indent * 4, "", indent * 4, "");
+  }
+
+  if (bench_random(state) % 16 == 0) {
+    *p += sprintf(*p, "/* %s is\n   worked out /* nested */ below */\n", bench_lexWord(state));
+
+    return;
+  }
+
+  const char* name = bench_lexWord(state);
+  *p += sprintf(*p, "%s %s ", name, (bench_random(state) % 2) ? ":=" : "=");
+
+  int terms = 1 + bench_random(state) % 8;
+  for (int i = 0; i < terms; i++) {
+    if (i != 0) {
+      *p += sprintf(*p, "%s", ops[bench_random(state) % (sizeof(ops) / sizeof(ops[0]))]);
+    }
+
+    if (bench_random(state) % 2) {
+      *p += sprintf(*p, "%u", bench_random(state) % 100000);
+    } else if (bench_random(state) % 4 == 0) {
+      const char* function = bench_lexWord(state);
+      const char* arg = bench_lexWord(state);
+
+      *p += sprintf(*p, "%s(%s, %u)", function, arg, bench_random(state) % 10);
+    } else {
+      *p += sprintf(*p, "%s", bench_lexWord(state));
+    }
+  }
+
+  if (bench_random(state) % 4 == 0) {
+    *p += sprintf(*p, " // %s gets updated here", bench_lexWord(state));
+  }
+
+  *p += sprintf(*p, "\n");
+}
+
+// Makes a null terminated source of roughly size bytes.
+char* bench_lexSource(int size, BenchLexSource kind) {
+  // NOTE: leave room for the line which goes over size.
+  char* source = (char*) malloc(size + 1024);
+  char* p = source;
+  uint32 state = 1;
+
+  while (p - source < size) {
+    bench_lexLine(&p, &state, kind);
+  }
+
+  *p = '\0';
+
+  return source;
+}
+
+// Scans source to the end with kernel. Returns the number of tokens, and sets
+// hash to a hash of their types, lengths and positions so kernels can be
+// checked against each other.
+int bench_lexSource(char* source, ScannerKernel* kernel, uint64* hash) {
+  Scanner scanner = {};
+  scanner_load(&scanner, source);
+  scanner.kernel = kernel;
+
+  int count = 0;
+  *hash = 14695981039346656037u;
+
+  while (true) {
+    Token t = scanner_getToken(&scanner);
+
+    *hash = (*hash ^ (((uint64) t.type << 48) | ((uint64) t.len << 32) | (uint64) t.pos)) * 1099511628211u;
+    count += 1;
+
+    if (t.type == TOKEN_EOF || t.type == TOKEN_ILLEGAL) {
+      break;
+    }
+  }
+
+  return count;
+}
+
+// Times the scanner over generated sources with each kernel the CPU supports.
+bool bench_lex(int iterations) {
+  int sizes[] = { 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+
+  ScannerKernel* kernels[] = {
+    &scanner_scalarKernel,
+#ifdef SCANNER_SIMD
+    &scanner_sse2Kernel,
+    &scanner_avx2Kernel,
+#endif
+  };
+
+  printf("lex (%d iterations)\n", iterations);
+
+  // NOTE: plain code is mostly short tokens, where the time goes on
+  // working out what each token is rather than on finding where it ends.
+  // Documented code has long comments, which is where the kernels help.
+  for (int kind = 0; kind < BENCH_LEX_SOURCE_COUNT; kind++) {
+    for (int size : sizes) {
+      char* source = bench_lexSource(size, (BenchLexSource) kind);
+      psize len = strlen(source);
+
+      uint64 expectedHash = 0;
+      int expectedCount = bench_lexSource(source, &scanner_scalarKernel, &expectedHash);
+
+      printf("  %-10s %8zu bytes, %d tokens\n", bench_lexSourceNames[kind], len, expectedCount);
+
+      for (ScannerKernel* kernel : kernels) {
+        if (!scanner_supports(kernel)) {
+          printf("    %-8s not supported by this CPU\n", kernel->name);
+
+          continue;
+        }
+
+        uint64 total = 0;
+
+        for (int it = 0; it < iterations; it++) {
+          uint64 hash = 0;
+
+          uint64 start = bench_now();
+          int count = bench_lexSource(source, kernel, &hash);
+          total += bench_now() - start;
+
+          if (count != expectedCount || hash != expectedHash) {
+            logf("ERROR: %s scanner disagrees with the scalar one\n", kernel->name);
+
+            return false;
+          }
+        }
+
+        double seconds = (double) total / iterations / 1000000000.0;
+
+        printf("    %-8s %10.2f MB/s\n", kernel->name, len / seconds / (1024 * 1024));
+      }
+
+      free(source);
+    }
+  }
+
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    logf("usage: %s dispatch|optimize|profile|table|lex [-n iterations] file.ls...\n", argv[0]);
+
+    return -1;
+  }
+
+  const char* mode = argv[1];
+
+  int iterations = BENCH_DEFAULT_ITERATIONS;
+  int first = 2;
+
+  if (first + 1 < argc && strcmp(argv[first], "-n") == 0) {
+    iterations = atoi(argv[first + 1]);
+    first += 2;
+  }
+
+  if (iterations <= 0) {
+    logf("ERROR: iterations must be positive\n");
+
+    return -1;
+  }
+
+  if (strcmp(mode, "table") == 0) {
+    return bench_table(iterations) ? 0 : 1;
+  }
+
+  if (strcmp(mode, "lex") == 0) {
+    return bench_lex(iterations) ? 0 : 1;
+  }
+
+  for (int i = first; i < argc; i++) {
+    bool ok = false;
+
+    if (strcmp(mode, "dispatch") == 0) {
+      ok = bench_dispatch(argv[i], iterations);
+    } else if (strcmp(mode, "optimize") == 0) {
+      ok = bench_optimize(argv[i], iterations);
+    } else if (strcmp(mode, "profile") == 0) {
+      ok = bench_profile(argv[i]);
+    } else {
+      logf("ERROR: unknown benchmark '%s'\n", mode);
+
+      return -1;
+    }
+
+    if (!ok) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,181 @@
+// Maps names to ints while following lexical scope. The type checker uses it
+// to find symbols and the code generator to find the slots of variables.
+//
+// Each name is looked up in one hash table, which always holds its innermost
+// binding, so lookups cost the same however deeply scopes are nested. The
+// bindings themselves are kept on a stack. Each binding remembers the one it
+// shadows, so closing a scope walks back to where that scope started and puts
+// the shadowed bindings back into the table.
+//
+// Bindings added before the first scope is opened are global: they can be
+// seen from everywhere, even inside functions, which can't see anything else
+// from the scopes around them.
+//
+// Usage:
+//
+// Bindings b = {};
+// bindings_init(&b);
+//
+// bindings_push(&b);
+// bindings_add(&b, string_intern(name, len), 10);
+//
+// int v;
+// bindings_get(&b, string_intern(name, len), &v);
+//
+// bindings_pop(&b);
+//
+// bindings_free(&b);
+
+struct Binding {
+  String* name;
+  int value;
+
+  // The binding of the same name which this one hides, or -1.
+  int shadowed;
+};
+
+array_for(Binding);
+
+struct BindingScope {
+  // Index of the first binding added in this scope.
+  int first;
+
+  // What visibleFrom was before this scope was opened.
+  int visibleFrom;
+};
+
+array_for(BindingScope);
+
+struct Bindings {
+  // Name to index of its innermost binding.
+  Table names;
+
+  array(Binding) stack;
+  array(BindingScope) scopes;
+
+  // Bindings below globals are global.
+  int globals;
+
+  // Bindings from globals up to visibleFrom belong to functions around the
+  // current one, so lookups skip over them.
+  int visibleFrom;
+};
+
+void bindings_init(Bindings* b) {
+  table_init(&b->names);
+
+  b->stack = array_Binding_init();
+  b->scopes = array_BindingScope_init();
+
+  b->globals = 0;
+  b->visibleFrom = 0;
+}
+
+void bindings_free(Bindings* b) {
+  table_free(&b->names);
+
+  free(array_header(b->stack));
+  free(array_header(b->scopes));
+}
+
+int bindings_count(Bindings* b) {
+  return (int) array_count(b->stack);
+}
+
+// Index of the first binding in the innermost scope. The bindings from there
+// up to bindings_count are the ones added to it.
+int bindings_first(Bindings* b) {
+  if (array_count(b->scopes) == 0) {
+    return 0;
+  }
+
+  return b->scopes[array_count(b->scopes) - 1].first;
+}
+
+// Index of the innermost binding of name, visible or not. -1 if there isn't
+// one.
+int bindings_find(Bindings* b, String* name) {
+  Value v;
+  if (!table_get(&b->names, *name, &v)) {
+    return -1;
+  }
+
+  return (int) VALUE_AS_NUMBER(v);
+}
+
+// Opens a scope. If function is true, the bindings of the scopes which are
+// already open can't be seen from it, apart from globals.
+void bindings_push(Bindings* b, bool function = false) {
+  if (array_count(b->scopes) == 0) {
+    b->globals = bindings_count(b);
+  }
+
+  BindingScope scope = {};
+  scope.first = bindings_count(b);
+  scope.visibleFrom = b->visibleFrom;
+
+  array_BindingScope_add(&b->scopes, scope);
+
+  if (function) {
+    b->visibleFrom = scope.first;
+  }
+}
+
+// Closes the innermost scope, dropping everything added to it.
+void bindings_pop(Bindings* b) {
+  assert(array_count(b->scopes) > 0);
+
+  BindingScope scope = b->scopes[array_count(b->scopes) - 1];
+  array_header(b->scopes)->count -= 1;
+
+  for (int i = bindings_count(b) - 1; i >= scope.first; i--) {
+    Binding binding = b->stack[i];
+
+    if (binding.shadowed == -1) {
+      table_delete(&b->names, *binding.name);
+    } else {
+      table_set(&b->names, *binding.name, value_make((double) binding.shadowed));
+    }
+  }
+
+  array_header(b->stack)->count = scope.first;
+
+  b->visibleFrom = scope.visibleFrom;
+}
+
+// Binds name to value in the innermost scope. Returns false if name is
+// already bound in that scope.
+bool bindings_add(Bindings* b, String* name, int value) {
+  int shadowed = bindings_find(b, name);
+  if (shadowed >= bindings_first(b)) {
+    return false;
+  }
+
+  Binding binding = {};
+  binding.name = name;
+  binding.value = value;
+  binding.shadowed = shadowed;
+
+  table_set(&b->names, *name, value_make((double) bindings_count(b)));
+  array_Binding_add(&b->stack, binding);
+
+  return true;
+}
+
+bool bindings_get(Bindings* b, String* name, int* value) {
+  int i = bindings_find(b, name);
+
+  // NOTE: everything a hidden binding shadows is older than it, so
+  // it is hidden too unless it is global.
+  while (i >= b->globals && i < b->visibleFrom) {
+    i = b->stack[i].shadowed;
+  }
+
+  if (i == -1) {
+    return false;
+  }
+
+  *value = b->stack[i].value;
+
+  return true;
+}
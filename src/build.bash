@@ -26,8 +26,23 @@ USLIB_FLAGS="-I$VENDOR_DIR/uslib"
 
 ls $SRC_DIR
 
+# Set NAN_BOXING=1 to build with NaN boxed values (see value.cpp).
+VALUE_FLAGS=""
+
+if [ "$NAN_BOXING" == "1" ]; then
+    VALUE_FLAGS="-DVALUE_NAN_BOXING"
+fi
+
+# Set PROFILE=1 to build loaf-bench with a VM which counts the instructions it
+# runs (see loaf-bench profile).
+BENCH_FLAGS=""
+
+if [ "$PROFILE" == "1" ]; then
+    BENCH_FLAGS="-DVM_PROFILE"
+fi
+
 GCC="gcc"
-GPP="g++ -Wall -Werror -std=c++11 -g"
+GPP="g++ -Wall -Werror -std=c++11 -g $VALUE_FLAGS"
 
 START_TIME=$(date +%s)
 
@@ -39,6 +54,11 @@ $GPP -o loaf -I$SRC_DIR $SRC_DIR/main.cpp $USLIB_FLAGS
 
 compileCheckError
 
+echo "Building benchmarks..."
+$GPP -O2 $BENCH_FLAGS -o loaf-bench -I$SRC_DIR $SRC_DIR/bench.cpp $USLIB_FLAGS
+
+compileCheckError
+
 echo "Done!"
 
 END_TIME=$(date +%s)
@@ -1,15 +1,16 @@
 // How to define a function
 //
 // Constants:
-// 0. Value [String, "main"]
-// 1. Value [Function, { x }
+// 0. Value [Function, { x }
+//
+// Globals:
+// 0. "main"
 //
 // OP_CONSTANT 0
-// OP_CONSTANT 1
 //
-// OP_SET_GLOBAL
-// -- defines function "main" as code "x". takes a string and function value
-// off the stack
+// OP_SET_GLOBAL 0
+// -- defines function "main" as code "x". takes the function value off the
+// stack
 
 typedef uint16 Instruction;
 
@@ -18,15 +19,22 @@ enum OPCode : Instruction {
 
   OP_SET_LOCAL,
   OP_GET_LOCAL,
+  OP_TEE_LOCAL, // Sets a local without popping the value off the stack
 
-  OP_SET_GLOBAL,
+  OP_SET_GLOBAL, // Globals are referred to by their index in Hunk::globals
   OP_GET_GLOBAL,
 
   OP_CALL,
+  OP_CALL_DIRECT, // global arity: calls a function which is only declared once
 
   // Load constant onto stack
   OP_CONSTANT,
 
+  // Push a number or bool held in the operand instead of the constant pool.
+  // The number is a signed 16 bit integer.
+  OP_CONSTANT_INT,
+  OP_CONSTANT_BOOL,
+
   // Unary negation
   OP_NEGATE,
 
@@ -49,45 +57,614 @@ enum OPCode : Instruction {
   OP_JUMP_IF_FALSE,
 
   OP_LOG,
+  OP_POP, // Drops the value on top of the stack
+
+  // Typed versions of the binary expressions above. They are only emitted
+  // when typeCheck has proven the types of both operands, so they don't
+  // check them at runtime.
+  OP_ADD_NUM,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+
+  OP_TEST_EQ_NUM,
+  OP_TEST_EQ_BOOL,
+  OP_TEST_GT_NUM,
+  OP_TEST_LT_NUM,
+  OP_TEST_GTE_NUM,
+  OP_TEST_LTE_NUM,
+
+  OP_TEST_AND_BOOL,
+  OP_TEST_OR_BOOL,
+
+  // Compare the two numbers on top of the stack and jump unless the
+  // comparison holds, ie. OP_JUMP_IF_NOT_LT offset jumps if !(a < b). Like
+  // the typed instructions above, they are only emitted for numbers.
+  OP_JUMP_IF_NOT_EQ,
+  OP_JUMP_IF_NOT_GT,
+  OP_JUMP_IF_NOT_LT,
+  OP_JUMP_IF_NOT_GTE,
+  OP_JUMP_IF_NOT_LTE,
+
+  // Register instructions. Instead of going through the stack, operands name
+  // slots in the current frame directly, ie. OP_R_ADD dst a b sets slot dst
+  // to slot a + slot b. Produced by ast_writeRegisterBytecode.
+  OP_R_MOVE,          // dst src
+  OP_R_CONSTANT,      // dst constant
+  OP_R_CONSTANT_INT,  // dst immediate
+  OP_R_CONSTANT_BOOL, // dst immediate
+
+  OP_R_SET_GLOBAL,    // global func (constant)
+
+  OP_R_CALL,          // dst global arity base: arguments are in slots base..base+arity
+  OP_R_CALL_DIRECT,   // dst global base: see OP_CALL_DIRECT
+  OP_R_RETURN,        // amount src
+
+  OP_R_NEGATE,        // dst a
+
+  OP_R_ADD,           // dst a b
+  OP_R_SUBTRACT,
+  OP_R_MULTIPLY,
+  OP_R_DIVIDE,
+
+  OP_R_TEST_EQ,
+  OP_R_TEST_GT,
+  OP_R_TEST_LT,
+  OP_R_TEST_GTE,
+  OP_R_TEST_LTE,
+
+  OP_R_TEST_OR,
+  OP_R_TEST_AND,
+
+  OP_R_JUMP_IF_FALSE, // src offset
+
+  OP_R_LOG,           // src
+
+  // Typed register instructions, see OP_ADD_NUM.
+  OP_R_ADD_NUM,       // dst a b
+  OP_R_SUBTRACT_NUM,
+  OP_R_MULTIPLY_NUM,
+  OP_R_DIVIDE_NUM,
+
+  OP_R_TEST_EQ_NUM,
+  OP_R_TEST_EQ_BOOL,
+  OP_R_TEST_GT_NUM,
+  OP_R_TEST_LT_NUM,
+  OP_R_TEST_GTE_NUM,
+  OP_R_TEST_LTE_NUM,
+
+  OP_R_TEST_AND_BOOL,
+  OP_R_TEST_OR_BOOL,
+
+  // Register versions of OP_JUMP_IF_NOT_EQ and co.
+  OP_R_JUMP_IF_NOT_EQ, // a b offset
+  OP_R_JUMP_IF_NOT_GT,
+  OP_R_JUMP_IF_NOT_LT,
+  OP_R_JUMP_IF_NOT_GTE,
+  OP_R_JUMP_IF_NOT_LTE,
+
+  // Superinstructions, which do the work of a pair of the instructions above
+  // in one dispatch. Their operands are those of the pair, one after the
+  // other. Only written by hunk_optimize, see superinstructions below.
+  OP_GET_LOCAL_CONSTANT_INT,        // slot immediate
+  OP_GET_LOCAL_GET_LOCAL,           // slot slot
+
+  OP_R_CONSTANT_INT_JUMP_IF_NOT_EQ, // dst immediate a b offset
+  OP_R_CONSTANT_INT_ADD_NUM,        // dst immediate dst a b
+  OP_R_CONSTANT_INT_SUBTRACT_NUM,
+  OP_R_CONSTANT_INT_DIVIDE_NUM,
+
+  OP_COUNT
 };
 
 array_for(Instruction);
-array_for(uint32);
 array_for(Value);
 
+struct Hunk;
+
+struct Global {
+  Value name;
+
+  // How many times the program declares a function called name.
+  int declarations;
+
+  // The function if there is only one declaration. Calls to it are resolved
+  // when compiling, and can jump straight to its code.
+  Hunk* function;
+};
+
+array_for(Global);
+
+// Finds values in an array of them without scanning it, for keeping the
+// values in a hunk's constants and globals unique. Open addressing with linear
+// probing over the positions of the values, which are kept alongside them.
+struct ValueIndexEntry {
+  Value value;
+
+  // Position of value in the array, or -1 if the entry is empty.
+  int position;
+};
+
+struct ValueIndex {
+  ValueIndexEntry* entries;
+
+  int count;
+
+  // Always 0 or a power of two.
+  int capacity;
+};
+
+#define VALUE_INDEX_MAX_LOAD(c) ((c) / 2)
+
+void valueIndex_init(ValueIndex* index) {
+  index->entries = 0;
+  index->count = 0;
+  index->capacity = 0;
+}
+
+// The entry holding v, or the empty entry it would go in.
+ValueIndexEntry* valueIndex_entry(ValueIndex* index, Value v) {
+  int mask = index->capacity - 1;
+
+  for (int i = (int) (value_hash(v) & mask); ; i = (i + 1) & mask) {
+    ValueIndexEntry* entry = &index->entries[i];
+
+    if (entry->position == -1 || value_identical(entry->value, v)) {
+      return entry;
+    }
+  }
+}
+
+// Position of v, or -1 if it hasn't been added.
+int valueIndex_find(ValueIndex* index, Value v) {
+  if (index->capacity == 0) {
+    return -1;
+  }
+
+  return valueIndex_entry(index, v)->position;
+}
+
+// Records that v is at position. v mustn't be in index already.
+void valueIndex_add(ValueIndex* index, Value v, int position) {
+  if (index->count + 1 > VALUE_INDEX_MAX_LOAD(index->capacity)) {
+    ValueIndexEntry* old = index->entries;
+    int oldCapacity = index->capacity;
+
+    index->capacity = oldCapacity == 0 ? 16 : oldCapacity * 2;
+    index->entries = (ValueIndexEntry*) malloc(sizeof(ValueIndexEntry) * index->capacity);
+
+    for (int i = 0; i < index->capacity; i++) {
+      index->entries[i].position = -1;
+    }
+
+    for (int i = 0; i < oldCapacity; i++) {
+      if (old[i].position != -1) {
+        *valueIndex_entry(index, old[i].value) = old[i];
+      }
+    }
+
+    free(old);
+  }
+
+  ValueIndexEntry* entry = valueIndex_entry(index, v);
+  assert(entry->position == -1);
+
+  entry->value = v;
+  entry->position = position;
+
+  index->count += 1;
+}
+
+// Which instruction set a hunk is written in. A program uses the same format
+// for all of its hunks.
+enum BytecodeFormat : uint32 {
+  BYTECODE_STACK,
+  BYTECODE_REGISTER,
+};
+
 struct Hunk {
+  BytecodeFormat format;
+
   array(Instruction) code;
-  array(uint32) lines;
+
+  // The source position (see lines.cpp) each instruction was compiled from.
+  array(uint32) positions;
 
   array(Value) constants;
+  ValueIndex constantIndex;
+
+  // Number of local slots a frame running this hunk uses, including its
+  // parameters (and temporaries in the register format).
+  int slotCount;
+
+  // Stack format only: the most values the frame's expression stack ever
+  // holds. Worked out by hunk_verify.
+  int maxStack;
+
+  // Has hunk_verify checked this hunk and the functions it defines?
+  bool verified;
+
+  // The globals in the program, by index. Only filled in on the hunk the
+  // program starts in, as all of its functions share them.
+  array(Global) globals;
+  ValueIndex globalIndex;
 };
 
-void hunk_init(Hunk* hunk) {
+void hunk_init(Hunk* hunk, BytecodeFormat format = BYTECODE_STACK) {
+  hunk->format = format;
+
   hunk->code = array_Instruction_init();
-  hunk->lines = array_uint32_init();
+  hunk->positions = array_uint32_init();
 
   hunk->constants = array_Value_init();
+  valueIndex_init(&hunk->constantIndex);
+
+  hunk->slotCount = 0;
+
+  hunk->maxStack = 0;
+  hunk->verified = false;
+
+  hunk->globals = array_Global_init();
+  valueIndex_init(&hunk->globalIndex);
 }
 
 int hunk_getCount(Hunk* hunk) {
   return (int) array_count(hunk->code);
 }
 
-bool hunk_write(Hunk* hunk, Instruction i, uint32 line) {
+bool hunk_write(Hunk* hunk, Instruction i, uint32 pos) {
   array_Instruction_add(&hunk->code, i);
-  array_uint32_add(&hunk->lines, line);
+  array_uint32_add(&hunk->positions, pos);
 
   return true;
 }
 
+// Makes sure frames running hunk have room for slot.
+void hunk_useSlot(Hunk* hunk, int slot) {
+  if (slot >= hunk->slotCount) {
+    hunk->slotCount = slot + 1;
+  }
+}
+
+// Returns the index of val in hunk's constant pool, adding it if it isn't
+// there yet.
 int hunk_addConstant(Hunk* hunk, Value val) {
+  int i = valueIndex_find(&hunk->constantIndex, val);
+
+  if (i != -1) {
+    return i;
+  }
+
+  i = (int) array_count(hunk->constants);
+
   array_Value_add(&hunk->constants, val);
+  valueIndex_add(&hunk->constantIndex, val, i);
+
+  return i;
+}
+
+// Adds the string at start to hunk's constants.
+int hunk_addString(Hunk* hunk, char* start, int len) {
+  return hunk_addConstant(hunk, value_make(start, len));
+}
+
+// Returns the index of the global called name in hunk, adding it if there
+// isn't one yet.
+int hunk_addGlobal(Hunk* hunk, char* start, int len) {
+  Value name = value_make(start, len);
+
+  int i = valueIndex_find(&hunk->globalIndex, name);
+
+  if (i != -1) {
+    return i;
+  }
+
+  i = (int) array_count(hunk->globals);
+
+  Global global = {};
+  global.name = name;
+
+  array_Global_add(&hunk->globals, global);
+  valueIndex_add(&hunk->globalIndex, name, i);
+
+  return i;
+}
+
+// Can v be written as the operand of OP_CONSTANT_INT or OP_CONSTANT_BOOL?
+// Sets immediate to the operand if so.
+bool hunk_immediate(Value v, Instruction* immediate) {
+  if (VALUE_IS_BOOL(v)) {
+    *immediate = VALUE_AS_BOOL(v) ? 1 : 0;
+
+    return true;
+  }
+
+  if (!VALUE_IS_NUMBER(v)) {
+    return false;
+  }
+
+  double n = VALUE_AS_NUMBER(v);
+
+  // NOTE: converting NaN or anything out of range to an integer is
+  // undefined, so the range is checked first. NaN fails every comparison.
+  if (!(n >= INT16_MIN && n <= INT16_MAX) || n != (double) (int16) n || (n == 0 && signbit(n))) {
+    return false;
+  }
+
+  *immediate = (Instruction) (int16) n;
+
+  return true;
+}
+
+// The pair of instructions a superinstruction does the work of.
+struct Superinstruction {
+  Instruction op;
+
+  Instruction first;
+  Instruction second;
+};
+
+// NOTE: picked from the pairs `loaf-bench profile` finds running
+// most often over the programs in bench/. It counts the pairs as they run, so
+// pairs which only follow each other across a call, a return or a jump show
+// up too, but can't be fused. Only the second instruction of a pair may jump.
+Superinstruction superinstructions[] = {
+  { OP_GET_LOCAL_CONSTANT_INT, OP_GET_LOCAL, OP_CONSTANT_INT },
+  { OP_GET_LOCAL_GET_LOCAL, OP_GET_LOCAL, OP_GET_LOCAL },
+
+  { OP_R_CONSTANT_INT_JUMP_IF_NOT_EQ, OP_R_CONSTANT_INT, OP_R_JUMP_IF_NOT_EQ },
+  { OP_R_CONSTANT_INT_ADD_NUM, OP_R_CONSTANT_INT, OP_R_ADD_NUM },
+  { OP_R_CONSTANT_INT_SUBTRACT_NUM, OP_R_CONSTANT_INT, OP_R_SUBTRACT_NUM },
+  { OP_R_CONSTANT_INT_DIVIDE_NUM, OP_R_CONSTANT_INT, OP_R_DIVIDE_NUM },
+};
+
+#define SUPERINSTRUCTION_COUNT ((int) (sizeof(superinstructions) / sizeof(superinstructions[0])))
+
+// The pair op does the work of, or 0 if it isn't a superinstruction.
+Superinstruction* superinstruction_find(Instruction op) {
+  for (int i = 0; i < SUPERINSTRUCTION_COUNT; i++) {
+    if (superinstructions[i].op == op) {
+      return &superinstructions[i];
+    }
+  }
+
+  return 0;
+}
+
+// The superinstruction which does the work of first and then second, or 0 if
+// there isn't one.
+Superinstruction* superinstruction_fuse(Instruction first, Instruction second) {
+  for (int i = 0; i < SUPERINSTRUCTION_COUNT; i++) {
+    if (superinstructions[i].first == first && superinstructions[i].second == second) {
+      return &superinstructions[i];
+    }
+  }
+
+  return 0;
+}
+
+// Number of operands which follow an instruction in the code stream.
+int opcode_operandCount(Instruction in) {
+  switch (in) {
+    case OP_SET_LOCAL:
+    case OP_GET_LOCAL:
+    case OP_TEE_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_CALL:
+    case OP_CONSTANT:
+    case OP_CONSTANT_INT:
+    case OP_CONSTANT_BOOL:
+    case OP_RETURN:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_EQ:
+    case OP_JUMP_IF_NOT_GT:
+    case OP_JUMP_IF_NOT_LT:
+    case OP_JUMP_IF_NOT_GTE:
+    case OP_JUMP_IF_NOT_LTE:
+    case OP_R_LOG:
+      {
+        return 1;
+      } break;
+    case OP_R_MOVE:
+    case OP_R_CONSTANT:
+    case OP_R_CONSTANT_INT:
+    case OP_R_CONSTANT_BOOL:
+    case OP_R_SET_GLOBAL:
+    case OP_CALL_DIRECT:
+    case OP_R_RETURN:
+    case OP_R_NEGATE:
+    case OP_R_JUMP_IF_FALSE:
+      {
+        return 2;
+      } break;
+    case OP_R_ADD:
+    case OP_R_SUBTRACT:
+    case OP_R_MULTIPLY:
+    case OP_R_DIVIDE:
+    case OP_R_TEST_EQ:
+    case OP_R_TEST_GT:
+    case OP_R_TEST_LT:
+    case OP_R_TEST_GTE:
+    case OP_R_TEST_LTE:
+    case OP_R_TEST_OR:
+    case OP_R_TEST_AND:
+    case OP_R_CALL_DIRECT:
+    case OP_R_ADD_NUM:
+    case OP_R_SUBTRACT_NUM:
+    case OP_R_MULTIPLY_NUM:
+    case OP_R_DIVIDE_NUM:
+    case OP_R_TEST_EQ_NUM:
+    case OP_R_TEST_EQ_BOOL:
+    case OP_R_TEST_GT_NUM:
+    case OP_R_TEST_LT_NUM:
+    case OP_R_TEST_GTE_NUM:
+    case OP_R_TEST_LTE_NUM:
+    case OP_R_TEST_AND_BOOL:
+    case OP_R_TEST_OR_BOOL:
+    case OP_R_JUMP_IF_NOT_EQ:
+    case OP_R_JUMP_IF_NOT_GT:
+    case OP_R_JUMP_IF_NOT_LT:
+    case OP_R_JUMP_IF_NOT_GTE:
+    case OP_R_JUMP_IF_NOT_LTE:
+      {
+        return 3;
+      } break;
+    case OP_R_CALL:
+      {
+        return 4;
+      } break;
+    default:
+      {
+        Superinstruction* super = superinstruction_find(in);
+
+        if (super != 0) {
+          return opcode_operandCount(super->first) + opcode_operandCount(super->second);
+        }
+
+        return 0;
+      } break;
+  }
+}
+
+// The name of opcode in, for printing.
+const char* opcode_name(Instruction in) {
+#define NAME(Code) \
+  case Code: \
+    { \
+      return #Code; \
+    } break
+
+  switch (in) {
+    NAME(OP_RETURN);
+    NAME(OP_SET_LOCAL);
+    NAME(OP_GET_LOCAL);
+    NAME(OP_TEE_LOCAL);
+    NAME(OP_SET_GLOBAL);
+    NAME(OP_GET_GLOBAL);
+    NAME(OP_CALL);
+    NAME(OP_CALL_DIRECT);
+    NAME(OP_CONSTANT);
+    NAME(OP_CONSTANT_INT);
+    NAME(OP_CONSTANT_BOOL);
+    NAME(OP_NEGATE);
+    NAME(OP_ADD);
+    NAME(OP_SUBTRACT);
+    NAME(OP_MULTIPLY);
+    NAME(OP_DIVIDE);
+    NAME(OP_TEST_EQ);
+    NAME(OP_TEST_GT);
+    NAME(OP_TEST_LT);
+    NAME(OP_TEST_GTE);
+    NAME(OP_TEST_LTE);
+    NAME(OP_TEST_OR);
+    NAME(OP_TEST_AND);
+    NAME(OP_JUMP);
+    NAME(OP_JUMP_IF_FALSE);
+    NAME(OP_LOG);
+    NAME(OP_POP);
+    NAME(OP_ADD_NUM);
+    NAME(OP_SUBTRACT_NUM);
+    NAME(OP_MULTIPLY_NUM);
+    NAME(OP_DIVIDE_NUM);
+    NAME(OP_TEST_EQ_NUM);
+    NAME(OP_TEST_EQ_BOOL);
+    NAME(OP_TEST_GT_NUM);
+    NAME(OP_TEST_LT_NUM);
+    NAME(OP_TEST_GTE_NUM);
+    NAME(OP_TEST_LTE_NUM);
+    NAME(OP_TEST_AND_BOOL);
+    NAME(OP_TEST_OR_BOOL);
+    NAME(OP_JUMP_IF_NOT_EQ);
+    NAME(OP_JUMP_IF_NOT_GT);
+    NAME(OP_JUMP_IF_NOT_LT);
+    NAME(OP_JUMP_IF_NOT_GTE);
+    NAME(OP_JUMP_IF_NOT_LTE);
+    NAME(OP_R_MOVE);
+    NAME(OP_R_CONSTANT);
+    NAME(OP_R_CONSTANT_INT);
+    NAME(OP_R_CONSTANT_BOOL);
+    NAME(OP_R_SET_GLOBAL);
+    NAME(OP_R_CALL);
+    NAME(OP_R_CALL_DIRECT);
+    NAME(OP_R_RETURN);
+    NAME(OP_R_NEGATE);
+    NAME(OP_R_ADD);
+    NAME(OP_R_SUBTRACT);
+    NAME(OP_R_MULTIPLY);
+    NAME(OP_R_DIVIDE);
+    NAME(OP_R_TEST_EQ);
+    NAME(OP_R_TEST_GT);
+    NAME(OP_R_TEST_LT);
+    NAME(OP_R_TEST_GTE);
+    NAME(OP_R_TEST_LTE);
+    NAME(OP_R_TEST_OR);
+    NAME(OP_R_TEST_AND);
+    NAME(OP_R_JUMP_IF_FALSE);
+    NAME(OP_R_LOG);
+    NAME(OP_R_ADD_NUM);
+    NAME(OP_R_SUBTRACT_NUM);
+    NAME(OP_R_MULTIPLY_NUM);
+    NAME(OP_R_DIVIDE_NUM);
+    NAME(OP_R_TEST_EQ_NUM);
+    NAME(OP_R_TEST_EQ_BOOL);
+    NAME(OP_R_TEST_GT_NUM);
+    NAME(OP_R_TEST_LT_NUM);
+    NAME(OP_R_TEST_GTE_NUM);
+    NAME(OP_R_TEST_LTE_NUM);
+    NAME(OP_R_TEST_AND_BOOL);
+    NAME(OP_R_TEST_OR_BOOL);
+    NAME(OP_R_JUMP_IF_NOT_EQ);
+    NAME(OP_R_JUMP_IF_NOT_GT);
+    NAME(OP_R_JUMP_IF_NOT_LT);
+    NAME(OP_R_JUMP_IF_NOT_GTE);
+    NAME(OP_R_JUMP_IF_NOT_LTE);
+    NAME(OP_GET_LOCAL_CONSTANT_INT);
+    NAME(OP_GET_LOCAL_GET_LOCAL);
+    NAME(OP_R_CONSTANT_INT_JUMP_IF_NOT_EQ);
+    NAME(OP_R_CONSTANT_INT_ADD_NUM);
+    NAME(OP_R_CONSTANT_INT_SUBTRACT_NUM);
+    NAME(OP_R_CONSTANT_INT_DIVIDE_NUM);
+    default:
+      {
+        return "OP_UNKNOWN";
+      } break;
+  }
+
+#undef NAME
+}
+
+// Counts the instructions in hunk and every function hunk it defines.
+int hunk_countInstructions(Hunk* hunk) {
+  int count = 0;
+
+  for (int i = 0; i < hunk_getCount(hunk); i += 1 + opcode_operandCount(hunk->code[i])) {
+    count += 1;
+  }
 
-  return ((int) array_count(hunk->constants)) - 1;
+  for (psize i = 0; i < array_count(hunk->constants); i++) {
+    Value v = hunk->constants[i];
+
+    if (VALUE_IS_FUNCTION(v)) {
+      count += hunk_countInstructions(VALUE_AS_FUNCTION(v).hunk);
+    }
+  }
+
+  return count;
 }
 
-int hunk_disassembleInstruction(Hunk* hunk, int offset) {
-  logf("%04d | %04d | ", hunk->lines[offset], offset);
+// Prints the instruction at offset, along with the line it came from if lines
+// is given, or its source position if it isn't.
+int hunk_disassembleInstruction(Hunk* hunk, int offset, LineIndex* lines = 0) {
+  if (lines != 0) {
+    int line, column;
+    lineIndex_find(lines, hunk->positions[offset], &line, &column);
+
+    logf("%04d | %04d | ", line, offset);
+  } else {
+    logf("@%04u | %04d | ", hunk->positions[offset], offset);
+  }
 
   Instruction in = hunk->code[offset];
 
@@ -105,10 +682,20 @@ int hunk_disassembleInstruction(Hunk* hunk, int offset) {
         return offset + 2; \
       } break;
 
+#define REGISTER_INSTRUCTION(Code, Count) \
+  case Code: \
+      { \
+        logf("%s", #Code); \
+        for (int i = 1; i <= Count; i++) { \
+          logf(" %d", hunk->code[offset + i]); \
+        } \
+        logf("\n"); \
+        return offset + 1 + Count; \
+      } break;
+
   switch (in) {
-    SIMPLE_INSTRUCTION(OP_SET_GLOBAL);
-    SIMPLE_INSTRUCTION(OP_GET_GLOBAL);
     SIMPLE_INSTRUCTION(OP_LOG);
+    SIMPLE_INSTRUCTION(OP_POP);
     SIMPLE_INSTRUCTION(OP_NEGATE);
 
     SIMPLE_INSTRUCTION(OP_ADD);
@@ -125,12 +712,85 @@ int hunk_disassembleInstruction(Hunk* hunk, int offset) {
     SIMPLE_INSTRUCTION(OP_TEST_AND);
     SIMPLE_INSTRUCTION(OP_TEST_OR);
 
+    SIMPLE_INSTRUCTION(OP_ADD_NUM);
+    SIMPLE_INSTRUCTION(OP_SUBTRACT_NUM);
+    SIMPLE_INSTRUCTION(OP_MULTIPLY_NUM);
+    SIMPLE_INSTRUCTION(OP_DIVIDE_NUM);
+    SIMPLE_INSTRUCTION(OP_TEST_EQ_NUM);
+    SIMPLE_INSTRUCTION(OP_TEST_EQ_BOOL);
+    SIMPLE_INSTRUCTION(OP_TEST_GT_NUM);
+    SIMPLE_INSTRUCTION(OP_TEST_LT_NUM);
+    SIMPLE_INSTRUCTION(OP_TEST_GTE_NUM);
+    SIMPLE_INSTRUCTION(OP_TEST_LTE_NUM);
+    SIMPLE_INSTRUCTION(OP_TEST_AND_BOOL);
+    SIMPLE_INSTRUCTION(OP_TEST_OR_BOOL);
+
     SIMPLE_INSTRUCTION2(OP_SET_LOCAL);
+    SIMPLE_INSTRUCTION2(OP_TEE_LOCAL);
+    SIMPLE_INSTRUCTION2(OP_SET_GLOBAL);
+    SIMPLE_INSTRUCTION2(OP_GET_GLOBAL);
     SIMPLE_INSTRUCTION2(OP_JUMP);
     SIMPLE_INSTRUCTION2(OP_JUMP_IF_FALSE);
+    SIMPLE_INSTRUCTION2(OP_JUMP_IF_NOT_EQ);
+    SIMPLE_INSTRUCTION2(OP_JUMP_IF_NOT_GT);
+    SIMPLE_INSTRUCTION2(OP_JUMP_IF_NOT_LT);
+    SIMPLE_INSTRUCTION2(OP_JUMP_IF_NOT_GTE);
+    SIMPLE_INSTRUCTION2(OP_JUMP_IF_NOT_LTE);
     SIMPLE_INSTRUCTION2(OP_CALL);
+    REGISTER_INSTRUCTION(OP_CALL_DIRECT, 2);
     SIMPLE_INSTRUCTION2(OP_RETURN);
 
+    REGISTER_INSTRUCTION(OP_R_MOVE, 2);
+    REGISTER_INSTRUCTION(OP_R_CONSTANT, 2);
+    REGISTER_INSTRUCTION(OP_R_CONSTANT_BOOL, 2);
+    REGISTER_INSTRUCTION(OP_R_SET_GLOBAL, 2);
+    REGISTER_INSTRUCTION(OP_R_CALL, 4);
+    REGISTER_INSTRUCTION(OP_R_CALL_DIRECT, 3);
+    REGISTER_INSTRUCTION(OP_R_RETURN, 2);
+    REGISTER_INSTRUCTION(OP_R_NEGATE, 2);
+
+    REGISTER_INSTRUCTION(OP_R_ADD, 3);
+    REGISTER_INSTRUCTION(OP_R_SUBTRACT, 3);
+    REGISTER_INSTRUCTION(OP_R_MULTIPLY, 3);
+    REGISTER_INSTRUCTION(OP_R_DIVIDE, 3);
+
+    REGISTER_INSTRUCTION(OP_R_TEST_EQ, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_GT, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_LT, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_GTE, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_LTE, 3);
+
+    REGISTER_INSTRUCTION(OP_R_TEST_AND, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_OR, 3);
+
+    REGISTER_INSTRUCTION(OP_R_ADD_NUM, 3);
+    REGISTER_INSTRUCTION(OP_R_SUBTRACT_NUM, 3);
+    REGISTER_INSTRUCTION(OP_R_MULTIPLY_NUM, 3);
+    REGISTER_INSTRUCTION(OP_R_DIVIDE_NUM, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_EQ_NUM, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_EQ_BOOL, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_GT_NUM, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_LT_NUM, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_GTE_NUM, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_LTE_NUM, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_AND_BOOL, 3);
+    REGISTER_INSTRUCTION(OP_R_TEST_OR_BOOL, 3);
+
+    REGISTER_INSTRUCTION(OP_R_JUMP_IF_FALSE, 2);
+    REGISTER_INSTRUCTION(OP_R_JUMP_IF_NOT_EQ, 3);
+    REGISTER_INSTRUCTION(OP_R_JUMP_IF_NOT_GT, 3);
+    REGISTER_INSTRUCTION(OP_R_JUMP_IF_NOT_LT, 3);
+    REGISTER_INSTRUCTION(OP_R_JUMP_IF_NOT_GTE, 3);
+    REGISTER_INSTRUCTION(OP_R_JUMP_IF_NOT_LTE, 3);
+    REGISTER_INSTRUCTION(OP_R_LOG, 1);
+
+    REGISTER_INSTRUCTION(OP_GET_LOCAL_CONSTANT_INT, 2);
+    REGISTER_INSTRUCTION(OP_GET_LOCAL_GET_LOCAL, 2);
+    REGISTER_INSTRUCTION(OP_R_CONSTANT_INT_JUMP_IF_NOT_EQ, 5);
+    REGISTER_INSTRUCTION(OP_R_CONSTANT_INT_ADD_NUM, 5);
+    REGISTER_INSTRUCTION(OP_R_CONSTANT_INT_SUBTRACT_NUM, 5);
+    REGISTER_INSTRUCTION(OP_R_CONSTANT_INT_DIVIDE_NUM, 5);
+
     case OP_CONSTANT:
       {
         int idx = hunk->code[offset + 1];
@@ -140,6 +800,24 @@ int hunk_disassembleInstruction(Hunk* hunk, int offset) {
 
         return offset + 2;
       } break;
+    case OP_CONSTANT_INT:
+      {
+        logf("%s %d\n", "OP_CONSTANT_INT", (int16) hunk->code[offset + 1]);
+
+        return offset + 2;
+      } break;
+    case OP_CONSTANT_BOOL:
+      {
+        logf("%s %s\n", "OP_CONSTANT_BOOL", hunk->code[offset + 1] ? "true" : "false");
+
+        return offset + 2;
+      } break;
+    case OP_R_CONSTANT_INT:
+      {
+        logf("%s %d %d\n", "OP_R_CONSTANT_INT", hunk->code[offset + 1], (int16) hunk->code[offset + 2]);
+
+        return offset + 3;
+      } break;
     case OP_GET_LOCAL:
       {
         int idx = hunk->code[offset + 1];
@@ -157,62 +835,667 @@ int hunk_disassembleInstruction(Hunk* hunk, int offset) {
 
 #undef SIMPLE_INSTRUCTION
 #undef SIMPLE_INSTRUCTION2
+#undef REGISTER_INSTRUCTION
 }
 
-void hunk_disassemble(Hunk* hunk, const char* name) {
+void hunk_disassemble(Hunk* hunk, const char* name, LineIndex* lines = 0) {
   logf("+++ %s +++\n", name);
 
   int i = 0;
 
   while (i < hunk_getCount(hunk)) {
-    i = hunk_disassembleInstruction(hunk, i);
+    i = hunk_disassembleInstruction(hunk, i, lines);
   }
 
   logf("--- %s ---\n", name);
 }
 
+// What an operand of an instruction refers to, for hunk_verify.
+enum OperandKind : uint8 {
+  OPERAND_NONE,
+
+  OPERAND_SLOT,      // a slot in the current frame
+  OPERAND_BASE,      // the first of a call's argument slots
+  OPERAND_CONSTANT,  // an index into the hunk's constants
+  OPERAND_GLOBAL,    // an index into the program's globals
+  OPERAND_FUNCTION,  // a global which is known to be one function
+  OPERAND_JUMP,      // an offset from the end of the instruction
+  OPERAND_AMOUNT,    // how many values a return gives back: 0 or 1
+  OPERAND_ARITY,     // how many arguments a call passes
+  OPERAND_IMMEDIATE, // a value held in the operand itself
+};
+
+#define OPCODE_OPERANDS_MAX (5)
+
+struct OpcodeInfo {
+  // Which format the instruction belongs to. OP_JUMP is in both.
+  bool stack;
+  bool registers;
+
+  int operandCount;
+  OperandKind operands[OPCODE_OPERANDS_MAX];
+
+  // Stack format only: how many values it takes off the expression stack and
+  // puts back. Calls also take their arguments, and returns their amount.
+  int pops;
+  int pushes;
+};
+
+OpcodeInfo opcode_make(bool stack, int pops, int pushes, OperandKind a = OPERAND_NONE, OperandKind b = OPERAND_NONE, OperandKind c = OPERAND_NONE, OperandKind d = OPERAND_NONE) {
+  OpcodeInfo info = {};
+  info.stack = stack;
+  info.registers = !stack;
+  info.pops = pops;
+  info.pushes = pushes;
+
+  OperandKind operands[OPCODE_OPERANDS_MAX] = {a, b, c, d};
+
+  for (int i = 0; i < OPCODE_OPERANDS_MAX && operands[i] != OPERAND_NONE; i++) {
+    info.operands[i] = operands[i];
+    info.operandCount += 1;
+  }
+
+  return info;
+}
+
+OpcodeInfo opcode_makeRegister(OperandKind a = OPERAND_NONE, OperandKind b = OPERAND_NONE, OperandKind c = OPERAND_NONE, OperandKind d = OPERAND_NONE) {
+  return opcode_make(false, 0, 0, a, b, c, d);
+}
+
+// Describes the instruction in. Returns false if it isn't one.
+bool opcode_info(Instruction in, OpcodeInfo* info) {
+  switch (in) {
+    case OP_RETURN:         { *info = opcode_make(true, 0, 0, OPERAND_AMOUNT); } break;
+    case OP_SET_LOCAL:      { *info = opcode_make(true, 1, 0, OPERAND_SLOT); } break;
+    case OP_GET_LOCAL:      { *info = opcode_make(true, 0, 1, OPERAND_SLOT); } break;
+    case OP_TEE_LOCAL:      { *info = opcode_make(true, 1, 1, OPERAND_SLOT); } break;
+    case OP_SET_GLOBAL:     { *info = opcode_make(true, 1, 0, OPERAND_GLOBAL); } break;
+    case OP_GET_GLOBAL:     { *info = opcode_make(true, 0, 1, OPERAND_GLOBAL); } break;
+    case OP_CALL:           { *info = opcode_make(true, 1, 1, OPERAND_ARITY); } break;
+    case OP_CALL_DIRECT:    { *info = opcode_make(true, 0, 1, OPERAND_FUNCTION, OPERAND_ARITY); } break;
+    case OP_CONSTANT:       { *info = opcode_make(true, 0, 1, OPERAND_CONSTANT); } break;
+    case OP_CONSTANT_INT:
+    case OP_CONSTANT_BOOL:  { *info = opcode_make(true, 0, 1, OPERAND_IMMEDIATE); } break;
+    case OP_NEGATE:
+    case OP_LOG:            { *info = opcode_make(true, 1, 1); } break;
+    case OP_POP:            { *info = opcode_make(true, 1, 0); } break;
+    case OP_JUMP_IF_FALSE:  { *info = opcode_make(true, 1, 0, OPERAND_JUMP); } break;
+    case OP_JUMP_IF_NOT_EQ:
+    case OP_JUMP_IF_NOT_GT:
+    case OP_JUMP_IF_NOT_LT:
+    case OP_JUMP_IF_NOT_GTE:
+    case OP_JUMP_IF_NOT_LTE:  { *info = opcode_make(true, 2, 0, OPERAND_JUMP); } break;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_TEST_EQ:
+    case OP_TEST_GT:
+    case OP_TEST_LT:
+    case OP_TEST_GTE:
+    case OP_TEST_LTE:
+    case OP_TEST_OR:
+    case OP_TEST_AND:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_TEST_EQ_NUM:
+    case OP_TEST_EQ_BOOL:
+    case OP_TEST_GT_NUM:
+    case OP_TEST_LT_NUM:
+    case OP_TEST_GTE_NUM:
+    case OP_TEST_LTE_NUM:
+    case OP_TEST_AND_BOOL:
+    case OP_TEST_OR_BOOL:   { *info = opcode_make(true, 2, 1); } break;
+
+    case OP_JUMP:
+      {
+        *info = opcode_make(true, 0, 0, OPERAND_JUMP);
+        info->registers = true;
+      } break;
+
+    case OP_R_MOVE:           { *info = opcode_makeRegister(OPERAND_SLOT, OPERAND_SLOT); } break;
+    case OP_R_CONSTANT:       { *info = opcode_makeRegister(OPERAND_SLOT, OPERAND_CONSTANT); } break;
+    case OP_R_CONSTANT_INT:
+    case OP_R_CONSTANT_BOOL:  { *info = opcode_makeRegister(OPERAND_SLOT, OPERAND_IMMEDIATE); } break;
+    case OP_R_SET_GLOBAL:     { *info = opcode_makeRegister(OPERAND_GLOBAL, OPERAND_CONSTANT); } break;
+    case OP_R_CALL:           { *info = opcode_makeRegister(OPERAND_SLOT, OPERAND_GLOBAL, OPERAND_ARITY, OPERAND_BASE); } break;
+    case OP_R_CALL_DIRECT:    { *info = opcode_makeRegister(OPERAND_SLOT, OPERAND_FUNCTION, OPERAND_BASE); } break;
+    case OP_R_RETURN:         { *info = opcode_makeRegister(OPERAND_AMOUNT, OPERAND_SLOT); } break;
+    case OP_R_NEGATE:         { *info = opcode_makeRegister(OPERAND_SLOT, OPERAND_SLOT); } break;
+    case OP_R_JUMP_IF_FALSE:  { *info = opcode_makeRegister(OPERAND_SLOT, OPERAND_JUMP); } break;
+    case OP_R_JUMP_IF_NOT_EQ:
+    case OP_R_JUMP_IF_NOT_GT:
+    case OP_R_JUMP_IF_NOT_LT:
+    case OP_R_JUMP_IF_NOT_GTE:
+    case OP_R_JUMP_IF_NOT_LTE:  { *info = opcode_makeRegister(OPERAND_SLOT, OPERAND_SLOT, OPERAND_JUMP); } break;
+    case OP_R_LOG:            { *info = opcode_makeRegister(OPERAND_SLOT); } break;
+    case OP_R_ADD:
+    case OP_R_SUBTRACT:
+    case OP_R_MULTIPLY:
+    case OP_R_DIVIDE:
+    case OP_R_TEST_EQ:
+    case OP_R_TEST_GT:
+    case OP_R_TEST_LT:
+    case OP_R_TEST_GTE:
+    case OP_R_TEST_LTE:
+    case OP_R_TEST_OR:
+    case OP_R_TEST_AND:
+    case OP_R_ADD_NUM:
+    case OP_R_SUBTRACT_NUM:
+    case OP_R_MULTIPLY_NUM:
+    case OP_R_DIVIDE_NUM:
+    case OP_R_TEST_EQ_NUM:
+    case OP_R_TEST_EQ_BOOL:
+    case OP_R_TEST_GT_NUM:
+    case OP_R_TEST_LT_NUM:
+    case OP_R_TEST_GTE_NUM:
+    case OP_R_TEST_LTE_NUM:
+    case OP_R_TEST_AND_BOOL:
+    case OP_R_TEST_OR_BOOL:   { *info = opcode_makeRegister(OPERAND_SLOT, OPERAND_SLOT, OPERAND_SLOT); } break;
+
+    default:
+      {
+        Superinstruction* super = superinstruction_find(in);
+
+        OpcodeInfo first;
+        OpcodeInfo second;
+
+        if (super == 0 || !opcode_info(super->first, &first) || !opcode_info(super->second, &second)) {
+          return false;
+        }
+
+        *info = first;
+
+        for (int i = 0; i < second.operandCount; i++) {
+          info->operands[info->operandCount + i] = second.operands[i];
+        }
+
+        info->operandCount += second.operandCount;
+
+        // The second instruction takes what the first left on the stack
+        // before anything under it.
+        int shared = first.pushes < second.pops ? first.pushes : second.pops;
+
+        info->pops = first.pops + second.pops - shared;
+        info->pushes = first.pushes - shared + second.pushes;
+      } break;
+  }
+
+  assert(info->operandCount == opcode_operandCount(in));
+
+  return true;
+}
+
+// Marks in the stack heights hunk_verify works out for offsets which don't
+// start an instruction, and for instructions no path has reached yet.
+#define VERIFY_NOT_INSTRUCTION (-2)
+#define VERIFY_UNREACHED (-1)
+
+// NOTE: INTERNAL USE ONLY. Records that the instruction at target
+// can be reached with height values on the stack. Returns false if another
+// path reaches it with a different amount.
+bool hunk_verifyReach(int* heights, int target, int height) {
+  if (heights[target] == VERIFY_UNREACHED) {
+    heights[target] = height;
+
+    return true;
+  }
+
+  return heights[target] == height;
+}
+
+// Checks that hunk, and every function it defines, is safe for the VM to run
+// without checking anything as it goes:
+//
+// - every opcode exists and belongs to the hunk's format, and no instruction
+//   runs past the end of the code.
+// - slot, constant and global operands are in range, and direct calls are to
+//   globals which are known to be a function.
+// - jumps land on the start of an instruction, and no path runs off the end.
+// - in the stack format, nothing takes more values off the expression stack
+//   than are on it, and every path into an instruction leaves the same
+//   amount on it. The most it ever holds is recorded in maxStack.
+//
+// program is the hunk holding the globals. Logs what's wrong and returns false
+// if the hunk doesn't pass.
+//
+// NOTE: jump offsets are unsigned, so every jump goes forwards. That
+// means every path into an instruction comes from before it, and one pass in
+// order sees all of them.
+bool hunk_verify(Hunk* hunk, Hunk* program) {
+  if (hunk->verified) {
+    return true;
+  }
+
+  int count = hunk_getCount(hunk);
+  int globalCount = (int) array_count(program->globals);
+  int constantCount = (int) array_count(hunk->constants);
+  bool registers = hunk->format == BYTECODE_REGISTER;
+
+  // The number of values on the stack before each instruction.
+  int* heights = (int*) malloc(sizeof(int) * (count + 1));
+
+  for (int i = 0; i <= count; i++) {
+    heights[i] = VERIFY_NOT_INSTRUCTION;
+  }
+
+  const char* error = 0;
+  int offset = 0;
+
+  for (offset = 0; offset < count && error == 0; ) {
+    OpcodeInfo info;
+
+    if (!opcode_info(hunk->code[offset], &info) || (registers ? !info.registers : !info.stack)) {
+      error = "unknown instruction";
+    } else if (offset + 1 + info.operandCount > count) {
+      error = "instruction runs past the end of the code";
+    } else {
+      heights[offset] = VERIFY_UNREACHED;
+      offset += 1 + info.operandCount;
+    }
+  }
+
+  if (count == 0) {
+    error = "no code";
+  } else if (error == 0) {
+    heights[0] = 0;
+  }
+
+  int maxStack = 0;
+
+  for (offset = 0; offset < count && error == 0; ) {
+    OpcodeInfo info;
+    opcode_info(hunk->code[offset], &info);
+
+    Instruction* operands = hunk->code + offset + 1;
+    int next = offset + 1 + info.operandCount;
+
+    int pops = info.pops;
+    int jump = -1;
+
+    for (int i = 0; i < info.operandCount && error == 0; i++) {
+      int operand = (int) operands[i];
+
+      switch (info.operands[i]) {
+        case OPERAND_SLOT:
+          {
+            // Returns without a value don't read their slot.
+            bool unused = hunk->code[offset] == OP_R_RETURN && operands[0] == 0;
+
+            if (!unused && operand >= hunk->slotCount) {
+              error = "slot out of range";
+            }
+          } break;
+        case OPERAND_BASE:
+          {
+            // A call with no arguments can start the callee's frame just past
+            // this one's slots.
+            if (operand > hunk->slotCount) {
+              error = "slot out of range";
+            }
+          } break;
+        case OPERAND_CONSTANT:
+          {
+            if (operand >= constantCount) {
+              error = "constant out of range";
+            }
+          } break;
+        case OPERAND_GLOBAL:
+          {
+            if (operand >= globalCount) {
+              error = "global out of range";
+            }
+          } break;
+        case OPERAND_FUNCTION:
+          {
+            if (operand >= globalCount || program->globals[operand].function == 0) {
+              error = "direct call to something which isn't a known function";
+            }
+          } break;
+        case OPERAND_JUMP:
+          {
+            jump = next + operand;
+
+            if (jump >= count || heights[jump] == VERIFY_NOT_INSTRUCTION) {
+              error = "jump doesn't land on an instruction";
+            }
+          } break;
+        case OPERAND_AMOUNT:
+          {
+            if (operand > 1) {
+              error = "can only return one value";
+            }
+
+            if (!registers) {
+              pops += operand;
+            }
+          } break;
+        case OPERAND_ARITY:
+          {
+            if (!registers) {
+              pops += operand;
+            }
+          } break;
+        default:
+          {
+            // Immediates can be anything.
+          } break;
+      }
+    }
+
+    if (error != 0) {
+      break;
+    }
+
+    // Register calls take their arguments from slots base up to base + arity.
+    if (hunk->code[offset] == OP_R_CALL && operands[3] + operands[2] > hunk->slotCount) {
+      error = "call arguments out of range";
+
+      break;
+    }
+
+    int height = heights[offset];
+
+    // NOTE: the compiler leaves a return after the last statement
+    // of a function, which can't be reached if every path has returned
+    // already. Unreachable code is only checked for its operands.
+    if (height == VERIFY_UNREACHED) {
+      offset = next;
+
+      continue;
+    }
+
+    if (height < pops) {
+      error = "takes more values than are on the stack";
+
+      break;
+    }
+
+    height += info.pushes - pops;
+
+    if (height > maxStack) {
+      maxStack = height;
+    }
+
+    Instruction in = hunk->code[offset];
+
+    if (jump != -1 && !hunk_verifyReach(heights, jump, height)) {
+      error = "paths meet with different amounts on the stack";
+
+      break;
+    }
+
+    bool ends = in == OP_RETURN || in == OP_R_RETURN || in == OP_JUMP;
+
+    if (!ends) {
+      if (next == count) {
+        error = "runs off the end of the code";
+
+        break;
+      }
+
+      if (!hunk_verifyReach(heights, next, height)) {
+        error = "paths meet with different amounts on the stack";
+
+        break;
+      }
+    }
+
+    offset = next;
+  }
+
+  free(heights);
+
+  if (error != 0) {
+    logf("ERROR: invalid bytecode at %d: %s\n", offset, error);
+
+    return false;
+  }
+
+  hunk->maxStack = maxStack;
+  hunk->verified = true;
+
+  for (int i = 0; i < constantCount; i++) {
+    Value v = hunk->constants[i];
+
+    if (VALUE_IS_FUNCTION(v) && !hunk_verify(VALUE_AS_FUNCTION(v).hunk, program)) {
+      hunk->verified = false;
+
+      return false;
+    }
+  }
+
+  return true;
+}
+
 enum ProgramResult : uint32 {
   PROGRAM_RESULT_OK,
   PROGRAM_RESULT_COMPILE_ERROR,
   PROGRAM_RESULT_RUNTIME_ERROR
 };
 
-#define VM_STACK_MAX (256)
-#define VM_FRAME_MAX (32)
-#define VM_LOCALS_MAX (32)
-
+// NOTE: the value stack and the frame stack are reserved up front
+// with mmap, and the OS only backs the pages we actually touch, so they grow
+// on demand. Each is followed by a PROT_NONE guard page. Running off the end
+// faults on the guard, and vm_runWith turns that into a runtime error. This
+// means frame entries don't need bounds checks.
+//
+// Values are only checked against the end of the stack when a frame is
+// entered. hunk_verify has worked out the most the frame can hold, slots and
+// expression stack together, so pushes don't need checks either.
+//
+// Untouched pages cost nothing, so the stacks are reserved big enough for
+// millions of nested calls. Systems which won't reserve that much address
+// space get the most they will give, down to the minimums.
+#define VM_STACK_MAX (1 << 26)
+#define VM_STACK_MIN (1 << 16)
+#define VM_FRAME_MAX (1 << 22)
+#define VM_FRAME_MIN (1 << 12)
+
+// Most slots a register format frame can address.
+#define VM_LOCALS_MAX (256)
+
+// NOTE: frames don't own their locals. slots points into vm->stack,
+// and the first arity slots are the arguments exactly where the caller left
+// them. For the stack format the caller pushed them, and for the register
+// format they are the caller's argument registers. The frame's other locals
+// follow them, and in the stack format the frame's expression stack starts
+// after those. Returning just moves stackTop back down to slots.
+//
+// Locals aren't cleared when a frame is entered; the compiler never reads a
+// slot before writing to it.
 struct Frame {
   Hunk* hunk;
   Instruction* ip;
 
-  Value* originalStackPosition;
+  Value* slots;
 
-  Value slots[VM_LOCALS_MAX];
+  // Register format only: the slot in the calling frame which receives this
+  // frame's return value.
+  int returnSlot;
 };
 
 struct VM {
-  Table globals;
+  // Globals are resolved to indexes when compiling, so they live in a flat
+  // array. globalNames maps their names to those indexes, for looking them up
+  // from outside of the VM.
+  Value* globals;
+  int globalCount;
 
-  Value stack[VM_STACK_MAX];
+  // The function each global is known to be when compiling, or 0. See
+  // Global::function.
+  Hunk** functions;
+
+  Table globalNames;
+
+  Value* stack;
   Value* stackTop;
+  Value* stackEnd;
 
-  Frame frames[VM_FRAME_MAX];
+  Frame* frames;
   int frameCount;
+
+  // How many frames were reserved.
+  int frameCapacity;
+
+  // Where vm_runWith picks up if a guard page is hit.
+  sigjmp_buf overflow;
 };
 
-void vm_load(VM* vm, Hunk* hunk) {
-  table_init(&vm->globals);
-  vm->stackTop = vm->stack;
+psize vm_pageSize() {
+  return (psize) sysconf(_SC_PAGESIZE);
+}
+
+// Rounds size up to a whole number of pages.
+psize vm_pageAlign(psize size) {
+  psize page = vm_pageSize();
+
+  return (size + page - 1) / page * page;
+}
+
+// Reserves size bytes followed by a guard page. Returns 0 on failure.
+void* vm_reserve(psize size) {
+  size = vm_pageAlign(size);
+
+  uint8* base = (uint8*) mmap(0, size + vm_pageSize(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    return 0;
+  }
+
+  if (mprotect(base + size, vm_pageSize(), PROT_NONE) != 0) {
+    munmap(base, size + vm_pageSize());
+
+    return 0;
+  }
+
+  return base;
+}
+
+// Reserves room for as many as max elements of size bytes, halving the amount
+// until the reservation succeeds. Sets count to how many there is room for.
+// Returns 0 if not even min would fit.
+void* vm_reserveUpTo(psize size, int max, int min, int* count) {
+  for (int n = max; n >= min; n /= 2) {
+    void* base = vm_reserve(n * size);
+
+    if (base != 0) {
+      *count = n;
+
+      return base;
+    }
+  }
+
+  *count = 0;
+
+  return 0;
+}
+
+void vm_release(void* base, psize size) {
+  if (base != 0) {
+    munmap(base, vm_pageAlign(size) + vm_pageSize());
+  }
+}
+
+// Is addr inside the guard page after a region from vm_reserve?
+bool vm_inGuard(void* base, psize size, void* addr) {
+  uint8* guard = (uint8*) base + vm_pageAlign(size);
+
+  return base != 0 && (uint8*) addr >= guard && (uint8*) addr < guard + vm_pageSize();
+}
+
+void vm_free(VM* vm) {
+  free(vm->globals);
+  free(vm->functions);
+  table_free(&vm->globalNames);
+
+  vm->globals = 0;
+  vm->functions = 0;
+  vm->globalCount = 0;
+
+  vm_release(vm->stack, (vm->stackEnd - vm->stack) * sizeof(Value));
+  vm_release(vm->frames, vm->frameCapacity * sizeof(Frame));
+
+  vm->stack = 0;
+  vm->stackTop = 0;
+  vm->stackEnd = 0;
+
+  vm->frames = 0;
   vm->frameCount = 0;
+  vm->frameCapacity = 0;
+}
+
+// Gets vm ready to run hunk. Returns false if hunk doesn't pass hunk_verify,
+// or the stacks couldn't be reserved.
+bool vm_load(VM* vm, Hunk* hunk) {
+  if (!hunk_verify(hunk, hunk)) {
+    return false;
+  }
+
+  free(vm->globals);
+  free(vm->functions);
+  table_free(&vm->globalNames);
+
+  vm->globalCount = (int) array_count(hunk->globals);
+  vm->globals = (Value*) malloc(sizeof(Value) * (vm->globalCount + 1));
+  vm->functions = (Hunk**) malloc(sizeof(Hunk*) * (vm->globalCount + 1));
+
+  for (int i = 0; i < vm->globalCount; i++) {
+    Global global = hunk->globals[i];
+
+    vm->globals[i] = value_makeNil();
+    vm->functions[i] = global.function;
+
+    table_set(&vm->globalNames, VALUE_AS_STRING(global.name), value_make((double) i));
+  }
+
+  vm->frameCount = 0;
+
+  if (vm->stack == 0) {
+    int capacity = 0;
+
+    vm->stack = (Value*) vm_reserveUpTo(sizeof(Value), VM_STACK_MAX, VM_STACK_MIN, &capacity);
+    vm->stackEnd = vm->stack + capacity;
+  }
+
+  if (vm->frames == 0) {
+    vm->frames = (Frame*) vm_reserveUpTo(sizeof(Frame), VM_FRAME_MAX, VM_FRAME_MIN, &vm->frameCapacity);
+  }
 
-  Frame f = {};
+  if (vm->stack == 0 || vm->frames == 0) {
+    logf("ERROR: couldn't reserve the VM stacks\n");
 
-  f.hunk = hunk;
-  f.ip = f.hunk->code;
-  f.originalStackPosition = vm->stackTop;
+    vm_free(vm);
+
+    return false;
+  }
+
+  Frame* f = &vm->frames[vm->frameCount];
+
+  f->hunk = hunk;
+  f->ip = f->hunk->code;
+  f->slots = vm->stack;
+  f->returnSlot = 0;
+
+  vm->stackTop = f->slots + hunk->slotCount;
 
-  vm->frames[vm->frameCount] = f;
   vm->frameCount += 1;
+
+  return true;
+}
+
+// Gets the value of the global called name. Returns false if there isn't one.
+bool vm_getGlobal(VM* vm, String name, Value* v) {
+  Value index;
+
+  if (!table_get(&vm->globalNames, name, &index)) {
+    return false;
+  }
+
+  *v = vm->globals[(int) VALUE_AS_NUMBER(index)];
+
+  return true;
 }
 
 void vm_stack_push(VM* vm, Value val) {
@@ -227,243 +1510,398 @@ Value vm_stack_pop(VM* vm) {
   return *vm->stackTop;
 }
 
-ProgramResult vm_run(VM* vm) {
-#define READ() (*frame->ip++)
-  while (vm->frameCount > 0) {
-    Frame* frame = &vm->frames[vm->frameCount -1];
+// NOTE: vm_run can dispatch instructions in two ways. The portable
+// way is a switch inside a loop. Where the compiler supports computed gotos
+// (GCC and clang) we can also jump straight from the end of one handler to
+// the next through a table of label addresses. This saves the bounds check
+// and the jump back to the top of the loop, and gives the branch predictor
+// one indirect jump per handler to learn instead of a single shared one.
+//
+// Both modes share the same handler code. Define VM_NO_COMPUTED_GOTO to build
+// without the threaded mode.
+#if defined(__GNUC__) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO
+#endif
 
-#ifdef DEBUG
-    for (int i = 0; i < VM_LOCALS_MAX; i++) {
-      if (frame->slots[i].type == VALUE_NIL) {
-        continue;
-      }
+enum VMDispatch : uint32 {
+  VM_DISPATCH_SWITCH,
+  VM_DISPATCH_THREADED,
+};
 
-      logf("slot %d: ", i);
-      value_logln(frame->slots[i]);
-    }
+#ifdef VM_COMPUTED_GOTO
+#define VM_DISPATCH_DEFAULT (VM_DISPATCH_THREADED)
+#else
+#define VM_DISPATCH_DEFAULT (VM_DISPATCH_SWITCH)
+#endif
 
-    for (Value* v = vm->stack; v != (vm->stackTop); v += 1) {
-      logf("stack: ");
+#ifdef DEBUG
+#define VM_TRACE() \
+  do { \
+    for (int i = 0; i < frame->hunk->slotCount; i++) { \
+      logf("slot %d: ", i); \
+      value_logln(frame->slots[i]); \
+    } \
+    for (Value* v = frame->slots + frame->hunk->slotCount; v < vm->stackTop; v += 1) { \
+      logf("stack: "); \
+      value_logln(*v); \
+    } \
+    hunk_disassembleInstruction(frame->hunk, (int) (ip - frame->hunk->code)); \
+  } while (false)
+#else
+#define VM_TRACE()
+#endif
 
-      value_logln(*v);
-    }
+// NOTE: build with VM_PROFILE to count which instructions run, and
+// which run one after another, for `loaf-bench profile`. Runs of instructions
+// which come up often are candidates for superinstructions.
+#ifdef VM_PROFILE
+struct VMProfile {
+  uint64 ops[OP_COUNT];
+  uint64 pairs[OP_COUNT][OP_COUNT];
+  uint64 triples[OP_COUNT][OP_COUNT][OP_COUNT];
+
+  // The last two instructions to run, or OP_COUNT before there were any.
+  Instruction last[2];
+};
 
-    int offset = (int) (frame->ip - frame->hunk->code);
-    hunk_disassembleInstruction(frame->hunk, offset);
-#endif
+VMProfile vm_profile = {};
 
-    Instruction in = READ();
+// Forgets the last instructions run, so the next run isn't counted as
+// following on from the one before.
+void vm_profileStart() {
+  vm_profile.last[0] = OP_COUNT;
+  vm_profile.last[1] = OP_COUNT;
+}
 
-    switch (in) {
-      case OP_RETURN:
-        {
-          int amount = (int) READ();
+void vm_profileRecord(Instruction in) {
+  Instruction a = vm_profile.last[0];
+  Instruction b = vm_profile.last[1];
 
-          Value ret = {};
+  vm_profile.ops[in] += 1;
 
-          if (amount != 0) {
-            ret = vm_stack_pop(vm);
-          }
+  if (b != OP_COUNT) {
+    vm_profile.pairs[b][in] += 1;
+  }
 
-          vm->stackTop = frame->originalStackPosition;
+  if (a != OP_COUNT) {
+    vm_profile.triples[a][b][in] += 1;
+  }
 
-          if (amount != 0) {
-            vm_stack_push(vm, ret);
-          }
+  vm_profile.last[0] = b;
+  vm_profile.last[1] = in;
+}
 
-          vm->frameCount -= 1;
-        } break;
-      case OP_CONSTANT:
-        {
-          Instruction id = READ();
-          Value val = frame->hunk->constants[id];
+#define VM_PROFILE_RECORD() vm_profileRecord(*ip)
+#else
+#define VM_PROFILE_RECORD()
+#endif
 
-          vm_stack_push(vm, val);
-        } break;
-      case OP_SET_LOCAL:
-        {
-          Instruction id = READ();
+// The loops below expect frame, ip and in as locals, and (when built with
+// computed gotos) a dispatchTable filled with the address of each CASE.
+#define READ() (*ip++)
+
+#ifdef VM_COMPUTED_GOTO
+// NOTE: the threaded path relies on hunk_verify having checked every
+// opcode, as there is no bounds check before indexing dispatchTable.
+#define CASE(Code) case Code: op_ ## Code:
+#define NEXT() \
+  do { \
+    VM_TRACE(); \
+    VM_PROFILE_RECORD(); \
+    if (Threaded) { \
+      goto *dispatchTable[READ()]; \
+    } \
+    goto dispatch; \
+  } while (false)
+#else
+#define CASE(Code) case Code:
+#define NEXT() \
+  do { \
+    VM_TRACE(); \
+    VM_PROFILE_RECORD(); \
+    goto dispatch; \
+  } while (false)
+#endif
 
-          frame->slots[id] = vm_stack_pop(vm);
-        } break;
-      case OP_GET_LOCAL:
-        {
-          Instruction id = READ();
-          Value val = frame->slots[id];
+// Threaded is a template parameter so that each mode gets its own copy of the
+// loop with the unused dispatch path folded away.
+template <bool Threaded>
+ProgramResult vm_execute(VM* vm) {
+  // NOTE: frame and ip live in locals for the whole run. They are
+  // only reloaded when the current frame changes (OP_CALL and OP_RETURN), and
+  // ip is only written back to the frame when we call into another one.
+  Frame* frame = &vm->frames[vm->frameCount - 1];
+  Instruction* ip = frame->ip;
 
-          vm_stack_push(vm, val);
-        } break;
-      case OP_SET_GLOBAL:
-        {
-          Value func = vm_stack_pop(vm);
-          Value name = vm_stack_pop(vm);
+  Instruction in;
 
-          if (name.type != VALUE_STRING) {
-            logf("ERROR: Expecting name in string format\n");
+#ifdef VM_COMPUTED_GOTO
+  static void* dispatchTable[OP_COUNT] = {};
 
-            return PROGRAM_RESULT_RUNTIME_ERROR;
-          }
+  if (Threaded && dispatchTable[OP_RETURN] == 0) {
+    for (int i = 0; i < OP_COUNT; i++) {
+      dispatchTable[i] = &&op_unknown;
+    }
 
-          table_set(&vm->globals, name.as.string, func);
-        } break;
-      case OP_GET_GLOBAL:
-        {
-          Value name = vm_stack_pop(vm);
+#define LABEL(Code) dispatchTable[Code] = &&op_ ## Code
+    LABEL(OP_RETURN);
+    LABEL(OP_SET_LOCAL);
+    LABEL(OP_GET_LOCAL);
+    LABEL(OP_TEE_LOCAL);
+    LABEL(OP_SET_GLOBAL);
+    LABEL(OP_GET_GLOBAL);
+    LABEL(OP_CALL);
+    LABEL(OP_CALL_DIRECT);
+    LABEL(OP_CONSTANT);
+    LABEL(OP_CONSTANT_INT);
+    LABEL(OP_CONSTANT_BOOL);
+    LABEL(OP_NEGATE);
+    LABEL(OP_ADD);
+    LABEL(OP_SUBTRACT);
+    LABEL(OP_MULTIPLY);
+    LABEL(OP_DIVIDE);
+    LABEL(OP_TEST_EQ);
+    LABEL(OP_TEST_GT);
+    LABEL(OP_TEST_LT);
+    LABEL(OP_TEST_GTE);
+    LABEL(OP_TEST_LTE);
+    LABEL(OP_TEST_OR);
+    LABEL(OP_TEST_AND);
+    LABEL(OP_JUMP);
+    LABEL(OP_JUMP_IF_FALSE);
+    LABEL(OP_LOG);
+    LABEL(OP_POP);
+    LABEL(OP_ADD_NUM);
+    LABEL(OP_SUBTRACT_NUM);
+    LABEL(OP_MULTIPLY_NUM);
+    LABEL(OP_DIVIDE_NUM);
+    LABEL(OP_TEST_EQ_NUM);
+    LABEL(OP_TEST_EQ_BOOL);
+    LABEL(OP_TEST_GT_NUM);
+    LABEL(OP_TEST_LT_NUM);
+    LABEL(OP_TEST_GTE_NUM);
+    LABEL(OP_TEST_LTE_NUM);
+    LABEL(OP_TEST_AND_BOOL);
+    LABEL(OP_TEST_OR_BOOL);
+    LABEL(OP_JUMP_IF_NOT_EQ);
+    LABEL(OP_JUMP_IF_NOT_GT);
+    LABEL(OP_JUMP_IF_NOT_LT);
+    LABEL(OP_JUMP_IF_NOT_GTE);
+    LABEL(OP_JUMP_IF_NOT_LTE);
+    LABEL(OP_GET_LOCAL_CONSTANT_INT);
+    LABEL(OP_GET_LOCAL_GET_LOCAL);
+#undef LABEL
+  }
+#endif
 
-          if (name.type != VALUE_STRING) {
-            logf("ERROR: Expecting name in string format\n");
+  NEXT();
 
-            return PROGRAM_RESULT_RUNTIME_ERROR;
-          }
+dispatch:
+  in = READ();
 
-          Value func;
+  switch (in) {
+    CASE(OP_RETURN)
+      {
+        int amount = (int) READ();
 
-          if (!table_get(&vm->globals, name.as.string, &func)) {
-            logf("ERROR: unknown function\n");
+        // NOTE: calls always leave one value behind, so that
+        // hunk_verify knows how much is on the stack after one.
+        Value ret = value_makeNil();
 
-            return PROGRAM_RESULT_RUNTIME_ERROR;
-          }
+        if (amount != 0) {
+          ret = vm_stack_pop(vm);
+        }
 
-          vm_stack_push(vm, func);
-        } break;
-      case OP_CALL:
-        {
-          Value func = vm_stack_pop(vm);
-          int arity = (int) READ();
+        vm->stackTop = frame->slots;
 
-          if (func.type != VALUE_FUNCTION) {
-            logf("ERROR Expecting func to be a function\n");
+        vm_stack_push(vm, ret);
 
-            return PROGRAM_RESULT_RUNTIME_ERROR;
-          }
+        vm->frameCount -= 1;
 
-          if (vm->frameCount >= VM_FRAME_MAX - 1) {
-            logf("ERROR: too many frames\n");
+        if (vm->frameCount == 0) {
+          return PROGRAM_RESULT_OK;
+        }
 
-            return PROGRAM_RESULT_RUNTIME_ERROR;
-          }
+        frame = &vm->frames[vm->frameCount - 1];
+        ip = frame->ip;
+      } NEXT();
+    CASE(OP_CONSTANT)
+      {
+        Instruction id = READ();
+        Value val = frame->hunk->constants[id];
 
-          Frame f = {};
+        vm_stack_push(vm, val);
+      } NEXT();
+    CASE(OP_CONSTANT_INT)
+      {
+        vm_stack_push(vm, value_make((double) (int16) READ()));
+      } NEXT();
+    CASE(OP_CONSTANT_BOOL)
+      {
+        vm_stack_push(vm, value_make(READ() != 0));
+      } NEXT();
+    CASE(OP_SET_LOCAL)
+      {
+        Instruction id = READ();
 
-          for (int i = arity - 1; i >= 0; i--) {
-            Value param = vm_stack_pop(vm);
+        frame->slots[id] = vm_stack_pop(vm);
+      } NEXT();
+    CASE(OP_TEE_LOCAL)
+      {
+        Instruction id = READ();
 
-            f.slots[i] = param;
-          }
+        frame->slots[id] = vm->stackTop[-1];
+      } NEXT();
+    CASE(OP_GET_LOCAL)
+      {
+        Instruction id = READ();
+        Value val = frame->slots[id];
 
-          Hunk* newHunk = func.as.function.hunk;
+        vm_stack_push(vm, val);
+      } NEXT();
+    CASE(OP_SET_GLOBAL)
+      {
+        vm->globals[READ()] = vm_stack_pop(vm);
+      } NEXT();
+    CASE(OP_GET_GLOBAL)
+      {
+        Value func = vm->globals[READ()];
 
-          f.hunk = newHunk;
-          f.ip = f.hunk->code;
-          f.originalStackPosition = vm->stackTop;
+        // NOTE: globals are nil until their declaration has run.
+        if (VALUE_IS_NIL(func)) {
+          logf("ERROR: unknown function\n");
 
-          vm->frames[vm->frameCount] = f;
-          vm->frameCount += 1;
-        } break;
-      case OP_JUMP_IF_FALSE:
-        {
-          Value v = vm_stack_pop(vm);
-          Instruction jumpOffset = READ();
+          return PROGRAM_RESULT_RUNTIME_ERROR;
+        }
+
+        vm_stack_push(vm, func);
+      } NEXT();
+    // Pushes a frame running NewHunk, with its locals starting at Slots.
+#define ENTER(NewHunk, Slots) \
+        Hunk* newHunk = (NewHunk); \
+        Value* slots = (Slots); \
+        if (slots + newHunk->slotCount + newHunk->maxStack > vm->stackEnd) { \
+          logf("ERROR: stack overflow\n"); \
+          return PROGRAM_RESULT_RUNTIME_ERROR; \
+        } \
+        frame->ip = ip; \
+        frame = &vm->frames[vm->frameCount]; \
+        vm->frameCount += 1; \
+        frame->hunk = newHunk; \
+        frame->slots = slots; \
+        vm->stackTop = slots + newHunk->slotCount; \
+        ip = newHunk->code;
+    CASE(OP_CALL)
+      {
+        Value func = vm_stack_pop(vm);
+        int arity = (int) READ();
 
-          if (v.type == VALUE_BOOL && v.as.boolean == false) {
-            frame->ip += jumpOffset;
-          }
-        } break;
-      case OP_JUMP:
-        {
-          Instruction jumpOffset = READ();
-
-          frame->ip += jumpOffset;
-        } break;
-      case OP_NEGATE:
-        {
-          Value v = vm_stack_pop(vm);
+        if (!VALUE_IS_FUNCTION(func)) {
+          logf("ERROR Expecting func to be a function\n");
 
-          if (!VALUE_IS_NUMBER(v)) {
-            logf("RUNTIME ERROR: Value is not a number.");
+          return PROGRAM_RESULT_RUNTIME_ERROR;
+        }
 
-            return PROGRAM_RESULT_RUNTIME_ERROR;
-          }
+        ENTER(VALUE_AS_FUNCTION(func).hunk, vm->stackTop - arity);
+      } NEXT();
+    CASE(OP_CALL_DIRECT)
+      {
+        // NOTE: typeCheck has made sure the function is declared
+        // before this runs, and that the arguments match it.
+        Hunk* callee = vm->functions[READ()];
+        int arity = (int) READ();
+
+        ENTER(callee, vm->stackTop - arity);
+      } NEXT();
+#undef ENTER
+    CASE(OP_JUMP_IF_FALSE)
+      {
+        Value v = vm_stack_pop(vm);
+        Instruction jumpOffset = READ();
+
+        if (VALUE_IS_BOOL(v) && !VALUE_AS_BOOL(v)) {
+          ip += jumpOffset;
+        }
+      } NEXT();
+    CASE(OP_JUMP)
+      {
+        Instruction jumpOffset = READ();
 
-          v.as.number *= -1;
+        ip += jumpOffset;
+      } NEXT();
+    CASE(OP_NEGATE)
+      {
+        Value v = vm_stack_pop(vm);
 
-          vm_stack_push(vm, v);
-        } break;
-      case OP_LOG:
-        {
-          Value v = vm_stack_pop(vm);
+        if (!VALUE_IS_NUMBER(v)) {
+          logf("RUNTIME ERROR: Value is not a number.");
 
-          value_println(v);
+          return PROGRAM_RESULT_RUNTIME_ERROR;
+        }
 
-          vm_stack_push(vm, v);
-        } break;
-      case OP_TEST_EQ:
-        {
-          Value b = vm_stack_pop(vm);
-          Value a = vm_stack_pop(vm);
+        vm_stack_push(vm, value_make(-VALUE_AS_NUMBER(v)));
+      } NEXT();
+    CASE(OP_LOG)
+      {
+        Value v = vm_stack_pop(vm);
 
-          Value c = {};
-          c.type = VALUE_BOOL;
+        value_println(v);
 
-          c.as.boolean = value_equals(a, b);
+        vm_stack_push(vm, v);
+      } NEXT();
+    CASE(OP_POP)
+      {
+        vm->stackTop -= 1;
+      } NEXT();
+    CASE(OP_TEST_EQ)
+      {
+        Value b = vm_stack_pop(vm);
+        Value a = vm_stack_pop(vm);
 
-          vm_stack_push(vm, c);
-        } break;
+        vm_stack_push(vm, value_make(value_equals(a, b)));
+      } NEXT();
 #define COMPARE(Name, Op) \
-      case Name: \
-        { \
-          Value b = vm_stack_pop(vm); \
-          Value a = vm_stack_pop(vm); \
-          if (!VALUE_IS_NUMBER(a) || !VALUE_IS_NUMBER(b)) { \
-            logf("ERROR: values should be numbers\n");\
-            return PROGRAM_RESULT_RUNTIME_ERROR; \
-          } \
-          Value c = {}; \
-          c.type = VALUE_BOOL; \
-          c.as.boolean = a.as.number Op b.as.number; \
-          vm_stack_push(vm, c); \
-        } break;
-      COMPARE(OP_TEST_LT, <)
-      COMPARE(OP_TEST_LTE, <=)
-      COMPARE(OP_TEST_GT, >)
-      COMPARE(OP_TEST_GTE, >=)
+    CASE(Name) \
+      { \
+        Value b = vm_stack_pop(vm); \
+        Value a = vm_stack_pop(vm); \
+        if (!VALUE_IS_NUMBER(a) || !VALUE_IS_NUMBER(b)) { \
+          logf("ERROR: values should be numbers\n");\
+          return PROGRAM_RESULT_RUNTIME_ERROR; \
+        } \
+        vm_stack_push(vm, value_make(VALUE_AS_NUMBER(a) Op VALUE_AS_NUMBER(b))); \
+      } NEXT();
+    COMPARE(OP_TEST_LT, <)
+    COMPARE(OP_TEST_LTE, <=)
+    COMPARE(OP_TEST_GT, >)
+    COMPARE(OP_TEST_GTE, >=)
 #undef COMPARE
-      case OP_TEST_AND:
-        {
-          Value b = vm_stack_pop(vm);
-          Value a = vm_stack_pop(vm);
-
-          if (!VALUE_IS_BOOL(a) || !VALUE_IS_BOOL(b)) {
-            logf("ERROR: values should be bools\n");
-
-            return PROGRAM_RESULT_RUNTIME_ERROR;
-          }
-
-          Value c = {};
-          c.type = VALUE_BOOL;
-
-          c.as.boolean = a.as.boolean && b.as.boolean;
+    CASE(OP_TEST_AND)
+      {
+        Value b = vm_stack_pop(vm);
+        Value a = vm_stack_pop(vm);
 
-          vm_stack_push(vm, c);
-        } break;
-      case OP_TEST_OR:
-        {
-          Value b = vm_stack_pop(vm);
-          Value a = vm_stack_pop(vm);
+        if (!VALUE_IS_BOOL(a) || !VALUE_IS_BOOL(b)) {
+          logf("ERROR: values should be bools\n");
 
-          if (!VALUE_IS_BOOL(a) || !VALUE_IS_BOOL(b)) {
-            logf("ERROR: values should be bools\n");
+          return PROGRAM_RESULT_RUNTIME_ERROR;
+        }
 
-            return PROGRAM_RESULT_RUNTIME_ERROR;
-          }
+        vm_stack_push(vm, value_make(VALUE_AS_BOOL(a) && VALUE_AS_BOOL(b)));
+      } NEXT();
+    CASE(OP_TEST_OR)
+      {
+        Value b = vm_stack_pop(vm);
+        Value a = vm_stack_pop(vm);
 
-          Value c = {};
-          c.type = VALUE_BOOL;
+        if (!VALUE_IS_BOOL(a) || !VALUE_IS_BOOL(b)) {
+          logf("ERROR: values should be bools\n");
 
-          c.as.boolean = a.as.boolean || b.as.boolean;
+          return PROGRAM_RESULT_RUNTIME_ERROR;
+        }
 
-          vm_stack_push(vm, c);
-        } break;
+        vm_stack_push(vm, value_make(VALUE_AS_BOOL(a) || VALUE_AS_BOOL(b)));
+      } NEXT();
 #define BINARY_OP(op) \
   Value b = vm_stack_pop(vm); \
   Value a = vm_stack_pop(vm); \
@@ -471,36 +1909,535 @@ ProgramResult vm_run(VM* vm) {
     logf("INVALID BINARY OPERATION: '%s'\n", #op); \
     return PROGRAM_RESULT_RUNTIME_ERROR; \
   } \
-  Value c = {}; \
-  c.type = VALUE_NUMBER; \
-  c.as.number = a.as.number op b.as.number; \
-  vm_stack_push(vm, c);
-      case OP_ADD:
-        {
-          BINARY_OP(+);
-        } break;
-      case OP_SUBTRACT:
-        {
-          BINARY_OP(-);
-        } break;
-      case OP_MULTIPLY:
-        {
-          BINARY_OP(*);
-        } break;
-      case OP_DIVIDE:
-        {
-          BINARY_OP(/);
-        } break;
+  vm_stack_push(vm, value_make(VALUE_AS_NUMBER(a) op VALUE_AS_NUMBER(b)));
+    CASE(OP_ADD)
+      {
+        BINARY_OP(+);
+      } NEXT();
+    CASE(OP_SUBTRACT)
+      {
+        BINARY_OP(-);
+      } NEXT();
+    CASE(OP_MULTIPLY)
+      {
+        BINARY_OP(*);
+      } NEXT();
+    CASE(OP_DIVIDE)
+      {
+        BINARY_OP(/);
+      } NEXT();
 #undef BINARY_OP
-      default:
-        {
-          logf("Unknown instruction. Exiting...\n");
 
-          return PROGRAM_RESULT_RUNTIME_ERROR;
-        } break;
+    // The operands of these have been type checked, so the result just
+    // replaces them on the stack.
+#define TYPED_OP(Name, Type, As, Result) \
+    CASE(Name) \
+      { \
+        Type b = As(vm->stackTop[-1]); \
+        Type a = As(vm->stackTop[-2]); \
+        vm->stackTop -= 1; \
+        vm->stackTop[-1] = value_make(Result); \
+      } NEXT();
+    TYPED_OP(OP_ADD_NUM, double, VALUE_AS_NUMBER, a + b)
+    TYPED_OP(OP_SUBTRACT_NUM, double, VALUE_AS_NUMBER, a - b)
+    TYPED_OP(OP_MULTIPLY_NUM, double, VALUE_AS_NUMBER, a * b)
+    TYPED_OP(OP_DIVIDE_NUM, double, VALUE_AS_NUMBER, a / b)
+    TYPED_OP(OP_TEST_EQ_NUM, double, VALUE_AS_NUMBER, us_equals(a, b))
+    TYPED_OP(OP_TEST_EQ_BOOL, bool, VALUE_AS_BOOL, a == b)
+    TYPED_OP(OP_TEST_GT_NUM, double, VALUE_AS_NUMBER, a > b)
+    TYPED_OP(OP_TEST_LT_NUM, double, VALUE_AS_NUMBER, a < b)
+    TYPED_OP(OP_TEST_GTE_NUM, double, VALUE_AS_NUMBER, a >= b)
+    TYPED_OP(OP_TEST_LTE_NUM, double, VALUE_AS_NUMBER, a <= b)
+    TYPED_OP(OP_TEST_AND_BOOL, bool, VALUE_AS_BOOL, a && b)
+    TYPED_OP(OP_TEST_OR_BOOL, bool, VALUE_AS_BOOL, a || b)
+#undef TYPED_OP
+#define JUMP_UNLESS(Name, Result) \
+    CASE(Name) \
+      { \
+        double b = VALUE_AS_NUMBER(vm->stackTop[-1]); \
+        double a = VALUE_AS_NUMBER(vm->stackTop[-2]); \
+        vm->stackTop -= 2; \
+        Instruction jumpOffset = READ(); \
+        if (!(Result)) { \
+          ip += jumpOffset; \
+        } \
+      } NEXT();
+    JUMP_UNLESS(OP_JUMP_IF_NOT_EQ, us_equals(a, b))
+    JUMP_UNLESS(OP_JUMP_IF_NOT_GT, a > b)
+    JUMP_UNLESS(OP_JUMP_IF_NOT_LT, a < b)
+    JUMP_UNLESS(OP_JUMP_IF_NOT_GTE, a >= b)
+    JUMP_UNLESS(OP_JUMP_IF_NOT_LTE, a <= b)
+#undef JUMP_UNLESS
+
+    // Superinstructions: the first instruction's work, then the second's.
+    CASE(OP_GET_LOCAL_CONSTANT_INT)
+      {
+        vm_stack_push(vm, frame->slots[READ()]);
+        vm_stack_push(vm, value_make((double) (int16) READ()));
+      } NEXT();
+    CASE(OP_GET_LOCAL_GET_LOCAL)
+      {
+        vm_stack_push(vm, frame->slots[READ()]);
+        vm_stack_push(vm, frame->slots[READ()]);
+      } NEXT();
+    default:
+#ifdef VM_COMPUTED_GOTO
+    op_unknown:
+#endif
+      {
+        logf("Unknown instruction. Exiting...\n");
+
+        return PROGRAM_RESULT_RUNTIME_ERROR;
+      } break;
+  }
+
+  return PROGRAM_RESULT_RUNTIME_ERROR;
+}
+
+template <bool Threaded>
+ProgramResult vm_executeRegisters(VM* vm) {
+  Frame* frame = &vm->frames[vm->frameCount - 1];
+  Instruction* ip = frame->ip;
+
+  Instruction in;
+
+#ifdef VM_COMPUTED_GOTO
+  static void* dispatchTable[OP_COUNT] = {};
+
+  if (Threaded && dispatchTable[OP_R_RETURN] == 0) {
+    for (int i = 0; i < OP_COUNT; i++) {
+      dispatchTable[i] = &&op_unknown;
     }
+
+#define LABEL(Code) dispatchTable[Code] = &&op_ ## Code
+    LABEL(OP_R_MOVE);
+    LABEL(OP_R_CONSTANT);
+    LABEL(OP_R_CONSTANT_INT);
+    LABEL(OP_R_CONSTANT_BOOL);
+    LABEL(OP_R_SET_GLOBAL);
+    LABEL(OP_R_CALL);
+    LABEL(OP_R_CALL_DIRECT);
+    LABEL(OP_R_RETURN);
+    LABEL(OP_R_NEGATE);
+    LABEL(OP_R_ADD);
+    LABEL(OP_R_SUBTRACT);
+    LABEL(OP_R_MULTIPLY);
+    LABEL(OP_R_DIVIDE);
+    LABEL(OP_R_TEST_EQ);
+    LABEL(OP_R_TEST_GT);
+    LABEL(OP_R_TEST_LT);
+    LABEL(OP_R_TEST_GTE);
+    LABEL(OP_R_TEST_LTE);
+    LABEL(OP_R_TEST_OR);
+    LABEL(OP_R_TEST_AND);
+    LABEL(OP_JUMP);
+    LABEL(OP_R_JUMP_IF_FALSE);
+    LABEL(OP_R_LOG);
+    LABEL(OP_R_ADD_NUM);
+    LABEL(OP_R_SUBTRACT_NUM);
+    LABEL(OP_R_MULTIPLY_NUM);
+    LABEL(OP_R_DIVIDE_NUM);
+    LABEL(OP_R_TEST_EQ_NUM);
+    LABEL(OP_R_TEST_EQ_BOOL);
+    LABEL(OP_R_TEST_GT_NUM);
+    LABEL(OP_R_TEST_LT_NUM);
+    LABEL(OP_R_TEST_GTE_NUM);
+    LABEL(OP_R_TEST_LTE_NUM);
+    LABEL(OP_R_TEST_AND_BOOL);
+    LABEL(OP_R_TEST_OR_BOOL);
+    LABEL(OP_R_JUMP_IF_NOT_EQ);
+    LABEL(OP_R_JUMP_IF_NOT_GT);
+    LABEL(OP_R_JUMP_IF_NOT_LT);
+    LABEL(OP_R_JUMP_IF_NOT_GTE);
+    LABEL(OP_R_JUMP_IF_NOT_LTE);
+    LABEL(OP_R_CONSTANT_INT_JUMP_IF_NOT_EQ);
+    LABEL(OP_R_CONSTANT_INT_ADD_NUM);
+    LABEL(OP_R_CONSTANT_INT_SUBTRACT_NUM);
+    LABEL(OP_R_CONSTANT_INT_DIVIDE_NUM);
+#undef LABEL
   }
+#endif
+
+#define REG(Operand) (frame->slots[(Operand)])
+
+  NEXT();
+
+dispatch:
+  in = READ();
+
+  switch (in) {
+    CASE(OP_R_MOVE)
+      {
+        Instruction dst = READ();
+        Instruction src = READ();
+
+        REG(dst) = REG(src);
+      } NEXT();
+    CASE(OP_R_CONSTANT)
+      {
+        Instruction dst = READ();
+        Instruction id = READ();
+
+        REG(dst) = frame->hunk->constants[id];
+      } NEXT();
+    CASE(OP_R_CONSTANT_INT)
+      {
+        Instruction dst = READ();
+
+        REG(dst) = value_make((double) (int16) READ());
+      } NEXT();
+    CASE(OP_R_CONSTANT_BOOL)
+      {
+        Instruction dst = READ();
+
+        REG(dst) = value_make(READ() != 0);
+      } NEXT();
+    CASE(OP_R_SET_GLOBAL)
+      {
+        Instruction global = READ();
+
+        vm->globals[global] = frame->hunk->constants[READ()];
+      } NEXT();
+    // Pushes a frame running NewHunk, with its registers starting at Slots.
+#define ENTER(NewHunk, Slots, ReturnSlot) \
+        Hunk* newHunk = (NewHunk); \
+        Value* slots = (Slots); \
+        if (slots + newHunk->slotCount > vm->stackEnd) { \
+          logf("ERROR: stack overflow\n"); \
+          return PROGRAM_RESULT_RUNTIME_ERROR; \
+        } \
+        frame->ip = ip; \
+        frame = &vm->frames[vm->frameCount]; \
+        vm->frameCount += 1; \
+        frame->hunk = newHunk; \
+        frame->slots = slots; \
+        frame->returnSlot = (ReturnSlot); \
+        ip = newHunk->code;
+    CASE(OP_R_CALL)
+      {
+        Instruction dst = READ();
+        Value func = vm->globals[READ()];
+        ip += 1; // arity: the arguments are already in place
+        Instruction base = READ();
+
+        if (VALUE_IS_NIL(func)) {
+          logf("ERROR: unknown function\n");
+
+          return PROGRAM_RESULT_RUNTIME_ERROR;
+        }
+
+        if (!VALUE_IS_FUNCTION(func)) {
+          logf("ERROR Expecting func to be a function\n");
+
+          return PROGRAM_RESULT_RUNTIME_ERROR;
+        }
+
+        ENTER(VALUE_AS_FUNCTION(func).hunk, &REG(base), dst);
+      } NEXT();
+    CASE(OP_R_CALL_DIRECT)
+      {
+        Instruction dst = READ();
+        Hunk* callee = vm->functions[READ()];
+        Instruction base = READ();
+
+        ENTER(callee, &REG(base), dst);
+      } NEXT();
+#undef ENTER
+    CASE(OP_R_RETURN)
+      {
+        int amount = (int) READ();
+        Value ret = REG(READ());
+
+        int returnSlot = frame->returnSlot;
+
+        vm->frameCount -= 1;
+
+        if (vm->frameCount == 0) {
+          return PROGRAM_RESULT_OK;
+        }
+
+        frame = &vm->frames[vm->frameCount - 1];
+        ip = frame->ip;
+
+        if (amount != 0) {
+          REG(returnSlot) = ret;
+        }
+      } NEXT();
+    CASE(OP_R_JUMP_IF_FALSE)
+      {
+        Value v = REG(READ());
+        Instruction jumpOffset = READ();
+
+        if (VALUE_IS_BOOL(v) && !VALUE_AS_BOOL(v)) {
+          ip += jumpOffset;
+        }
+      } NEXT();
+    CASE(OP_JUMP)
+      {
+        Instruction jumpOffset = READ();
+
+        ip += jumpOffset;
+      } NEXT();
+    CASE(OP_R_NEGATE)
+      {
+        Instruction dst = READ();
+        Value v = REG(READ());
+
+        if (!VALUE_IS_NUMBER(v)) {
+          logf("RUNTIME ERROR: Value is not a number.");
+
+          return PROGRAM_RESULT_RUNTIME_ERROR;
+        }
+
+        REG(dst) = value_make(-VALUE_AS_NUMBER(v));
+      } NEXT();
+    CASE(OP_R_LOG)
+      {
+        value_println(REG(READ()));
+      } NEXT();
+    CASE(OP_R_TEST_EQ)
+      {
+        Instruction dst = READ();
+        Value a = REG(READ());
+        Value b = REG(READ());
+
+        REG(dst) = value_make(value_equals(a, b));
+      } NEXT();
+#define COMPARE(Name, Op) \
+    CASE(Name) \
+      { \
+        Instruction dst = READ(); \
+        Value a = REG(READ()); \
+        Value b = REG(READ()); \
+        if (!VALUE_IS_NUMBER(a) || !VALUE_IS_NUMBER(b)) { \
+          logf("ERROR: values should be numbers\n");\
+          return PROGRAM_RESULT_RUNTIME_ERROR; \
+        } \
+        REG(dst) = value_make(VALUE_AS_NUMBER(a) Op VALUE_AS_NUMBER(b)); \
+      } NEXT();
+    COMPARE(OP_R_TEST_LT, <)
+    COMPARE(OP_R_TEST_LTE, <=)
+    COMPARE(OP_R_TEST_GT, >)
+    COMPARE(OP_R_TEST_GTE, >=)
+#undef COMPARE
+#define LOGICAL_OP(Name, Op) \
+    CASE(Name) \
+      { \
+        Instruction dst = READ(); \
+        Value a = REG(READ()); \
+        Value b = REG(READ()); \
+        if (!VALUE_IS_BOOL(a) || !VALUE_IS_BOOL(b)) { \
+          logf("ERROR: values should be bools\n"); \
+          return PROGRAM_RESULT_RUNTIME_ERROR; \
+        } \
+        REG(dst) = value_make(VALUE_AS_BOOL(a) Op VALUE_AS_BOOL(b)); \
+      } NEXT();
+    LOGICAL_OP(OP_R_TEST_AND, &&)
+    LOGICAL_OP(OP_R_TEST_OR, ||)
+#undef LOGICAL_OP
+#define BINARY_OP(Name, Op) \
+    CASE(Name) \
+      { \
+        Instruction dst = READ(); \
+        Value a = REG(READ()); \
+        Value b = REG(READ()); \
+        if (!VALUE_IS_NUMBER(a) || !VALUE_IS_NUMBER(b)) { \
+          logf("INVALID BINARY OPERATION: '%s'\n", #Op); \
+          return PROGRAM_RESULT_RUNTIME_ERROR; \
+        } \
+        REG(dst) = value_make(VALUE_AS_NUMBER(a) Op VALUE_AS_NUMBER(b)); \
+      } NEXT();
+    BINARY_OP(OP_R_ADD, +)
+    BINARY_OP(OP_R_SUBTRACT, -)
+    BINARY_OP(OP_R_MULTIPLY, *)
+    BINARY_OP(OP_R_DIVIDE, /)
+#undef BINARY_OP
+#define TYPED_OP(Name, Type, As, Result) \
+    CASE(Name) \
+      { \
+        Instruction dst = READ(); \
+        Type a = As(REG(READ())); \
+        Type b = As(REG(READ())); \
+        REG(dst) = value_make(Result); \
+      } NEXT();
+    TYPED_OP(OP_R_ADD_NUM, double, VALUE_AS_NUMBER, a + b)
+    TYPED_OP(OP_R_SUBTRACT_NUM, double, VALUE_AS_NUMBER, a - b)
+    TYPED_OP(OP_R_MULTIPLY_NUM, double, VALUE_AS_NUMBER, a * b)
+    TYPED_OP(OP_R_DIVIDE_NUM, double, VALUE_AS_NUMBER, a / b)
+    TYPED_OP(OP_R_TEST_EQ_NUM, double, VALUE_AS_NUMBER, us_equals(a, b))
+    TYPED_OP(OP_R_TEST_EQ_BOOL, bool, VALUE_AS_BOOL, a == b)
+    TYPED_OP(OP_R_TEST_GT_NUM, double, VALUE_AS_NUMBER, a > b)
+    TYPED_OP(OP_R_TEST_LT_NUM, double, VALUE_AS_NUMBER, a < b)
+    TYPED_OP(OP_R_TEST_GTE_NUM, double, VALUE_AS_NUMBER, a >= b)
+    TYPED_OP(OP_R_TEST_LTE_NUM, double, VALUE_AS_NUMBER, a <= b)
+    TYPED_OP(OP_R_TEST_AND_BOOL, bool, VALUE_AS_BOOL, a && b)
+    TYPED_OP(OP_R_TEST_OR_BOOL, bool, VALUE_AS_BOOL, a || b)
+#undef TYPED_OP
+#define JUMP_UNLESS(Name, Result) \
+    CASE(Name) \
+      { \
+        double a = VALUE_AS_NUMBER(REG(READ())); \
+        double b = VALUE_AS_NUMBER(REG(READ())); \
+        Instruction jumpOffset = READ(); \
+        if (!(Result)) { \
+          ip += jumpOffset; \
+        } \
+      } NEXT();
+    JUMP_UNLESS(OP_R_JUMP_IF_NOT_EQ, us_equals(a, b))
+    JUMP_UNLESS(OP_R_JUMP_IF_NOT_GT, a > b)
+    JUMP_UNLESS(OP_R_JUMP_IF_NOT_LT, a < b)
+    JUMP_UNLESS(OP_R_JUMP_IF_NOT_GTE, a >= b)
+    JUMP_UNLESS(OP_R_JUMP_IF_NOT_LTE, a <= b)
+#undef JUMP_UNLESS
+
+    // Superinstructions: the first instruction's work, then the second's. The
+    // second can read the slot the first wrote, so it is written first.
+    CASE(OP_R_CONSTANT_INT_JUMP_IF_NOT_EQ)
+      {
+        Instruction constant = READ();
+        REG(constant) = value_make((double) (int16) READ());
+
+        double a = VALUE_AS_NUMBER(REG(READ()));
+        double b = VALUE_AS_NUMBER(REG(READ()));
+        Instruction jumpOffset = READ();
+
+        if (!us_equals(a, b)) {
+          ip += jumpOffset;
+        }
+      } NEXT();
+#define CONSTANT_INT_TYPED_OP(Name, Result) \
+    CASE(Name) \
+      { \
+        Instruction constant = READ(); \
+        REG(constant) = value_make((double) (int16) READ()); \
+        Instruction dst = READ(); \
+        double a = VALUE_AS_NUMBER(REG(READ())); \
+        double b = VALUE_AS_NUMBER(REG(READ())); \
+        REG(dst) = value_make(Result); \
+      } NEXT();
+    CONSTANT_INT_TYPED_OP(OP_R_CONSTANT_INT_ADD_NUM, a + b)
+    CONSTANT_INT_TYPED_OP(OP_R_CONSTANT_INT_SUBTRACT_NUM, a - b)
+    CONSTANT_INT_TYPED_OP(OP_R_CONSTANT_INT_DIVIDE_NUM, a / b)
+#undef CONSTANT_INT_TYPED_OP
+    default:
+#ifdef VM_COMPUTED_GOTO
+    op_unknown:
+#endif
+      {
+        logf("Unknown instruction. Exiting...\n");
+
+        return PROGRAM_RESULT_RUNTIME_ERROR;
+      } break;
+  }
+
+  return PROGRAM_RESULT_RUNTIME_ERROR;
+#undef REG
+}
 
-  return PROGRAM_RESULT_OK;
 #undef READ
+#undef CASE
+#undef NEXT
+#undef VM_TRACE
+#undef VM_PROFILE_RECORD
+
+ProgramResult vm_dispatch(VM* vm, VMDispatch dispatch, bool registers) {
+#ifdef VM_COMPUTED_GOTO
+  if (dispatch == VM_DISPATCH_THREADED) {
+    return registers ? vm_executeRegisters<true>(vm) : vm_execute<true>(vm);
+  }
+#endif
+
+  return registers ? vm_executeRegisters<false>(vm) : vm_execute<false>(vm);
+}
+
+// The VM currently inside vm_runWith, for vm_onFault.
+VM* vm_running = 0;
+
+// The handlers which were installed before vm_installFaultHandler's.
+struct sigaction vm_previousSegv;
+struct sigaction vm_previousBus;
+
+void vm_onFault(int sig, siginfo_t* info, void* context) {
+  VM* vm = vm_running;
+
+  if (vm != 0) {
+    bool stack = vm_inGuard(vm->stack, (vm->stackEnd - vm->stack) * sizeof(Value), info->si_addr);
+    bool frames = vm_inGuard(vm->frames, vm->frameCapacity * sizeof(Frame), info->si_addr);
+
+    if (stack || frames) {
+      siglongjmp(vm->overflow, 1);
+    }
+  }
+
+  // NOTE: not one of ours, so it goes to whoever handled it before.
+  // If that is the default, it is put back so that the fault happens again
+  // when we return, and crashes like it should.
+  struct sigaction* previous = sig == SIGBUS ? &vm_previousBus : &vm_previousSegv;
+
+  if (previous->sa_flags & SA_SIGINFO) {
+    previous->sa_sigaction(sig, info, context);
+  } else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN) {
+    previous->sa_handler(sig);
+  } else {
+    sigaction(sig, previous, 0);
+  }
+}
+
+void vm_installFaultHandler() {
+  static bool installed = false;
+
+  if (installed) {
+    return;
+  }
+
+  struct sigaction action = {};
+  action.sa_sigaction = vm_onFault;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+
+  // Some systems report touching a PROT_NONE page as SIGBUS.
+  sigaction(SIGSEGV, &action, &vm_previousSegv);
+  sigaction(SIGBUS, &action, &vm_previousBus);
+
+  installed = true;
+}
+
+ProgramResult vm_runWith(VM* vm, VMDispatch dispatch) {
+  if (vm->frameCount <= 0) {
+    return PROGRAM_RESULT_OK;
+  }
+
+  if (vm->stackTop + vm->frames[0].hunk->maxStack > vm->stackEnd) {
+    logf("ERROR: stack overflow\n");
+
+    return PROGRAM_RESULT_RUNTIME_ERROR;
+  }
+
+  bool registers = vm->frames[0].hunk->format == BYTECODE_REGISTER;
+
+  vm_installFaultHandler();
+
+  vm_running = vm;
+
+#ifdef VM_PROFILE
+  vm_profileStart();
+#endif
+
+  if (sigsetjmp(vm->overflow, 1) != 0) {
+    vm_running = 0;
+
+    logf("ERROR: stack overflow\n");
+
+    return PROGRAM_RESULT_RUNTIME_ERROR;
+  }
+
+  ProgramResult res = vm_dispatch(vm, dispatch, registers);
+
+  vm_running = 0;
+
+  return res;
+}
+
+ProgramResult vm_run(VM* vm) {
+  return vm_runWith(vm, VM_DISPATCH_DEFAULT);
 }
@@ -0,0 +1,298 @@
+// Constant folding over a type checked AST, run before code generation.
+//
+// - operators whose operands are both constants are evaluated, with the same
+//   double arithmetic and value_equals the VM uses.
+// - identities are simplified: x - 0, x * 1, 1 * x, x / 1, true && x,
+//   x && true, false || x and x || false all become x. x + 0 doesn't, as
+//   it is 0 rather than -0 when x is -0.
+// - false && x and true || x become the constant, as x is never evaluated.
+//   x && false and x || true only do if x has no function calls in it.
+// - if statements with a constant condition are replaced by the block which
+//   would run, or removed entirely.
+
+// Is node a number or bool literal? Sets v to its value if so.
+bool fold_constant(AST* ast, ASTNodeId node, Value* v) {
+  if (ast_kind(ast, node) == AST_NODE_NUMBER) {
+    *v = value_make((double) ast->data[node].number.number);
+
+    return true;
+  }
+
+  if (ast_kind(ast, node) == AST_NODE_VALUE && (VALUE_IS_NUMBER(ast_value(ast, node)) || VALUE_IS_BOOL(ast_value(ast, node)))) {
+    *v = ast_value(ast, node);
+
+    return true;
+  }
+
+  return false;
+}
+
+// Is node the number n? 0 and -0 are told apart, as x - -0 isn't always x.
+bool fold_isNumber(AST* ast, ASTNodeId node, double n) {
+  Value v;
+
+  return fold_constant(ast, node, &v) && VALUE_IS_NUMBER(v) && VALUE_AS_NUMBER(v) == n && signbit(VALUE_AS_NUMBER(v)) == signbit(n);
+}
+
+bool fold_isBool(AST* ast, ASTNodeId node, bool b) {
+  Value v;
+
+  return fold_constant(ast, node, &v) && VALUE_IS_BOOL(v) && VALUE_AS_BOOL(v) == b;
+}
+
+// Can node be dropped without changing what the program does?
+bool fold_isPure(AST* ast, ASTNodeId node) {
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_NUMBER:
+    case AST_NODE_VALUE:
+    case AST_NODE_IDENTIFIER:
+      {
+        return true;
+      } break;
+    case AST_NODE_ADD:
+    case AST_NODE_SUBTRACT:
+    case AST_NODE_MULTIPLY:
+    case AST_NODE_DIVIDE:
+    case AST_NODE_TEST_EQUAL:
+    case AST_NODE_TEST_GREATER:
+    case AST_NODE_TEST_GREATER_EQUAL:
+    case AST_NODE_TEST_LESSER:
+    case AST_NODE_TEST_LESSER_EQUAL:
+    case AST_NODE_TEST_AND:
+    case AST_NODE_TEST_OR:
+      {
+        // NOTE: walks down the left hand side in a loop, as long
+        // chains would otherwise run out of stack. See ast_leftSpine.
+        while (ast_isBinary(ast_kind(ast, node))) {
+          if (!fold_isPure(ast, ast->data[node].binary.right)) {
+            return false;
+          }
+
+          node = ast->data[node].binary.left;
+        }
+
+        return fold_isPure(ast, node);
+      } break;
+    default:
+      {
+        return false;
+      } break;
+  }
+}
+
+// Replaces the binary node with one of its operands, keep. The nodes which are
+// dropped belong to the compiler's arena, so they don't need freeing.
+void fold_replaceWith(AST* ast, ASTNodeId node, ASTNodeId keep) {
+  ast_replace(ast, node, keep);
+}
+
+void fold_replaceWithValue(AST* ast, ASTNodeId node, Value v) {
+  ast_replace(ast, node, ast_makeValue(ast, v, ast->positions[node]));
+}
+
+// Evaluates a binary operator on two constants. Returns false if it can't.
+bool fold_evaluate(ASTNodeType op, Value a, Value b, Value* out) {
+  bool numbers = VALUE_IS_NUMBER(a) && VALUE_IS_NUMBER(b);
+  bool bools = VALUE_IS_BOOL(a) && VALUE_IS_BOOL(b);
+
+#define NUMBER_OP(Type, Op) \
+    case Type: \
+      { \
+        if (!numbers) { \
+          return false; \
+        } \
+        *out = value_make(VALUE_AS_NUMBER(a) Op VALUE_AS_NUMBER(b)); \
+      } break;
+
+#define BOOL_OP(Type, Op) \
+    case Type: \
+      { \
+        if (!bools) { \
+          return false; \
+        } \
+        *out = value_make(VALUE_AS_BOOL(a) Op VALUE_AS_BOOL(b)); \
+      } break;
+
+  switch (op) {
+    NUMBER_OP(AST_NODE_ADD, +)
+    NUMBER_OP(AST_NODE_SUBTRACT, -)
+    NUMBER_OP(AST_NODE_MULTIPLY, *)
+    NUMBER_OP(AST_NODE_DIVIDE, /)
+
+    NUMBER_OP(AST_NODE_TEST_GREATER, >)
+    NUMBER_OP(AST_NODE_TEST_GREATER_EQUAL, >=)
+    NUMBER_OP(AST_NODE_TEST_LESSER, <)
+    NUMBER_OP(AST_NODE_TEST_LESSER_EQUAL, <=)
+
+    BOOL_OP(AST_NODE_TEST_AND, &&)
+    BOOL_OP(AST_NODE_TEST_OR, ||)
+
+    case AST_NODE_TEST_EQUAL:
+      {
+        if (!numbers && !bools) {
+          return false;
+        }
+
+        *out = value_make(value_equals(a, b));
+      } break;
+    default:
+      {
+        return false;
+      } break;
+  }
+
+#undef NUMBER_OP
+#undef BOOL_OP
+
+  return true;
+}
+
+void fold_binary(AST* ast, ASTNodeId node) {
+  ASTNodeId left = ast->data[node].binary.left;
+  ASTNodeId right = ast->data[node].binary.right;
+
+  Value a;
+  Value b;
+
+  if (fold_constant(ast, left, &a) && fold_constant(ast, right, &b)) {
+    Value result;
+
+    if (fold_evaluate(ast_kind(ast, node), a, b, &result)) {
+      fold_replaceWithValue(ast, node, result);
+    }
+
+    return;
+  }
+
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_SUBTRACT:
+      {
+        if (fold_isNumber(ast, right, 0)) {
+          fold_replaceWith(ast, node, left);
+        }
+      } break;
+    case AST_NODE_MULTIPLY:
+      {
+        if (fold_isNumber(ast, right, 1)) {
+          fold_replaceWith(ast, node, left);
+        } else if (fold_isNumber(ast, left, 1)) {
+          fold_replaceWith(ast, node, right);
+        }
+      } break;
+    case AST_NODE_DIVIDE:
+      {
+        if (fold_isNumber(ast, right, 1)) {
+          fold_replaceWith(ast, node, left);
+        }
+      } break;
+    case AST_NODE_TEST_AND:
+    case AST_NODE_TEST_OR:
+      {
+        // x && true is x, but x && false is false. The other way around
+        // for ||.
+        bool identity = ast_kind(ast, node) == AST_NODE_TEST_AND;
+
+        if (fold_isBool(ast, right, identity)) {
+          fold_replaceWith(ast, node, left);
+        } else if (fold_isBool(ast, left, identity)) {
+          fold_replaceWith(ast, node, right);
+        } else if (fold_isBool(ast, right, !identity) && fold_isPure(ast, left)) {
+          fold_replaceWith(ast, node, right);
+        } else if (fold_isBool(ast, left, !identity)) {
+          fold_replaceWith(ast, node, left);
+        }
+      } break;
+    default:
+      {
+        // Nothing to simplify.
+      } break;
+  }
+}
+
+void ast_fold(AST* ast, ASTNodeId node) {
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_ROOT:
+      {
+        for (uint32 i = 0; i < ast->data[node].root.count; i++) {
+          ast_fold(ast, ast_child(ast, node, i));
+        }
+      } break;
+    case AST_NODE_ASSIGNMENT:
+    case AST_NODE_ASSIGNMENT_DECLARATION:
+      {
+        ast_fold(ast, ast->data[node].assignment.right);
+      } break;
+    case AST_NODE_FUNCTION_DECLARATION:
+      {
+        ast_fold(ast, ast_function(ast, node)->block);
+      } break;
+    case AST_NODE_FUNCTION_CALL:
+      {
+        for (uint32 i = 0; i < ast->data[node].functionCall.argCount; i++) {
+          ast_fold(ast, ast_arg(ast, node, i));
+        }
+      } break;
+    case AST_NODE_RETURN:
+      {
+        ast_fold(ast, ast->data[node].Return.child);
+      } break;
+    case AST_NODE_BLOCK:
+      {
+        ast_fold(ast, ast->data[node].block.block);
+      } break;
+    case AST_NODE_IF:
+      {
+        ast_fold(ast, ast->data[node].cIf.condition);
+        ast_fold(ast, ast->data[node].cIf.block);
+
+        if (ast->data[node].cIf.elseBlock != AST_NODE_NONE) {
+          ast_fold(ast, ast->data[node].cIf.elseBlock);
+        }
+
+        Value v;
+
+        if (!fold_constant(ast, ast->data[node].cIf.condition, &v) || !VALUE_IS_BOOL(v)) {
+          break;
+        }
+
+        ASTNodeId taken = VALUE_AS_BOOL(v) ? ast->data[node].cIf.block : ast->data[node].cIf.elseBlock;
+
+        // NOTE: the block keeps its own scope, so variables declared
+        // in it still can't be seen after it.
+        if (taken != AST_NODE_NONE) {
+          ast_replace(ast, node, ast_makeBlock(ast, taken, ast->positions[node]));
+        } else {
+          ast_replace(ast, node, ast_makeRoot(ast, 0, 0));
+        }
+      } break;
+    case AST_NODE_ADD:
+    case AST_NODE_SUBTRACT:
+    case AST_NODE_MULTIPLY:
+    case AST_NODE_DIVIDE:
+    case AST_NODE_TEST_EQUAL:
+    case AST_NODE_TEST_GREATER:
+    case AST_NODE_TEST_GREATER_EQUAL:
+    case AST_NODE_TEST_LESSER:
+    case AST_NODE_TEST_LESSER_EQUAL:
+    case AST_NODE_TEST_AND:
+    case AST_NODE_TEST_OR:
+      {
+        // Operators are folded from the bottom of a chain up, after both
+        // their operands. See ast_leftSpine.
+        array(ASTNodeId) spine = ast_leftSpine(ast, node, ast_isBinary);
+        int last = (int) array_count(spine) - 1;
+
+        ast_fold(ast, ast->data[spine[last]].binary.left);
+
+        for (int i = last; i >= 0; i--) {
+          ast_fold(ast, ast->data[spine[i]].binary.right);
+
+          fold_binary(ast, spine[i]);
+        }
+      } break;
+    default:
+      {
+        // Leaves and statements without expressions.
+      } break;
+  }
+}
@@ -1,4 +1,4 @@
-enum TokenType : uint32 {
+enum TokenType : uint8 {
   TOKEN_ILLEGAL,
   TOKEN_EOF,
 
@@ -44,51 +44,431 @@ enum TokenType : uint32 {
   TOKEN_LOG
 };
 
+// NOTE: tokens are packed into 8 bytes. A token's text is the len
+// bytes of the source starting at pos. Its line and column aren't kept, but
+// can be found from pos with a LineIndex when they're needed.
 struct Token {
+  uint32 pos;
+  uint16 len;
+
   TokenType type;
+};
+
+static_assert(sizeof(Token) == 8, "Token should pack into 8 bytes");
 
-  char* start;
+#define TOKEN_LEN_MAX (UINT16_MAX)
+
+// NOTE: every keyword in the language, and the token it scans as.
+// Everything which needs to know the keywords should use this list, so that
+// adding one is a one line change.
+struct Keyword {
+  const char* text;
   int len;
-  int line;
+
+  TokenType type;
+};
+
+constexpr Keyword keywords[] = {
+  { "true", 4, TOKEN_TRUE },
+  { "false", 5, TOKEN_FALSE },
+  { "if", 2, TOKEN_IF },
+  { "else", 4, TOKEN_ELSE },
+  { "func", 4, TOKEN_FUNC },
+  { "return", 6, TOKEN_RETURN },
+  { "var", 3, TOKEN_VAR },
+  { "log", 3, TOKEN_LOG },
+};
+
+#define KEYWORD_COUNT ((int) (sizeof(keywords) / sizeof(keywords[0])))
+
+// Keywords are found with a perfect hash: a table of KEYWORD_SLOTS slots,
+// which every keyword hashes to a different one of. Looking up an identifier
+// is then one hash, one load and one compare.
+//
+// The hash multiplies the identifier's first and last characters and its
+// length by a seed. keyword_findSeed tries seeds until it finds one where no
+// two keywords collide, and the table is filled in from the keyword list, all
+// at compile time.
+#define KEYWORD_SLOT_BITS (5)
+#define KEYWORD_SLOTS (1 << KEYWORD_SLOT_BITS)
+#define KEYWORD_SEED_TRIES (256)
+
+constexpr uint32 keyword_hash(uint32 seed, const char* s, int len) {
+  return (((uint32) (uint8) s[0] | ((uint32) (uint8) s[len - 1] << 8) | ((uint32) len << 16)) * seed) >> (32 - KEYWORD_SLOT_BITS);
+}
+
+constexpr uint32 keyword_slot(uint32 seed, int i) {
+  return keyword_hash(seed, keywords[i].text, keywords[i].len);
+}
+
+// Does any keyword from i onwards share a slot with one after it?
+constexpr bool keyword_collides(uint32 seed, int i = 0, int j = 1) {
+  return i >= KEYWORD_COUNT ? false
+    : j >= KEYWORD_COUNT ? keyword_collides(seed, i + 1, i + 2)
+    : keyword_slot(seed, i) == keyword_slot(seed, j) || keyword_collides(seed, i, j + 1);
+}
+
+// The first seed from seed onwards which doesn't collide, or 0 if there isn't
+// one in tries tries. Seeds are odd so the multiply doesn't lose bits.
+constexpr uint32 keyword_findSeed(uint32 seed, int tries) {
+  return tries == 0 ? 0
+    : !keyword_collides(seed) ? seed
+    : keyword_findSeed(seed + 2, tries - 1);
+}
+
+constexpr uint32 KEYWORD_SEED = keyword_findSeed(0x9E3779B1u, KEYWORD_SEED_TRIES);
+
+static_assert(KEYWORD_SEED != 0, "No perfect hash for the keywords, try more seeds or slots");
+
+// The keyword which hashes to slot, or an empty one which matches nothing.
+constexpr Keyword keyword_forSlot(int slot, int i = 0) {
+  return i >= KEYWORD_COUNT ? Keyword{ "", 0, TOKEN_IDENTIFIER }
+    : keyword_slot(KEYWORD_SEED, i) == (uint32) slot ? keywords[i]
+    : keyword_forSlot(slot, i + 1);
+}
+
+// The table itself, with slots[i] = keyword_forSlot(i). KeywordSlots<N>
+// counts down from N to make the list of slot numbers 0 to N - 1.
+template <int... Slots>
+struct KeywordTable {
+  static const Keyword slots[sizeof...(Slots)];
+};
+
+template <int... Slots>
+const Keyword KeywordTable<Slots...>::slots[sizeof...(Slots)] = { keyword_forSlot(Slots)... };
+
+template <int N, int... Slots>
+struct KeywordSlots : KeywordSlots<N - 1, N - 1, Slots...> {};
+
+template <int... Slots>
+struct KeywordSlots<0, Slots...> {
+  typedef KeywordTable<Slots...> Table;
+};
+
+typedef KeywordSlots<KEYWORD_SLOTS>::Table KeywordTableType;
+
+// The keyword token for the identifier at s, or TOKEN_IDENTIFIER if it isn't
+// one.
+TokenType keyword_find(char* s, int len) {
+  const Keyword* k = &KeywordTableType::slots[keyword_hash(KEYWORD_SEED, s, len)];
+
+  if (k->len == len && memcmp(k->text, s, len) == 0) {
+    return k->type;
+  }
+
+  return TOKEN_IDENTIFIER;
+}
+
+// NOTE: The scanner finds where runs of whitespace, identifier
+// characters, digits and comment text end with a ScannerKernel. There is a
+// kernel which goes a byte at a time, and ones which classify 16 (SSE2) or 32
+// (AVX2) bytes at once and pick out the end of the run with a bit scan.
+// scanner_load uses the best kernel the CPU supports.
+//
+// Every run ends at the '\0' which terminates the source. The SIMD kernels
+// only ever read whole blocks from aligned addresses, so the bytes they read
+// past the '\0' are always in the same page as it.
+
+// Each of these returns the length of the run starting at p. The run of
+// whitespace also sets newline if there's a newline in it.
+typedef int (*ScannerRun)(char* p, bool* newline);
+
+struct ScannerKernel {
+  const char* name;
+
+  // ' ', '\t', '\n' and '\r'.
+  ScannerRun space;
+
+  // Letters, digits and '_'.
+  ScannerRun word;
+
+  ScannerRun digits;
+
+  // Everything up to a newline.
+  ScannerRun line;
+
+  // Everything up to a '/' or '*'.
+  ScannerRun comment;
+};
+
+int scanner_spaceScalar(char* p, bool* newline) {
+  char* start = p;
+
+  while (us_isSpace(*p)) {
+    if (us_isNewline(*p)) {
+      *newline = true;
+    }
+
+    p += 1;
+  }
+
+  return (int) (p - start);
+}
+
+int scanner_wordScalar(char* p, bool* newline) {
+  char* start = p;
+
+  while (us_isLetter(*p) || us_isDigit(*p) || *p == '_') {
+    p += 1;
+  }
+
+  return (int) (p - start);
+}
+
+int scanner_digitsScalar(char* p, bool* newline) {
+  char* start = p;
+
+  while (us_isDigit(*p)) {
+    p += 1;
+  }
+
+  return (int) (p - start);
+}
+
+int scanner_lineScalar(char* p, bool* newline) {
+  char* start = p;
+
+  while (*p != '\0' && !us_isNewline(*p)) {
+    p += 1;
+  }
+
+  return (int) (p - start);
+}
+
+int scanner_commentScalar(char* p, bool* newline) {
+  char* start = p;
+
+  while (*p != '\0' && *p != '/' && *p != '*') {
+    p += 1;
+  }
+
+  return (int) (p - start);
+}
+
+ScannerKernel scanner_scalarKernel = {
+  "scalar",
+  scanner_spaceScalar, scanner_wordScalar, scanner_digitsScalar,
+  scanner_lineScalar, scanner_commentScalar,
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCANNER_SIMD
+
+// Which bytes of a block are in each class, one bit per byte.
+struct ScannerMasks {
+  uint32 space;
+  uint32 newline;
+  uint32 word;
+  uint32 digit;
+  uint32 comment;
+  uint32 end;
+};
+
+// NOTE: the SIMD kernels deliberately read past the end of the
+// source, which the address sanitizer would report.
+#define SCANNER_SSE2 __attribute__((target("sse2"), no_sanitize_address))
+#define SCANNER_AVX2 __attribute__((target("avx2"), no_sanitize_address))
+
+SCANNER_SSE2 inline __attribute__((always_inline)) void scanner_classifySSE2(char* block, ScannerMasks* m) {
+  __m128i v = _mm_load_si128((__m128i*) block);
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+
+#define EQ(c) ((uint32) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))))
+#define RANGE(x, lo, hi) ((uint32) _mm_movemask_epi8(_mm_and_si128( \
+        _mm_cmpgt_epi8((x), _mm_set1_epi8((lo) - 1)), \
+        _mm_cmplt_epi8((x), _mm_set1_epi8((hi) + 1)))))
+
+  m->newline = EQ('\n') | EQ('\r');
+  m->space = m->newline | EQ(' ') | EQ('\t');
+  m->digit = RANGE(v, '0', '9');
+  m->word = m->digit | RANGE(lower, 'a', 'z') | EQ('_');
+  m->comment = EQ('/') | EQ('*');
+  m->end = EQ('\0');
+
+#undef EQ
+#undef RANGE
+}
+
+SCANNER_AVX2 inline __attribute__((always_inline)) void scanner_classifyAVX2(char* block, ScannerMasks* m) {
+  __m256i v = _mm256_load_si256((__m256i*) block);
+  __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+
+#define EQ(c) ((uint32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))))
+#define RANGE(x, lo, hi) ((uint32) _mm256_movemask_epi8(_mm256_and_si256( \
+        _mm256_cmpgt_epi8((x), _mm256_set1_epi8((lo) - 1)), \
+        _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), (x)))))
+
+  m->newline = EQ('\n') | EQ('\r');
+  m->space = m->newline | EQ(' ') | EQ('\t');
+  m->digit = RANGE(v, '0', '9');
+  m->word = m->digit | RANGE(lower, 'a', 'z') | EQ('_');
+  m->comment = EQ('/') | EQ('*');
+  m->end = EQ('\0');
+
+#undef EQ
+#undef RANGE
+}
+
+// Stamps out a run function for a kernel which classifies Width bytes at a
+// time. Stops is the mask of the bytes which end the run and Flagged the mask
+// of the bytes which set newline. Bits for bytes before p are masked off.
+#define SCANNER_RUN(Name, Kernel, Width, Stops, Flagged) \
+SCANNER_ ## Kernel int scanner_ ## Name ## Kernel(char* p, bool* newline) { \
+  char* block = (char*) ((uintptr_t) p & ~((uintptr_t) (Width) - 1)); \
+  uint32 valid = (uint32) (((uint64) 1 << (Width)) - 1); \
+  uint32 from = valid & ~(uint32) (((uint64) 1 << (p - block)) - 1); \
+\
+  while (true) { \
+    ScannerMasks m; \
+    scanner_classify ## Kernel(block, &m); \
+\
+    uint32 stops = (Stops) & from; \
+\
+    if (stops != 0) { \
+      uint32 before = (stops & (0 - stops)) - 1; \
+\
+      if (((Flagged) & from & before) != 0) { \
+        *newline = true; \
+      } \
+\
+      return (int) (block + __builtin_ctz(stops) - p); \
+    } \
+\
+    if (((Flagged) & from) != 0) { \
+      *newline = true; \
+    } \
+\
+    block += (Width); \
+    from = valid; \
+  } \
+}
+
+#define SCANNER_KERNEL(Kernel, Width) \
+  SCANNER_RUN(space, Kernel, Width, ~m.space, m.newline) \
+  SCANNER_RUN(word, Kernel, Width, ~m.word, 0) \
+  SCANNER_RUN(digits, Kernel, Width, ~m.digit, 0) \
+  SCANNER_RUN(line, Kernel, Width, m.newline | m.end, 0) \
+  SCANNER_RUN(comment, Kernel, Width, m.comment | m.end, 0)
+
+SCANNER_KERNEL(SSE2, 16)
+SCANNER_KERNEL(AVX2, 32)
+
+#undef SCANNER_KERNEL
+#undef SCANNER_RUN
+
+ScannerKernel scanner_sse2Kernel = {
+  "sse2",
+  scanner_spaceSSE2, scanner_wordSSE2, scanner_digitsSSE2,
+  scanner_lineSSE2, scanner_commentSSE2,
 };
 
+ScannerKernel scanner_avx2Kernel = {
+  "avx2",
+  scanner_spaceAVX2, scanner_wordAVX2, scanner_digitsAVX2,
+  scanner_lineAVX2, scanner_commentAVX2,
+};
+#endif
+
+// Can this CPU run kernel?
+bool scanner_supports(ScannerKernel* kernel) {
+#ifdef SCANNER_SIMD
+  __builtin_cpu_init();
+
+  if (kernel == &scanner_avx2Kernel) {
+    return __builtin_cpu_supports("avx2");
+  }
+
+  if (kernel == &scanner_sse2Kernel) {
+    return __builtin_cpu_supports("sse2");
+  }
+#endif
+
+  return kernel == &scanner_scalarKernel;
+}
+
+// The fastest kernel this CPU supports.
+ScannerKernel* scanner_bestKernel() {
+  static ScannerKernel* best = 0;
+
+  if (best != 0) {
+    return best;
+  }
+
+  best = &scanner_scalarKernel;
+
+#ifdef SCANNER_SIMD
+  if (scanner_supports(&scanner_avx2Kernel)) {
+    best = &scanner_avx2Kernel;
+  } else if (scanner_supports(&scanner_sse2Kernel)) {
+    best = &scanner_sse2Kernel;
+  }
+#endif
+
+  return best;
+}
+
 struct Scanner {
   char* source;
   char* head;
 
-  int line;
-
   bool reachedNewline;
   Token lastToken;
+
+  ScannerKernel* kernel;
 };
 
 void scanner_load(Scanner* scn, char* buf) {
   scn->source = buf;
   scn->head = buf;
-  scn->line = 1;
+
+  scn->kernel = scanner_bestKernel();
 }
 
+// NOTE: most runs are only a few bytes long, eg. the space between
+// two tokens or a short identifier, and finish before a kernel would have
+// classified its first block. The scanner goes through the first
+// SCANNER_SHORT_RUN bytes of a run itself and only hands longer ones over.
+#define SCANNER_SHORT_RUN (8)
+
 void scanner_skipWhitespace(Scanner* scn) {
-  while (*scn->head != '\0') {
-    char c = *scn->head;
+  // Spaces between tokens. A newline or tab means indentation follows, which
+  // is worth a kernel.
+  int spaces = 0;
+  while (spaces < SCANNER_SHORT_RUN && scn->head[spaces] == ' ') {
+    spaces += 1;
+  }
 
-    if (us_isNewline(c)) {
-      scn->reachedNewline = true;
-      scn->head += 1;
-      
-      scn->line += 1;
-      
-      continue;
-    }
+  scn->head += spaces;
 
-    if (us_isSpace(c)) {
-      scn->head += 1;
+  if (us_isSpace(*scn->head)) {
+    scn->head += scn->kernel->space(scn->head, &scn->reachedNewline);
+  }
+}
 
-      continue;
-    }
+// Makes a token of type for the len bytes of source at start. Tokens longer
+// than TOKEN_LEN_MAX are illegal, apart from comments, which are thrown away
+// anyway and so are only cut short.
+Token scanner_makeToken(Scanner* scn, TokenType type, char* start, psize len) {
+  Token t = {};
+  t.type = type;
+  t.pos = (uint32) (start - scn->source);
+
+  if (len > TOKEN_LEN_MAX) {
+    len = TOKEN_LEN_MAX;
 
-    return;
+    if (type != TOKEN_COMMENT) {
+      t.type = TOKEN_ILLEGAL;
+    }
   }
+
+  t.len = (uint16) len;
+
+  return t;
+}
+
+// The text of t, which is t.len bytes long.
+char* scanner_text(Scanner* scn, Token t) {
+  return scn->source + t.pos;
 }
 
 char scanner_peek(Scanner* scn, int amount = 1) {
@@ -101,146 +481,92 @@ bool scanner_isLetter(Scanner* scn) {
 }
 
 Token scanner_readNumber(Scanner* scn) {
-  Token t = {};
-  t.type = TOKEN_NUMBER;
-  t.line = scn->line;
-  t.start = scn->head;
+  char* start = scn->head;
 
-  while (*scn->head != '\0') {
-    if (!us_isDigit(*scn->head)) {
-      break;
-    }
+  int len = 0;
+  while (len < SCANNER_SHORT_RUN && us_isDigit(start[len])) {
+    len += 1;
+  }
 
-    t.len += 1;
-    scn->head += 1;
+  if (len == SCANNER_SHORT_RUN) {
+    bool newline = false;
+    len += scn->kernel->digits(start + len, &newline);
   }
 
-  return t;
+  scn->head += len;
+
+  return scanner_makeToken(scn, TOKEN_NUMBER, start, len);
 }
 
 Token scanner_readIdentifier(Scanner* scn) {
-  Token t = {};
-  t.type = TOKEN_IDENTIFIER;
-  t.line = scn->line;
-  t.start = scn->head;
+  char* start = scn->head;
 
-  while (*scn->head != '\0') {
-    if (!(scanner_isLetter(scn) || us_isDigit(*scn->head))) {
-      break;
-    }
-
-    if (t.len == 0 && us_isDigit(*scn->head)) {
-      t.type = TOKEN_ILLEGAL;
-      break;
-    }
+  if (us_isDigit(*scn->head)) {
+    return scanner_makeToken(scn, TOKEN_ILLEGAL, start, 0);
+  }
 
-    t.len += 1;
-    scn->head += 1;
+  int len = 0;
+  while (len < SCANNER_SHORT_RUN && (us_isLetter(start[len]) || us_isDigit(start[len]) || start[len] == '_')) {
+    len += 1;
   }
 
-  // true
-  // false
-  // if
-  // else
-  // func
-  // var
-  // return
-  if (t.len == 4) {
-    if (strncmp(t.start, "true", 4) == 0) {
-      t.type = TOKEN_TRUE;
-    } else if (strncmp(t.start, "func", 4) == 0) {
-      t.type = TOKEN_FUNC;
-    } else if (strncmp(t.start, "else", 4) == 0) {
-      t.type = TOKEN_ELSE;
-    }
-  } else if (t.len == 5) {
-    if (strncmp(t.start, "false", 5) == 0) {
-      t.type = TOKEN_FALSE;
-    }
-  } else if (t.len == 3) {
-    if (strncmp(t.start, "log", 3) == 0) {
-      t.type = TOKEN_LOG;
-    } else if (strncmp(t.start, "var", 3) == 0) {
-      t.type = TOKEN_VAR;
-    }
-  } else if (t.len == 2) {
-    if (strncmp(t.start, "if", 2) == 0) {
-      t.type = TOKEN_IF;
-    }
-  } else if (t.len == 6) {
-    if (strncmp(t.start, "return", 6) == 0) {
-      t.type = TOKEN_RETURN;
-    }
+  if (len == SCANNER_SHORT_RUN) {
+    bool newline = false;
+    len += scn->kernel->word(start + len, &newline);
   }
 
-  return t;
+  scn->head += len;
+
+  return scanner_makeToken(scn, keyword_find(start, len), start, len);
 }
 
 Token scanner_readMultilineComment(Scanner* scn) {
-  Token t = {};
-  t.type = TOKEN_COMMENT;
-  t.line = scn->line;
-  t.start = scn->head;
+  char* start = scn->head;
 
   scn->head += 2;
-  t.len += 2;
 
   int depth = 1;
 
-  while (*scn->head != '\0') {
-    if (*scn->head == '/' && scanner_peek(scn) == '*') {
-      depth += 1;
-    } else if (*scn->head == '/' && scanner_peek(scn, -1) == '*') {
-      depth -= 1;
-    }
+  // Skip straight to the next '/' or '*', as only they can open or close a
+  // comment.
+  while (depth > 0) {
+    bool newline = false;
+    scn->head += scn->kernel->comment(scn->head, &newline);
 
-    if (scanner_peek(scn) == '\n') {
-      scn->line += 1;
+    if (*scn->head == '\0') {
+      break;
     }
 
-    t.len += 1;
-    scn->head += 1;
-
-    if (depth <= 0) {
-      break;
+    if (*scn->head == '/' && scanner_peek(scn) == '*') {
+      depth += 1;
+      scn->head += 2;
+    } else if (*scn->head == '*' && scanner_peek(scn) == '/') {
+      depth -= 1;
+      scn->head += 2;
+    } else {
+      scn->head += 1;
     }
   }
 
-  return t;
+  return scanner_makeToken(scn, TOKEN_COMMENT, start, scn->head - start);
 }
 
 Token scanner_readSinglelineComment(Scanner* scn) {
-  Token t = {};
-  t.type = TOKEN_COMMENT;
-  t.line = scn->line;
-  t.start = scn->head;
+  char* start = scn->head;
 
   scn->head += 2;
-  t.len += 2;
 
-  while (*scn->head != '\0') {
-    char c = *scn->head;
+  bool newline = false;
+  scn->head += scn->kernel->line(scn->head, &newline);
 
-    if (us_isNewline(c)) {
-      break;
-    }
-
-    t.len += 1;
-    scn->head += 1;
-  }
-
-  return t;
+  return scanner_makeToken(scn, TOKEN_COMMENT, start, scn->head - start);
 }
 
 Token scanner_getToken(Scanner* scn) {
   scanner_skipWhitespace(scn);
 
   if (scn->reachedNewline) {
-    Token breakToken = {};
-    breakToken.type = TOKEN_SEMICOLON;
-    breakToken.start = scn->head;
-    breakToken.len = 0;
-    breakToken.line = scn->line;
+    Token breakToken = scanner_makeToken(scn, TOKEN_SEMICOLON, scn->head, 0);
 
     switch (scn->lastToken.type) {
       case TOKEN_NUMBER:
@@ -264,8 +590,7 @@ Token scanner_getToken(Scanner* scn) {
   }
 
   // Start with an illegal token
-  Token t = {};
-  t.line = scn->line;
+  Token t = scanner_makeToken(scn, TOKEN_ILLEGAL, scn->head, 0);
 
   if (*scn->head == '\0') {
     t.type = TOKEN_EOF;
@@ -275,40 +600,30 @@ Token scanner_getToken(Scanner* scn) {
     // NOTE(harrison): this will also map keywords
     t = scanner_readIdentifier(scn);
   } else {
-#define SIMPLE_TOKEN(Type) \
+#define SIMPLE_TOKEN(Type, Len) \
     do { \
-      t.type = Type; \
-      t.start = scn->head; \
-      t.len = 1; \
+      t = scanner_makeToken(scn, Type, scn->head, Len); \
 \
-      scn->head += t.len; \
+      scn->head += Len; \
     } while (false)
 #define SIMPLE_CASE(Char, Type) \
     case Char: \
       { \
-        SIMPLE_TOKEN(Type); \
+        SIMPLE_TOKEN(Type, 1); \
       } break;
     switch (*scn->head) {
       case '=':
         {
           if (scanner_peek(scn) == '=') {
-            t.type = TOKEN_EQUALS;
-            t.start = scn->head;
-            t.len = 2;
-
-            scn->head += t.len;
+            SIMPLE_TOKEN(TOKEN_EQUALS, 2);
           } else {
-            SIMPLE_TOKEN(TOKEN_ASSIGNMENT);
+            SIMPLE_TOKEN(TOKEN_ASSIGNMENT, 1);
           }
         } break;
       case ':':
         {
           if (scanner_peek(scn) == '=') {
-            t.type = TOKEN_ASSIGNMENT_DECLARATION;
-            t.start = scn->head;
-            t.len = 2;
-
-            scn->head += t.len;
+            SIMPLE_TOKEN(TOKEN_ASSIGNMENT_DECLARATION, 2);
           }
         } break;
       case '/':
@@ -318,27 +633,19 @@ Token scanner_getToken(Scanner* scn) {
           } else if (scanner_peek(scn) == '/') {
             t = scanner_readSinglelineComment(scn);
           } else {
-            SIMPLE_TOKEN(TOKEN_DIVIDE);
+            SIMPLE_TOKEN(TOKEN_DIVIDE, 1);
           }
         } break;
       case '&':
         {
           if (scanner_peek(scn) == '&') {
-            t.type = TOKEN_AND;
-            t.start = scn->head;
-            t.len = 2;
-
-            scn->head += t.len;
+            SIMPLE_TOKEN(TOKEN_AND, 2);
           }
         } break;
       case '|':
         {
           if (scanner_peek(scn) == '|') {
-            t.type = TOKEN_OR;
-            t.start = scn->head;
-            t.len = 2;
-
-            scn->head += t.len;
+            SIMPLE_TOKEN(TOKEN_OR, 2);
           }
         } break;
       SIMPLE_CASE(',', TOKEN_COMMA);
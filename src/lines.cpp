@@ -0,0 +1,76 @@
+// Works out line and column numbers from source positions, which are byte
+// offsets into the source. Tokens, AST nodes and instructions only keep
+// positions, as lines are only needed to report errors and disassemble code.
+//
+// The newlines in the source are only looked for the first time a position is
+// looked up, so programs which compile without errors never pay for it.
+//
+// Usage:
+//
+// LineIndex lines = {};
+// lineIndex_init(&lines, source);
+//
+// int line, column;
+// lineIndex_find(&lines, pos, &line, &column);
+//
+// lineIndex_free(&lines);
+
+array_for(uint32);
+
+struct LineIndex {
+  char* source;
+
+  // Position of the first character of each line, once built.
+  array(uint32) starts;
+};
+
+void lineIndex_init(LineIndex* index, char* source) {
+  index->source = source;
+  index->starts = 0;
+}
+
+void lineIndex_free(LineIndex* index) {
+  if (index->starts != 0) {
+    free(array_header(index->starts));
+  }
+
+  lineIndex_init(index, 0);
+}
+
+// NOTE: '\r' and '\n' each start a new line, the same as the
+// scanner treats them.
+void lineIndex_build(LineIndex* index) {
+  index->starts = array_uint32_init();
+
+  array_uint32_add(&index->starts, 0);
+
+  for (char* c = index->source; *c != '\0'; c++) {
+    if (us_isNewline(*c)) {
+      array_uint32_add(&index->starts, (uint32) (c + 1 - index->source));
+    }
+  }
+}
+
+// Sets line and column (both starting at 1) to where pos is in the source.
+void lineIndex_find(LineIndex* index, uint32 pos, int* line, int* column) {
+  if (index->starts == 0) {
+    lineIndex_build(index);
+  }
+
+  // The last line starting at or before pos.
+  int lo = 0;
+  int hi = (int) array_count(index->starts) - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+
+    if (index->starts[mid] <= pos) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  *line = lo + 1;
+  *column = (int) (pos - index->starts[lo]) + 1;
+}
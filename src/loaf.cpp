@@ -0,0 +1,207 @@
+#include <stdlib.h> // malloc, realloc
+#include <stdio.h> // logf
+#include <assert.h> // assert
+#include <string.h> // memcmp
+#include <stdarg.h>
+#include <stdint.h> // uintptr_t, INT16_MAX
+#include <math.h> // signbit
+#include <signal.h> // sigaction
+#include <setjmp.h> // sigsetjmp, siglongjmp
+#include <sys/mman.h> // mmap, mprotect, madvise
+#include <sys/stat.h> // fstat
+#include <fcntl.h> // open
+#include <unistd.h> // sysconf, close
+
+#ifdef __SSE2__
+#include <emmintrin.h> // _mm_cmpeq_epi8, _mm_movemask_epi8
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // _mm256_cmpeq_epi8, _mm256_movemask_epi8
+#endif
+
+// TODO(harrison): add some of above dependencies into uslib
+
+#include <us.hpp>
+
+#define REALLOC(Type, ptr, count) ((Type*) realloc(ptr, count * sizeof(Type)))
+
+#include <debug.cpp>
+
+#include <arena.cpp>
+#include <array.cpp>
+#include <value.cpp>
+
+#include <table.cpp>
+#include <bindings.cpp>
+#include <lines.cpp>
+
+#include <bytecode.cpp>
+#include <peephole.cpp>
+#include <lexer.cpp>
+#include <ast.cpp>
+#include <fold.cpp>
+#include <typing.cpp>
+#include <parser.cpp>
+
+// Maps the file at path into memory, read only, followed by at least one '\0'
+// so it can be used as a null terminated string. Sets mapped to the number of
+// bytes mapped, for loaf_unmapFile. Returns 0 on failure.
+//
+// NOTE: pages of the file are only read in when the scanner first
+// touches them, so compiling can start before all of it has been read.
+char* loaf_mapFile(const char* path, psize* mapped) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    logf("ERROR: can't open file\n");
+
+    return 0;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == -1) {
+    logf("ERROR: can't stat file\n");
+
+    close(fd);
+
+    return 0;
+  }
+
+  psize size = (psize) info.st_size;
+
+  // Positions in the source are 32 bit offsets.
+  if (size >= UINT32_MAX) {
+    logf("ERROR: file is too big\n");
+
+    close(fd);
+
+    return 0;
+  }
+
+  psize page = (psize) sysconf(_SC_PAGESIZE);
+
+  // The file's pages, and at least one zeroed page after them for the '\0'.
+  // The file is mapped over the start of it.
+  *mapped = (size / page + 1) * page;
+
+  char* source = (char*) mmap(0, *mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (source == MAP_FAILED) {
+    logf("ERROR: not enough memory to read file\n");
+
+    close(fd);
+
+    return 0;
+  }
+
+  if (size > 0 && mmap(source, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    logf("ERROR: could not map file into memory\n");
+
+    munmap(source, *mapped);
+    close(fd);
+
+    return 0;
+  }
+
+  close(fd);
+
+  madvise(source, *mapped, MADV_SEQUENTIAL);
+
+  return source;
+}
+
+void loaf_unmapFile(char* source, psize mapped) {
+  munmap(source, mapped);
+}
+
+// Does the work of loaf_compile, allocating from compiler_arena.
+bool loaf_compileIn(char* source, Hunk* hunk, BytecodeFormat format, bool optimize) {
+  Scanner scanner = {0};
+  scanner_load(&scanner, source);
+
+  AST ast = {};
+  ast_init(&ast, source);
+
+  Parser parser = {};
+  parser_init(&parser, &scanner, &ast);
+
+  if (!parser_parse(&parser)) {
+    logf("Couldn't parse program...\n");
+
+    return false;
+  }
+
+  SymbolTable symbols = {};
+  symbolTable_init(&symbols);
+
+  bool typed = typeCheck(&ast, parser.root, &symbols);
+
+  symbolTable_free(&symbols);
+
+  if (!typed) {
+    logf("Typecheck failed...\n");
+
+    return false;
+  }
+
+  if (optimize) {
+    ast_fold(&ast, parser.root);
+  }
+
+  hunk_init(hunk, format);
+
+  ast_declareGlobals(&ast, parser.root, hunk);
+
+  Scope scope = {};
+  scope_init(&scope, hunk, ast_findUses(&ast, parser.root));
+
+  bool generated;
+
+  if (format == BYTECODE_REGISTER) {
+    generated = ast_writeRegisterBytecode(&ast, parser.root, hunk, &scope);
+
+    hunk_write(hunk, OP_R_RETURN, 0);
+    hunk_write(hunk, 0, 0);
+    hunk_write(hunk, 0, 0);
+  } else {
+    generated = ast_writeBytecode(&ast, parser.root, hunk, &scope);
+
+    hunk_write(hunk, OP_RETURN, 0);
+    hunk_write(hunk, 0, 0);
+  }
+
+  scope_free(&scope);
+
+  if (!generated) {
+    logf("Couldn't generate bytecode\n");
+
+    return false;
+  }
+
+  if (optimize) {
+    hunk_optimize(hunk);
+  }
+
+  return true;
+}
+
+// Runs source through the lexer, parser, type checker and code generator,
+// leaving a runnable program in hunk. optimize folds constants in the AST
+// before code generation, and runs the peephole optimizer over the result.
+//
+// The AST and everything else only needed while compiling live in an arena
+// which is freed before this returns. Tokens are only kept until the parser
+// has moved past them. Nothing compiled into hunk points into source.
+bool loaf_compile(char* source, Hunk* hunk, BytecodeFormat format = BYTECODE_STACK, bool optimize = true) {
+  Arena arena = {};
+  arena_init(&arena);
+
+  compiler_arena = &arena;
+
+  bool ok = loaf_compileIn(source, hunk, format, optimize);
+
+  compiler_arena = 0;
+
+  arena_free(&arena);
+
+  return ok;
+}
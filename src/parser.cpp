@@ -4,42 +4,133 @@
 //
 // operator = "+"
 //
-// term = identifier | number | "(" numerical_expression ")"
-// expression = term [ operator term ]
+// term = identifier | number | function_call | "(" expression ")"
+// expression = term { operator term }
 //
 // function_call = identifier "(" expression ")"
 //
 // assignment = identifier ":=" expression
 // statement = assignment | function_call
 
-array_for(ASTNode);
+// How many tokens the parser can look ahead of the one it's on, plus one.
+// Must be a power of two.
+#define PARSER_LOOKAHEAD (4)
+
+// How deeply brackets, operands of tighter operators and blocks can be nested
+// inside each other. The passes after parsing recurse over them.
+#define PARSER_NESTING_MAX (1000)
 
-array_for(Token);
 struct Parser {
-  array(Token) tokens;
-  Token* head;
+  // NOTE: tokens are pulled from the scanner as the parser needs
+  // them, and only kept until it has moved past them. lookahead is a ring
+  // buffer of the count tokens starting at the head, which is at first.
+  Scanner* scanner;
+
+  Token lookahead[PARSER_LOOKAHEAD];
+  int first;
+  int count;
+
+  // Set once the scanner has handed out TOKEN_EOF or TOKEN_ILLEGAL, which is
+  // then repeated forever.
+  bool scannerDone;
+  Token last;
+
+  // How deeply nested the parser is, and whether that has got too deep. Once
+  // it has, nothing else is parsed.
+  int depth;
+  bool failed;
 
-  ASTNode root;
+  // Where the nodes go.
+  AST* ast;
+
+  ASTNodeId root;
 };
 
-void parser_init(Parser* p, array(Token) tokens) {
-  p->tokens = tokens;
+void parser_init(Parser* p, Scanner* scanner, AST* ast) {
+  p->scanner = scanner;
+
+  p->first = 0;
+  p->count = 0;
+  p->scannerDone = false;
+
+  p->depth = 0;
+  p->failed = false;
 
-  p->head = p->tokens;
+  p->ast = ast;
+  p->root = AST_NODE_NONE;
+}
+
+// Adds the next token from the scanner to the end of the lookahead, skipping
+// comments.
+void parser_pull(Parser* p) {
+  if (!p->scannerDone) {
+    Token t;
+
+    do {
+      t = scanner_getToken(p->scanner);
+    } while (t.type == TOKEN_COMMENT);
+
+    if (t.type == TOKEN_ILLEGAL) {
+      logf("ERROR lexing code\n");
+    }
+
+    p->scannerDone = t.type == TOKEN_EOF || t.type == TOKEN_ILLEGAL;
+    p->last = t;
+  }
+
+  p->lookahead[(p->first + p->count) & (PARSER_LOOKAHEAD - 1)] = p->last;
+  p->count += 1;
+}
+
+// The token n tokens after the head, which is the one being parsed.
+Token* parser_peek(Parser* p, int n = 0) {
+  assert(n < PARSER_LOOKAHEAD);
+
+  while (p->count <= n) {
+    parser_pull(p);
+  }
+
+  return &p->lookahead[(p->first + n) & (PARSER_LOOKAHEAD - 1)];
 }
 
 void parser_advance(Parser* p) {
-  // TODO(harrison): skip comment tokens
-  p->head += 1;
+  if (p->count == 0) {
+    parser_pull(p);
+  }
+
+  p->first = (p->first + 1) & (PARSER_LOOKAHEAD - 1);
+  p->count -= 1;
+}
+
+// Logs the token at the head and where it is, for syntax errors. The lines of
+// the source are only worked out here.
+void parser_logHead(Parser* p) {
+  Token* head = parser_peek(p);
+
+  LineIndex lines = {};
+  lineIndex_init(&lines, p->scanner->source);
+
+  int line, column;
+  lineIndex_find(&lines, head->pos, &line, &column);
+
+  logf("%d:%d: token: %.*s. %d\n", line, column, head->len, scanner_text(p->scanner, *head), head->type);
+
+  lineIndex_free(&lines);
 }
 
 bool parser_allow(Parser* p, TokenType type, Token* tok = 0) {
-  if (p->head->type != type) {
+  if (p->failed) {
+    return false;
+  }
+
+  Token* head = parser_peek(p);
+
+  if (head->type != type) {
     return false;
   }
 
   if (tok != 0) {
-    *tok = *p->head;
+    *tok = *head;
   }
 
   return true;
@@ -55,7 +146,30 @@ bool parser_expect(Parser *p, TokenType type, Token* tok = 0) {
   return true;
 }
 
-bool parser_parseComplexExpression(Parser* p, ASTNode* node, TokenType endOn = TOKEN_SEMICOLON);
+bool parser_parseComplexExpression(Parser* p, ASTNodeId* node, TokenType endOn = TOKEN_SEMICOLON);
+
+// Goes one level deeper into nested code. Returns false, having reported it,
+// if that is too deep.
+bool parser_enter(Parser* p) {
+  if (p->depth >= PARSER_NESTING_MAX) {
+    if (!p->failed) {
+      parser_logHead(p);
+      logf("ERROR: code is nested more than %d deep\n", PARSER_NESTING_MAX);
+    }
+
+    p->failed = true;
+
+    return false;
+  }
+
+  p->depth += 1;
+
+  return true;
+}
+
+void parser_leave(Parser* p) {
+  p->depth -= 1;
+}
 
 // int x = 10 + y;
 //              ^
@@ -63,21 +177,21 @@ bool parser_parseComplexExpression(Parser* p, ASTNode* node, TokenType endOn = T
 //   ^
 // int x = 10 + func(y);
 //                ^  ^
-bool parser_parseIdentifier(Parser* p, ASTNode* node, Token tIdent) {
+bool parser_parseIdentifier(Parser* p, ASTNodeId* node, Token tIdent) {
   assert(tIdent.type == TOKEN_IDENTIFIER);
 
   if (parser_expect(p, TOKEN_BRACKET_OPEN)) {
-    array(ASTNode) args = array_ASTNode_init();
+    array(ASTNodeId) args = array_ASTNodeId_initIn(compiler_arena);
 
     if (!parser_allow(p, TOKEN_BRACKET_CLOSE)) {
       while (true) {
-        ASTNode n = {};
+        ASTNodeId n = AST_NODE_NONE;
 
         if (!parser_parseComplexExpression(p, &n, TOKEN_COMMA)) {
           return false;
         }
 
-        array_ASTNode_add(&args, n);
+        array_ASTNodeId_add(&args, n);
 
         if (!parser_expect(p, TOKEN_COMMA)) {
           break;
@@ -86,7 +200,7 @@ bool parser_parseIdentifier(Parser* p, ASTNode* node, Token tIdent) {
     }
 
     if (parser_expect(p, TOKEN_BRACKET_CLOSE)) {
-      *node = ast_makeFunctionCall(tIdent, args);
+      *node = ast_makeFunctionCall(p->ast, tIdent, args, array_count(args));
 
       return true;
     }
@@ -94,145 +208,197 @@ bool parser_parseIdentifier(Parser* p, ASTNode* node, Token tIdent) {
     return false;
   }
 
-  *node = ast_makeIdentifier(tIdent);
+  *node = ast_makeIdentifier(p->ast, tIdent);
 
   return true;
 }
 
-bool parser_parseBrackets(Parser* p, ASTNode* node);
-
-// Perform algorithm:
-// for: N * N + N * Bx + I
-//  - group multiplication and division together until there are no operations of that sort in the top level
-//    - becomes: B(N * N) + B(N * Bx) + I
-//  - group addition and subtraction together
-//    - becomes: B(B(B(N * N) + B(N * Bx)) + I)
-// therefore everything has been reduced into a single binary expression
-bool parser_parseComplexExpression(Parser* p, ASTNode* node, TokenType endOn) {
-  array(ASTNode) expression = array_ASTNode_init();
-
-  while (true) {
-    ASTNode n = {};
-    Token t = {};
-
-    if (parser_expect(p, TOKEN_NUMBER, &t)) {
-      n = ast_makeNumber(us_parseInt(t.start, t.len), t);
-    } else if (parser_expect(p, TOKEN_ADD, &t)) {
-      n = ast_makeOperator(AST_NODE_ADD, t);
-    } else if (parser_expect(p, TOKEN_SUBTRACT, &t)) {
-      n = ast_makeOperator(AST_NODE_SUBTRACT, t);
-    } else if (parser_expect(p, TOKEN_MULTIPLY, &t)) {
-      n = ast_makeOperator(AST_NODE_MULTIPLY, t);
-    } else if (parser_expect(p, TOKEN_DIVIDE, &t)) {
-      n = ast_makeOperator(AST_NODE_DIVIDE, t);
-    } else if (parser_expect(p, TOKEN_EQUALS, &t)) {
-      n = ast_makeOperator(AST_NODE_TEST_EQUAL, t);
-    } else if (parser_expect(p, TOKEN_GREATER, &t)) {
-      ASTNodeType type = AST_NODE_TEST_GREATER;
-      if (parser_expect(p, TOKEN_ASSIGNMENT)) {
-        type = AST_NODE_TEST_GREATER_EQUAL;
-      }
+bool parser_parseBrackets(Parser* p, ASTNodeId* node);
 
-      n = ast_makeOperator(type, t);
-    } else if (parser_expect(p, TOKEN_LESSER, &t)) {
-      ASTNodeType type = AST_NODE_TEST_LESSER;
-      if (parser_expect(p, TOKEN_ASSIGNMENT)) {
-        type = AST_NODE_TEST_LESSER_EQUAL;
-      }
+// Binary operators, from the one which binds tightest to the loosest. Every
+// operator has a level of its own: / binds looser than *, and - looser than +
+// (ie. a - b + c is a - (b + c)).
+// TODO: put + and -, and * and /, on the same level
+ASTNodeType precedenceOrder[] = {
+  // Numeric
+  AST_NODE_MULTIPLY, AST_NODE_DIVIDE, AST_NODE_ADD, AST_NODE_SUBTRACT,
 
-      n = ast_makeOperator(type, t);
-    } else if (parser_expect(p, TOKEN_AND, &t)) {
-      n = ast_makeOperator(AST_NODE_TEST_AND, t);
-    } else if (parser_expect(p, TOKEN_OR, &t)) {
-      n = ast_makeOperator(AST_NODE_TEST_OR, t);
-    } else if (parser_expect(p, TOKEN_IDENTIFIER, &t)) {
-      if (!parser_parseIdentifier(p, &n, t)) {
-        return false;
-      }
-    } else if (parser_allow(p, TOKEN_BRACKET_OPEN)) {
-      if (!parser_parseBrackets(p, &n)) {
-        return false;
-      }
-    } else if (parser_allow(p, endOn) || parser_allow(p, TOKEN_CURLY_OPEN) || parser_allow(p, TOKEN_BRACKET_CLOSE)) {
-      break;
-    } else {
-      logf("token: %.*s. %d\n", t.len, t.start, t.type);
+  // Comparative
+  AST_NODE_TEST_EQUAL, AST_NODE_TEST_GREATER, AST_NODE_TEST_LESSER,
+  AST_NODE_TEST_GREATER_EQUAL, AST_NODE_TEST_LESSER_EQUAL,
 
-      assert(!"Unknown token type");
+  // Logical
+  AST_NODE_TEST_AND, AST_NODE_TEST_OR,
+};
+
+// Binding power of the binary operator op; the higher it is, the tighter op
+// binds.
+int parser_bindingPower(ASTNodeType op) {
+  int count = (int) (sizeof(precedenceOrder) / sizeof(precedenceOrder[0]));
+
+  for (int i = 0; i < count; i++) {
+    if (precedenceOrder[i] == op) {
+      return count - i;
     }
+  }
+
+  assert(!"Not a binary operator");
 
-    array_ASTNode_add(&expression, n);
+  return 0;
+}
+
+// Works out which binary operator starts at the head, without consuming it.
+// len is set to the number of tokens it's made of. Returns false if the head
+// isn't an operator.
+bool parser_peekOperator(Parser* p, ASTNodeType* op, int* len) {
+  *len = 1;
+
+  switch (parser_peek(p)->type) {
+    case TOKEN_ADD:
+      {
+        *op = AST_NODE_ADD;
+      } break;
+    case TOKEN_SUBTRACT:
+      {
+        *op = AST_NODE_SUBTRACT;
+      } break;
+    case TOKEN_MULTIPLY:
+      {
+        *op = AST_NODE_MULTIPLY;
+      } break;
+    case TOKEN_DIVIDE:
+      {
+        *op = AST_NODE_DIVIDE;
+      } break;
+    case TOKEN_EQUALS:
+      {
+        *op = AST_NODE_TEST_EQUAL;
+      } break;
+    case TOKEN_AND:
+      {
+        *op = AST_NODE_TEST_AND;
+      } break;
+    case TOKEN_OR:
+      {
+        *op = AST_NODE_TEST_OR;
+      } break;
+    case TOKEN_GREATER:
+    case TOKEN_LESSER:
+      {
+        bool orEqual = parser_peek(p, 1)->type == TOKEN_ASSIGNMENT;
+
+        if (parser_peek(p)->type == TOKEN_GREATER) {
+          *op = orEqual ? AST_NODE_TEST_GREATER_EQUAL : AST_NODE_TEST_GREATER;
+        } else {
+          *op = orEqual ? AST_NODE_TEST_LESSER_EQUAL : AST_NODE_TEST_LESSER;
+        }
+
+        if (orEqual) {
+          *len = 2;
+        }
+      } break;
+    default:
+      {
+        return false;
+      } break;
   }
 
-#define LEFT() (expression[i])
-#define OP() (expression[i + 1])
-#define RIGHT() (expression[i + 2])
+  return true;
+}
 
-  array(ASTNode) working = array_ASTNode_init();
+// term = number | identifier | function_call | "(" expression ")"
+bool parser_parseTerm(Parser* p, ASTNodeId* node) {
+  Token t = {};
 
-  ASTNodeType precedenceOrder[] = {
-    // Numeric
-    AST_NODE_MULTIPLY, AST_NODE_DIVIDE, AST_NODE_ADD, AST_NODE_SUBTRACT,
+  if (parser_expect(p, TOKEN_NUMBER, &t)) {
+    *node = ast_makeNumber(p->ast, us_parseInt(scanner_text(p->scanner, t), t.len), t);
 
-    // Comparative
-    AST_NODE_TEST_EQUAL, AST_NODE_TEST_GREATER, AST_NODE_TEST_LESSER,
-    AST_NODE_TEST_GREATER_EQUAL, AST_NODE_TEST_LESSER_EQUAL,
+    return true;
+  } else if (parser_expect(p, TOKEN_IDENTIFIER, &t)) {
+    return parser_parseIdentifier(p, node, t);
+  } else if (parser_allow(p, TOKEN_BRACKET_OPEN)) {
+    return parser_parseBrackets(p, node);
+  }
 
-    // Logical
-    AST_NODE_TEST_AND, AST_NODE_TEST_OR,
-  };
+  parser_logHead(p);
 
-  for (ASTNodeType currentOP : precedenceOrder) {
-    psize i = 0;
+  assert(!"Unknown token type");
 
-    while (i < array_count(expression) && array_count(expression) != 1) {
-      if (i + 2 >= array_count(expression)) {
-        break;
-      }
+  return false;
+}
 
-      ASTNode left = LEFT();
-      ASTNode op = OP();
-      ASTNode right = RIGHT();
+// Parses a term and then every operator after it which binds tighter than
+// minPower, along with their right hand sides. Operators of the same power
+// group to the left, so a chain of them is parsed in a loop instead of
+// recursing once per operator.
+bool parser_parseBinary(Parser* p, ASTNodeId* node, int minPower) {
+  if (!parser_enter(p)) {
+    return false;
+  }
 
-      if (op.type != currentOP) {
-        array_ASTNode_add(&working, left);
-        array_ASTNode_add(&working, op);
+  ASTNodeId left = AST_NODE_NONE;
 
-        i += 2;
+  if (!parser_parseTerm(p, &left)) {
+    parser_leave(p);
 
-        continue;
-      }
+    return false;
+  }
 
-      Token t = {};
-      t.line = op.line;
+  ASTNodeType op;
+  int len;
 
-      ASTNode compressed = ast_makeOperatorWith(op.type, left, right, t);
-      array_ASTNode_add(&working, compressed);
+  while (parser_peekOperator(p, &op, &len)) {
+    int power = parser_bindingPower(op);
 
-      // Copy nodes after the right node;
-      psize j = i + 3;
-      while (j < array_count(expression)) {
-        ASTNode n = expression[j];
-        array_ASTNode_add(&working, n);
+    if (power <= minPower) {
+      break;
+    }
 
-        j += 1;
-      }
+    ASTNodeId opNode = ast_makeOperator(p->ast, op, *parser_peek(p));
 
-      array_ASTNode_copy(&working, &expression);
-      array_ASTNode_zero(&working);
+    for (int i = 0; i < len; i++) {
+      parser_advance(p);
     }
 
-    array_ASTNode_zero(&working);
+    ASTNodeId right = AST_NODE_NONE;
+
+    if (!parser_parseBinary(p, &right, power)) {
+      parser_leave(p);
+
+      return false;
+    }
+
+    ast_setOperands(p->ast, opNode, left, right);
+
+    left = opNode;
+  }
+
+  *node = left;
+
+  parser_leave(p);
+
+  return true;
+}
+
+// Parses an expression made of terms and binary operators, which ends at
+// endOn (or an opening curly bracket, or a closing bracket).
+bool parser_parseComplexExpression(Parser* p, ASTNodeId* node, TokenType endOn) {
+  if (!parser_parseBinary(p, node, 0)) {
+    return false;
   }
 
-  assert(array_count(expression) == 1);
+  if (!parser_allow(p, endOn) && !parser_allow(p, TOKEN_CURLY_OPEN) && !parser_allow(p, TOKEN_BRACKET_CLOSE)) {
+    parser_logHead(p);
 
-  *node = expression[0];
+    assert(!"Unknown token type");
+
+    return false;
+  }
 
   return true;
 }
 
-bool parser_parseBrackets(Parser* p, ASTNode* node) {
+bool parser_parseBrackets(Parser* p, ASTNodeId* node) {
   if (parser_expect(p, TOKEN_BRACKET_OPEN)) {
     if (parser_parseComplexExpression(p, node, TOKEN_BRACKET_CLOSE)) {
       if (parser_expect(p, TOKEN_BRACKET_CLOSE)) {
@@ -244,15 +410,15 @@ bool parser_parseBrackets(Parser* p, ASTNode* node) {
   return false;
 }
 
-bool parser_parseExpression(Parser* p, ASTNode* node) {
+bool parser_parseExpression(Parser* p, ASTNodeId* node) {
   Token t;
 
   if (parser_expect(p, TOKEN_TRUE, &t)) {
-    *node = ast_makeValue(value_make(true), t);
+    *node = ast_makeValue(p->ast, value_make(true), t);
 
     return true;
   } else if (parser_expect(p, TOKEN_FALSE, &t)) {
-    *node = ast_makeValue(value_make(false), t);
+    *node = ast_makeValue(p->ast, value_make(false), t);
 
     return true;
   } else if (parser_parseComplexExpression(p, node)) {
@@ -266,15 +432,15 @@ bool parser_parseExpression(Parser* p, ASTNode* node) {
   return false;
 }
 
-bool parser_parseBlock(Parser* p, ASTNode* node);
+bool parser_parseBlock(Parser* p, ASTNodeId* node);
 
-bool parser_parseReturn(Parser* p, ASTNode* node) {
+bool parser_parseReturn(Parser* p, ASTNodeId* node) {
   Token tok;
   if (parser_expect(p, TOKEN_RETURN, &tok)) {
-    ASTNode expr = {};
+    ASTNodeId expr = AST_NODE_NONE;
 
     if (parser_parseExpression(p, &expr)) {
-      *node = ast_makeReturn(expr, tok);
+      *node = ast_makeReturn(p->ast, expr, tok);
 
       return true;
     }
@@ -283,33 +449,35 @@ bool parser_parseReturn(Parser* p, ASTNode* node) {
   return false;
 }
 
-bool parser_parseStatement(Parser* p, ASTNode* node) {
+bool parser_parseStatement(Parser* p, ASTNodeId* node) {
   Token tIdent;
+  Token tLog;
+
   if (parser_expect(p, TOKEN_IDENTIFIER, &tIdent)) {
-    ASTNode ident = ast_makeIdentifier(tIdent);
+    ASTNodeId ident = ast_makeIdentifier(p->ast, tIdent);
 
     Token tAss;
     if (parser_expect(p, TOKEN_ASSIGNMENT_DECLARATION, &tAss)) {
-      ASTNode val = {};
+      ASTNodeId val = AST_NODE_NONE;
 
       if (parser_parseExpression(p, &val)) {
-        *node = ast_makeAssignmentDeclaration(ident, val, tAss);
+        *node = ast_makeAssignmentDeclaration(p->ast, ident, val, tAss.pos);
 
         return true;
       }
     } else if (parser_expect(p, TOKEN_ASSIGNMENT, &tAss)) {
-      ASTNode val = {};
+      ASTNodeId val = AST_NODE_NONE;
 
       if (parser_parseExpression(p, &val)) {
-        *node = ast_makeAssignment(ident, val, tAss);
+        *node = ast_makeAssignment(p->ast, ident, val, tAss);
 
         return true;
       }
     } else if (parser_parseIdentifier(p, node, tIdent)) {
       return true;
     }
-  } else if (parser_expect(p, TOKEN_LOG)) {
-    *node = ast_makeLog();
+  } else if (parser_expect(p, TOKEN_LOG, &tLog)) {
+    *node = ast_makeLog(p->ast, tLog);
 
     return true;
   } else if (parser_expect(p, TOKEN_VAR)) {
@@ -317,7 +485,7 @@ bool parser_parseStatement(Parser* p, ASTNode* node) {
       Token type;
 
       if (parser_expect(p, TOKEN_IDENTIFIER, &type)) {
-        *node = ast_makeDeclaration(tIdent, type);
+        *node = ast_makeDeclaration(p->ast, tIdent, type);
 
         return true;
       }
@@ -330,23 +498,25 @@ bool parser_parseStatement(Parser* p, ASTNode* node) {
   return false;
 }
 
-bool parser_parseIf(Parser* p, ASTNode* node) {
-  if (parser_expect(p, TOKEN_IF)) {
-      ASTNode condition = {};
+bool parser_parseIf(Parser* p, ASTNodeId* node) {
+  Token tIf;
+
+  if (parser_expect(p, TOKEN_IF, &tIf)) {
+      ASTNodeId condition = AST_NODE_NONE;
       if (parser_parseExpression(p, &condition)) {
-        ASTNode block = {};
+        ASTNodeId block = AST_NODE_NONE;
 
         if (parser_parseBlock(p, &block)) {
           if (parser_expect(p, TOKEN_ELSE)) {
-            ASTNode elseBlock = {};
+            ASTNodeId elseBlock = AST_NODE_NONE;
 
             if (parser_parseBlock(p, &elseBlock)) {
-              *node = ast_makeIf(condition, block, elseBlock);
+              *node = ast_makeIf(p->ast, tIf, condition, block, elseBlock);
 
               return true;
             }
           } else {
-            *node = ast_makeIf(condition, block);
+            *node = ast_makeIf(p->ast, tIf, condition, block);
 
             return true;
           }
@@ -357,28 +527,34 @@ bool parser_parseIf(Parser* p, ASTNode* node) {
   return false;
 }
 
-bool parser_parseBlock(Parser* p, ASTNode* node);
+bool parser_parseBlock(Parser* p, ASTNodeId* node);
 
-bool parser_parseFunctionDeclaration(Parser* p, ASTNode* node) {
+bool parser_parseFunctionDeclaration(Parser* p, ASTNodeId* node) {
   if (parser_expect(p, TOKEN_FUNC)) {
     Token ident;
 
     if (parser_expect(p, TOKEN_IDENTIFIER, &ident)) {
       if (parser_expect(p, TOKEN_BRACKET_OPEN)) {
-        array(Parameter) parameters = array_Parameter_init();
+        array(Parameter) parameters = array_Parameter_initIn(compiler_arena);
 
         if (!parser_allow(p, TOKEN_BRACKET_CLOSE)) {
           while (true) {
             Parameter param = {};
 
-            if (!parser_expect(p, TOKEN_IDENTIFIER, &param.identifier)) {
+            Token tParam;
+            Token tType;
+
+            if (!parser_expect(p, TOKEN_IDENTIFIER, &tParam)) {
               return false;
             }
 
-            if (!parser_expect(p, TOKEN_IDENTIFIER, &param.type)) {
+            if (!parser_expect(p, TOKEN_IDENTIFIER, &tType)) {
               return false;
             }
 
+            param.identifier = ast_span(p->ast, tParam);
+            param.type = ast_span(p->ast, tType);
+
             array_Parameter_add(&parameters, param);
 
             if (!parser_expect(p, TOKEN_COMMA)) {
@@ -393,10 +569,10 @@ bool parser_parseFunctionDeclaration(Parser* p, ASTNode* node) {
           // optional return type
           parser_expect(p, TOKEN_IDENTIFIER, &ret);
 
-          ASTNode source;
+          ASTNodeId source = AST_NODE_NONE;
 
           if (parser_parseBlock(p, &source)) {
-            *node = ast_makeFunctionDeclaration(ident, source, parameters, ret);
+            *node = ast_makeFunctionDeclaration(p->ast, ident, source, parameters, array_count(parameters), ret);
 
             return true;
           }
@@ -408,11 +584,13 @@ bool parser_parseFunctionDeclaration(Parser* p, ASTNode* node) {
   return false;
 }
 
-bool parser_parseScope(Parser* p, ASTNode* node) {
-  ASTNode block = ast_makeRoot();
+bool parser_parseScope(Parser* p, ASTNodeId* node) {
+  // NOTE: the statements of a block have to be next to each other in
+  // the AST's lists, so they are collected here until the block is finished.
+  array(ASTNodeId) children = array_ASTNodeId_initIn(compiler_arena);
 
-  while (p->head->type != TOKEN_EOF && p->head->type != TOKEN_CURLY_CLOSE) {
-    ASTNode next = {};
+  while (parser_peek(p)->type != TOKEN_EOF && parser_peek(p)->type != TOKEN_CURLY_CLOSE) {
+    ASTNodeId next = AST_NODE_NONE;
 
     if (parser_parseIf(p, &next)) {
       // do nothing
@@ -427,28 +605,35 @@ bool parser_parseScope(Parser* p, ASTNode* node) {
 
         return false;
       }
+    } else if (p->failed) {
+      return false;
     } else {
       assert(!"Don't know how to parse this");
     }
 
-    ast_root_add(&block, next);
+    array_ASTNodeId_add(&children, next);
   }
 
-  *node = block;
+  *node = ast_makeRoot(p->ast, children, array_count(children));
 
   return true;
 }
 
-bool parser_parseBlock(Parser* p, ASTNode* node) {
+bool parser_parseBlock(Parser* p, ASTNodeId* node) {
   if (parser_expect(p, TOKEN_CURLY_OPEN)) {
-    ASTNode block = {};
+    if (!parser_enter(p)) {
+      return false;
+    }
 
-    if (parser_parseScope(p, &block)) {
-      if (parser_expect(p, TOKEN_CURLY_CLOSE)) {
-        *node = block;
+    ASTNodeId block = AST_NODE_NONE;
+    bool parsed = parser_parseScope(p, &block) && parser_expect(p, TOKEN_CURLY_CLOSE);
 
-        return true;
-      }
+    parser_leave(p);
+
+    if (parsed) {
+      *node = block;
+
+      return true;
     }
   }
 
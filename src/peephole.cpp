@@ -0,0 +1,452 @@
+// A peephole optimizer which runs over finished hunks. The code generators
+// write every statement on its own, so it cleans up what ends up between
+// them:
+//
+// - OP_SET_LOCAL n followed by OP_GET_LOCAL n becomes OP_TEE_LOCAL n.
+// - jumps to jumps are pointed straight at the final target, and jumps to a
+//   return become that return.
+// - jumps to the next instruction are removed.
+// - code which can't be reached (ie. after a return, or the OP_RETURN 0 put
+//   after a function body which always returns) is removed.
+//
+// Once nothing else changes, pairs of instructions with a superinstruction
+// are replaced by it, unless something jumps between them.
+//
+// Jump offsets are recomputed when the hunk is written back out. If a jump
+// ends up too far away for its offset, the rewrites which moved it are dropped.
+
+#define PEEPHOLE_OPERANDS_MAX (OPCODE_OPERANDS_MAX)
+#define PEEPHOLE_PASSES_MAX (8)
+
+struct PeepholeInstruction {
+  Instruction op;
+  Instruction operands[PEEPHOLE_OPERANDS_MAX];
+  int operandCount;
+
+  uint32 pos;
+
+  // Index of the instruction this jumps to, or -1 if it isn't a jump.
+  int target;
+
+  bool live;
+};
+
+array_for(PeepholeInstruction);
+
+// Which operand holds the offset of a jump, or -1 if in isn't a jump.
+int peephole_jumpOperand(Instruction in) {
+  switch (in) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_EQ:
+    case OP_JUMP_IF_NOT_GT:
+    case OP_JUMP_IF_NOT_LT:
+    case OP_JUMP_IF_NOT_GTE:
+    case OP_JUMP_IF_NOT_LTE:
+      {
+        return 0;
+      } break;
+    case OP_R_JUMP_IF_FALSE:
+      {
+        return 1;
+      } break;
+    case OP_R_JUMP_IF_NOT_EQ:
+    case OP_R_JUMP_IF_NOT_GT:
+    case OP_R_JUMP_IF_NOT_LT:
+    case OP_R_JUMP_IF_NOT_GTE:
+    case OP_R_JUMP_IF_NOT_LTE:
+      {
+        return 2;
+      } break;
+    default:
+      {
+        Superinstruction* super = superinstruction_find(in);
+
+        if (super != 0 && peephole_jumpOperand(super->second) != -1) {
+          return opcode_operandCount(super->first) + peephole_jumpOperand(super->second);
+        }
+
+        return -1;
+      } break;
+  }
+}
+
+// Does control never fall through to the instruction after in?
+bool peephole_isTerminator(Instruction in) {
+  return in == OP_JUMP || in == OP_RETURN || in == OP_R_RETURN;
+}
+
+bool peephole_isReturn(Instruction in) {
+  return in == OP_RETURN || in == OP_R_RETURN;
+}
+
+// Splits hunk into instructions, with jumps resolved to instruction indexes.
+// Returns false if the code can't be decoded.
+bool peephole_decode(Hunk* hunk, array(PeepholeInstruction)* out) {
+  int count = hunk_getCount(hunk);
+
+  // Instruction index starting at each offset, or -1 for operands.
+  int* indexAt = (int*) malloc(sizeof(int) * (count + 1));
+
+  for (int i = 0; i <= count; i++) {
+    indexAt[i] = -1;
+  }
+
+  int offset = 0;
+  while (offset < count) {
+    PeepholeInstruction pi = {};
+    pi.op = hunk->code[offset];
+    pi.operandCount = opcode_operandCount(pi.op);
+    pi.pos = hunk->positions[offset];
+    pi.target = -1;
+
+    if (pi.operandCount > PEEPHOLE_OPERANDS_MAX || offset + pi.operandCount >= count) {
+      free(indexAt);
+
+      return false;
+    }
+
+    for (int i = 0; i < pi.operandCount; i++) {
+      pi.operands[i] = hunk->code[offset + 1 + i];
+    }
+
+    indexAt[offset] = (int) array_count(*out);
+    array_PeepholeInstruction_add(out, pi);
+
+    offset += 1 + pi.operandCount;
+  }
+
+  // Jumping to the very end is the same as jumping past the last instruction.
+  indexAt[count] = (int) array_count(*out);
+
+  int n = (int) array_count(*out);
+  offset = 0;
+
+  for (int i = 0; i < n; i++) {
+    PeepholeInstruction* pi = &(*out)[i];
+    int next = offset + 1 + pi->operandCount;
+
+    int jump = peephole_jumpOperand(pi->op);
+    if (jump != -1) {
+      int to = next + pi->operands[jump];
+
+      if (to > count || indexAt[to] == -1) {
+        free(indexAt);
+
+        return false;
+      }
+
+      pi->target = indexAt[to];
+    }
+
+    offset = next;
+  }
+
+  free(indexAt);
+
+  return true;
+}
+
+// Index of the first live instruction at or after i.
+int peephole_nextLive(array(PeepholeInstruction) code, int i) {
+  int n = (int) array_count(code);
+
+  while (i < n && !code[i].live) {
+    i += 1;
+  }
+
+  return i;
+}
+
+// Runs one round of rewrites over code. Returns true if anything changed.
+bool peephole_rewrite(array(PeepholeInstruction) code) {
+  int n = (int) array_count(code);
+  bool changed = false;
+
+  // Jumps to jumps, and jumps to returns.
+  for (int i = 0; i < n; i++) {
+    PeepholeInstruction* pi = &code[i];
+
+    if (pi->target == -1) {
+      continue;
+    }
+
+    // NOTE: offsets can only point forwards, so this always ends.
+    while (pi->target < n && code[pi->target].op == OP_JUMP && pi->target != code[pi->target].target) {
+      pi->target = code[pi->target].target;
+      changed = true;
+    }
+
+    if (pi->op == OP_JUMP && pi->target < n && peephole_isReturn(code[pi->target].op)) {
+      PeepholeInstruction ret = code[pi->target];
+      ret.pos = pi->pos;
+
+      *pi = ret;
+      changed = true;
+    }
+  }
+
+  // Everything reachable from the start is live.
+  for (int i = 0; i < n; i++) {
+    code[i].live = false;
+  }
+
+  int* work = (int*) malloc(sizeof(int) * (n + 1));
+  int workCount = 0;
+
+  if (n > 0) {
+    work[workCount++] = 0;
+    code[0].live = true;
+  }
+
+  while (workCount > 0) {
+    int i = work[--workCount];
+    PeepholeInstruction* pi = &code[i];
+
+    int successors[2] = { -1, -1 };
+
+    if (!peephole_isTerminator(pi->op)) {
+      successors[0] = i + 1;
+    }
+
+    if (pi->target != -1) {
+      successors[1] = pi->target;
+    }
+
+    for (int s : successors) {
+      if (s == -1 || s >= n || code[s].live) {
+        continue;
+      }
+
+      code[s].live = true;
+      work[workCount++] = s;
+    }
+  }
+
+  free(work);
+
+  for (int i = 0; i < n; i++) {
+    if (!code[i].live) {
+      changed = true;
+    }
+  }
+
+  // Jumps to the next instruction do nothing. Conditional jumps in the stack
+  // format still have to pop their condition, so they stay. Jumps which can
+  // be used in the register format (including OP_JUMP) only read slots.
+  for (int i = 0; i < n; i++) {
+    PeepholeInstruction* pi = &code[i];
+
+    OpcodeInfo info;
+
+    if (!pi->live || pi->target == -1 || !opcode_info(pi->op, &info) || !info.registers || superinstruction_find(pi->op) != 0) {
+      continue;
+    }
+
+    if (peephole_nextLive(code, pi->target) == peephole_nextLive(code, i + 1)) {
+      pi->live = false;
+      changed = true;
+    }
+  }
+
+  // Stores which are immediately loaded again.
+  bool* isTarget = (bool*) calloc(n + 1, sizeof(bool));
+
+  for (int i = 0; i < n; i++) {
+    if (code[i].live && code[i].target != -1) {
+      isTarget[peephole_nextLive(code, code[i].target)] = true;
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    PeepholeInstruction* set = &code[i];
+
+    if (!set->live || set->op != OP_SET_LOCAL) {
+      continue;
+    }
+
+    int next = peephole_nextLive(code, i + 1);
+    if (next >= n || isTarget[next]) {
+      continue;
+    }
+
+    PeepholeInstruction* get = &code[next];
+
+    if (get->op == OP_GET_LOCAL && get->operands[0] == set->operands[0]) {
+      set->op = OP_TEE_LOCAL;
+      get->live = false;
+
+      changed = true;
+    }
+  }
+
+  free(isTarget);
+
+  return changed;
+}
+
+// Replaces each pair of instructions which has a superinstruction with it,
+// from the start of code. The second of a pair can't be a jump target, as
+// there would be nowhere left to jump to. Returns true if anything changed.
+bool peephole_fuse(array(PeepholeInstruction) code) {
+  int n = (int) array_count(code);
+  bool changed = false;
+
+  bool* isTarget = (bool*) calloc(n + 1, sizeof(bool));
+
+  for (int i = 0; i < n; i++) {
+    if (code[i].live && code[i].target != -1) {
+      isTarget[peephole_nextLive(code, code[i].target)] = true;
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    PeepholeInstruction* first = &code[i];
+
+    if (!first->live) {
+      continue;
+    }
+
+    int next = peephole_nextLive(code, i + 1);
+    if (next >= n || isTarget[next]) {
+      continue;
+    }
+
+    PeepholeInstruction* second = &code[next];
+    Superinstruction* super = superinstruction_fuse(first->op, second->op);
+
+    if (super == 0) {
+      continue;
+    }
+
+    assert(first->target == -1);
+    assert(first->operandCount + second->operandCount <= PEEPHOLE_OPERANDS_MAX);
+
+    for (int j = 0; j < second->operandCount; j++) {
+      first->operands[first->operandCount + j] = second->operands[j];
+    }
+
+    first->op = super->op;
+    first->operandCount += second->operandCount;
+    first->target = second->target;
+
+    second->live = false;
+
+    changed = true;
+  }
+
+  free(isTarget);
+
+  return changed;
+}
+
+// Writes the live instructions in code back into hunk. Returns false, leaving
+// hunk as it was, if a jump has ended up too far away for its offset to hold.
+//
+// NOTE: pointing a jump at the end of a chain of jumps can take it
+// further than any of the jumps in the chain went.
+bool peephole_encode(Hunk* hunk, array(PeepholeInstruction) code) {
+  int n = (int) array_count(code);
+
+  // New offset of each instruction, and of the end of the hunk.
+  int* offsets = (int*) malloc(sizeof(int) * (n + 1));
+
+  int offset = 0;
+  for (int i = 0; i < n; i++) {
+    offsets[i] = offset;
+
+    if (code[i].live) {
+      offset += 1 + code[i].operandCount;
+    }
+  }
+
+  offsets[n] = offset;
+
+  for (int i = 0; i < n; i++) {
+    if (!code[i].live || code[i].target == -1) {
+      continue;
+    }
+
+    int next = offsets[i] + 1 + code[i].operandCount;
+
+    if (offsets[peephole_nextLive(code, code[i].target)] - next > UINT16_MAX) {
+      free(offsets);
+
+      return false;
+    }
+  }
+
+  array_Instruction_zero(&hunk->code);
+  array_uint32_zero(&hunk->positions);
+
+  for (int i = 0; i < n; i++) {
+    PeepholeInstruction pi = code[i];
+
+    if (!pi.live) {
+      continue;
+    }
+
+    int jump = peephole_jumpOperand(pi.op);
+    if (jump != -1) {
+      int next = offsets[i] + 1 + pi.operandCount;
+      int to = offsets[peephole_nextLive(code, pi.target)];
+
+      pi.operands[jump] = (Instruction) (to - next);
+    }
+
+    hunk_write(hunk, pi.op, pi.pos);
+
+    for (int j = 0; j < pi.operandCount; j++) {
+      hunk_write(hunk, pi.operands[j], pi.pos);
+    }
+  }
+
+  free(offsets);
+
+  return true;
+}
+
+// Optimizes hunk and every function hunk it defines.
+void hunk_optimize(Hunk* hunk) {
+  array(PeepholeInstruction) code = array_PeepholeInstruction_init();
+
+  if (peephole_decode(hunk, &code)) {
+    for (int pass = 0; pass < PEEPHOLE_PASSES_MAX; pass++) {
+      if (!peephole_rewrite(code) || !peephole_encode(hunk, code)) {
+        break;
+      }
+
+      array_PeepholeInstruction_zero(&code);
+
+      if (!peephole_decode(hunk, &code)) {
+        break;
+      }
+    }
+
+    // NOTE: the other rewrites only know about plain instructions,
+    // so this goes last. Whatever is still in the hunk is kept.
+    array_PeepholeInstruction_zero(&code);
+
+    if (peephole_decode(hunk, &code)) {
+      for (psize i = 0; i < array_count(code); i++) {
+        code[i].live = true;
+      }
+
+      if (peephole_fuse(code)) {
+        peephole_encode(hunk, code);
+      }
+    }
+  } else {
+    logf("WARNING: couldn't decode hunk, not optimizing it\n");
+  }
+
+  free(array_header(code));
+
+  for (psize i = 0; i < array_count(hunk->constants); i++) {
+    Value v = hunk->constants[i];
+
+    if (VALUE_IS_FUNCTION(v)) {
+      hunk_optimize(VALUE_AS_FUNCTION(v).hunk);
+    }
+  }
+}
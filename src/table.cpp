@@ -1,137 +1,266 @@
+// An open addressing hash table, laid out like a Swiss table.
+//
+// Slots are split into groups of TABLE_GROUP_WIDTH. Every slot has a control
+// byte which is either TABLE_CTRL_EMPTY, TABLE_CTRL_DELETED or, if the slot is
+// in use, the low 7 bits of its key's hash. A lookup probes whole groups at a
+// time: it compares the control bytes of a group against the hash in one go
+// (with SSE2 where available), and only looks at the entries which match. The
+// first group with an empty slot in it ends a lookup, so misses are cheap.
+//
+// Deleted slots are marked with a tombstone so that lookups keep probing past
+// them, unless their group still has an empty slot, in which case no lookup
+// could have probed past it.
+//
+// Keys are interned strings (see string_intern), so they are compared by
+// pointer and bring their own hash.
+
 struct TableEntry {
   String key;
   Value val;
-
-  int64 hash;
 };
 
-bool tableEntry_sameKey(TableEntry left, TableEntry right) {
-  if (left.key.len != right.key.len || left.hash != right.hash) {
-    return false;
-  }
+#define TABLE_GROUP_WIDTH (16)
 
-  return strncmp(left.key.str, right.key.str, left.key.len);
-}
+#define TABLE_CTRL_EMPTY ((uint8) 0x80)
+#define TABLE_CTRL_DELETED ((uint8) 0xFE)
+
+// Slots in use, including tombstones, can fill up to 7/8ths of the table.
+#define TABLE_MAX_LOAD(c) ((c) - (c) / 8)
 
-#define TABLE_MAX_LOAD (0.7)
-#define TABLE_CAPACITY_GROW(c) ( ((c) < 1) ? 8 : (c)*2 )
 struct Table {
+  // capacity control bytes, and the entries they describe.
+  uint8* ctrl;
   TableEntry* entries;
 
   int count;
+  int tombstones;
+
+  // Always 0 or a power of two, and a multiple of TABLE_GROUP_WIDTH.
   int capacity;
 };
 
 void table_init(Table* t) {
+  t->ctrl = 0;
   t->entries = 0;
   t->count = 0;
+  t->tombstones = 0;
   t->capacity = 0;
 }
 
-// From: http://www.cse.yorku.ca/~oz/hash.html
-uint64 table_hash(String str) {
-  uint64 hash = 5381;
-  char c;
+void table_free(Table* t) {
+  free(t->ctrl);
+  free(t->entries);
+
+  table_init(t);
+}
+
+// The control byte stored for a key with this hash.
+uint8 table_h2(uint64 hash) {
+  return (uint8) (hash & 0x7F);
+}
+
+// Bitmask of the slots in the group starting at ctrl whose control byte is b.
+uint32 table_match(uint8* ctrl, uint8 b) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((__m128i*) ctrl);
+
+  return (uint32) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) b)));
+#else
+  uint32 mask = 0;
+
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+    if (ctrl[i] == b) {
+      mask |= 1 << i;
+    }
+  }
+
+  return mask;
+#endif
+}
 
-  for (int i = 0; i < str.len - 1; i++) {
-    c = str.str[i];
-    hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+// Bitmask of the slots in the group starting at ctrl which aren't in use.
+uint32 table_matchFree(uint8* ctrl) {
+#ifdef __SSE2__
+  // Empty and deleted are the only control bytes with the top bit set.
+  return (uint32) _mm_movemask_epi8(_mm_loadu_si128((__m128i*) ctrl));
+#else
+  uint32 mask = 0;
+
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+    if (ctrl[i] & 0x80) {
+      mask |= 1 << i;
+    }
   }
 
-  return hash;
+  return mask;
+#endif
 }
 
-bool table_full(Table* t) {
-  return t->capacity * TABLE_MAX_LOAD < t->count + 1;
+int table_lowestBit(uint32 mask) {
+  return __builtin_ctz(mask);
 }
 
-// NOTE(harrison): INTERNAL USE ONLY.
-bool table_addEntry(Table* t, TableEntry entry) {
+// Index of the first group to probe for hash. Groups are then probed
+// triangularly (+1, +2, +3, ...), which visits every group once as the number
+// of groups is a power of two.
+int table_firstGroup(Table* t, uint64 hash) {
+  int groups = t->capacity / TABLE_GROUP_WIDTH;
+
+  return (int) ((hash >> 7) & (groups - 1));
+}
+
+// Finds the slot holding key. Returns -1 if it isn't in the table.
+int table_find(Table* t, String key) {
   if (t->capacity <= 0) {
-    return false;
+    return -1;
   }
 
-  int index = entry.hash % t->capacity;
+  uint64 hash = key.hash;
+  int groups = t->capacity / TABLE_GROUP_WIDTH;
+  int group = table_firstGroup(t, hash);
+  uint8 h2 = table_h2(hash);
 
-  for (int offset = 0; offset < t->capacity; offset += 1) {
-    int i = (index + offset) % t->capacity;
+  for (int probe = 1; probe <= groups; probe++) {
+    uint8* ctrl = t->ctrl + group * TABLE_GROUP_WIDTH;
 
-    if (t->entries[i].hash == 0) {
-      t->entries[i] = entry;
-      t->count += 1;
+    for (uint32 mask = table_match(ctrl, h2); mask != 0; mask &= mask - 1) {
+      int i = group * TABLE_GROUP_WIDTH + table_lowestBit(mask);
 
-      return true;
-    } else if (tableEntry_sameKey(entry, t->entries[i])) {
-      t->entries[i] = entry;
+      if (t->entries[i].key.str == key.str) {
+        return i;
+      }
+    }
 
-      return true;
+    if (table_match(ctrl, TABLE_CTRL_EMPTY) != 0) {
+      return -1;
     }
+
+    group = (group + probe) & (groups - 1);
   }
 
-  return false;
+  return -1;
 }
 
-void table_resize(Table* t) {
-  int cap = t->capacity;
-  TableEntry* entries = t->entries;
+// Finds the first slot a key with this hash could be put into. The table must
+// have a free slot.
+int table_findFree(Table* t, uint64 hash) {
+  int groups = t->capacity / TABLE_GROUP_WIDTH;
+  int group = table_firstGroup(t, hash);
 
-  t->capacity = TABLE_CAPACITY_GROW(t->capacity);
-  t->entries = (TableEntry*) malloc(sizeof(TableEntry) * t->capacity);
+  for (int probe = 1; probe <= groups; probe++) {
+    uint32 mask = table_matchFree(t->ctrl + group * TABLE_GROUP_WIDTH);
 
-  memset(t->entries, 0, sizeof(TableEntry)*t->capacity);
+    if (mask != 0) {
+      return group * TABLE_GROUP_WIDTH + table_lowestBit(mask);
+    }
 
-  for (int i = 0; i < cap; i += 1) {
-    TableEntry e = entries[i];
+    group = (group + probe) & (groups - 1);
+  }
 
-    if (e.hash == 0) {
-      continue;
-    }
+  assert(!"table_findFree called on a full table");
 
-    assert(table_addEntry(t, e));
+  return -1;
+}
+
+// NOTE: INTERNAL USE ONLY. Puts an entry for a key which isn't in
+// the table into a free slot.
+void table_insert(Table* t, TableEntry entry) {
+  int i = table_findFree(t, entry.key.hash);
+
+  if (t->ctrl[i] == TABLE_CTRL_DELETED) {
+    t->tombstones -= 1;
   }
 
+  t->ctrl[i] = table_h2(entry.key.hash);
+  t->entries[i] = entry;
+  t->count += 1;
+}
+
+// Rebuilds the table with the given capacity, dropping any tombstones.
+void table_rehash(Table* t, int capacity) {
+  uint8* ctrl = t->ctrl;
+  TableEntry* entries = t->entries;
+  int oldCapacity = t->capacity;
+
+  t->ctrl = (uint8*) malloc(capacity);
+  t->entries = (TableEntry*) malloc(sizeof(TableEntry) * capacity);
+  t->count = 0;
+  t->tombstones = 0;
+  t->capacity = capacity;
+
+  memset(t->ctrl, TABLE_CTRL_EMPTY, capacity);
+
+  for (int i = 0; i < oldCapacity; i++) {
+    if ((ctrl[i] & 0x80) == 0) {
+      table_insert(t, entries[i]);
+    }
+  }
+
+  free(ctrl);
   free(entries);
 }
 
+// Makes sure there's room to add another entry.
+void table_reserve(Table* t) {
+  if (t->count + t->tombstones + 1 <= TABLE_MAX_LOAD(t->capacity)) {
+    return;
+  }
+
+  // If tombstones are what filled the table up, clearing them out is enough.
+  if (t->capacity > 0 && t->count + 1 <= TABLE_MAX_LOAD(t->capacity) / 2) {
+    table_rehash(t, t->capacity);
+  } else {
+    table_rehash(t, t->capacity < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : t->capacity * 2);
+  }
+}
+
 void table_set(Table* t, String str, Value val) {
-  if (table_full(t)) {
-    table_resize(t);
+  int i = table_find(t, str);
+  if (i != -1) {
+    t->entries[i].val = val;
+
+    return;
   }
 
+  table_reserve(t);
+
   TableEntry e = {};
   e.key = str;
   e.val = val;
-  e.hash = table_hash(str);
 
-  assert(table_addEntry(t, e));
+  table_insert(t, e);
 }
 
 bool table_get(Table* t, String key, Value* v) {
-  if (t->capacity <= 0) {
+  int i = table_find(t, key);
+  if (i == -1) {
     return false;
   }
 
-  // TODO(harrison): Is this too slow? Benchmark
-  int64 hash = table_hash(key);
-
-  int64 index = hash % t->capacity;
+  if (v != 0) {
+    *v = t->entries[i].val;
+  }
 
-  for (int offset = 0; offset < t->capacity; offset += 1) {
-    int64 i = (index + offset) % t->capacity;
-    TableEntry entry = t->entries[i];
+  return true;
+}
 
-    if (entry.hash == 0) {
-      continue;
-    }
+// Removes key from the table. Returns false if it wasn't there.
+bool table_delete(Table* t, String key) {
+  int i = table_find(t, key);
+  if (i == -1) {
+    return false;
+  }
 
-    if (key.len == entry.key.len && hash == entry.hash && strncmp(key.str, entry.key.str, key.len) == 0) {
-      if (v != 0) {
-        *v = t->entries[i].val;
-      }
+  uint8* group = t->ctrl + (i / TABLE_GROUP_WIDTH) * TABLE_GROUP_WIDTH;
 
-      return true;
-    }
+  if (table_match(group, TABLE_CTRL_EMPTY) != 0) {
+    t->ctrl[i] = TABLE_CTRL_EMPTY;
+  } else {
+    t->ctrl[i] = TABLE_CTRL_DELETED;
+    t->tombstones += 1;
   }
 
-  return false;
+  t->count -= 1;
+
+  return true;
 }
@@ -86,111 +86,133 @@ Symbol symbol_makeFunction(char* str, int strLen, array(Symbol*) paramTypes, Sym
   return sym;
 }
 
+// Symbols by name, in lexical scope. Symbol ids are handed out in the order
+// symbols are added, and are never reused, so types can be compared by id.
 struct SymbolTable {
-  Symbol symbols[MAX_SYMBOLS];
-  int count;
+  // Every symbol added, indexed by id. They're allocated from compiler_arena
+  // and outlive their scope, as other symbols can point at them.
+  array(Symbol*) symbols;
 
-  SymbolTable* parent;
+  // Name to symbol id.
+  Bindings names;
 };
 
-// init adds a parent to a symbol table.
-void symbolTable_init(SymbolTable* symbols, SymbolTable* parent) {
-  symbols->parent = parent;
-}
-
 // add adds a symbol into the symbol table. Return value is false iff the
 // symbols name already exists in the current level of scope.
 bool symbolTable_add(SymbolTable* symbols, Symbol* sym) {
-  for (int i = 0; i < symbols->count; i++) {
-    Symbol s = symbols->symbols[i];
-
-    // compare s and sym names
-    if (s.nameLen != sym->nameLen) {
-      break;
-    }
+  int id = (int) array_count(symbols->symbols);
 
-    if (strncmp(s.name, sym->name, s.nameLen) == 0) {
-      return false;
-    }
+  if (!bindings_add(&symbols->names, string_intern(sym->name, sym->nameLen), id)) {
+    return false;
   }
 
-  assert(symbols->count < MAX_SYMBOLS);
+  sym->id = id;
 
-  sym->id = symbols->count;
+  Symbol* s = (Symbol*) arena_alloc(compiler_arena, sizeof(Symbol));
+  *s = *sym;
 
-  symbols->symbols[symbols->count] = *sym;
-
-  symbols->count += 1;
+  array_Symbolp_add(&symbols->symbols, s);
 
   return true;
 }
 
-bool symbolTable_get(SymbolTable* symbols, char* name, int nameLen, Symbol** sym) {
-  for (int i = 0; i < symbols->count; i++) {
-    Symbol s = symbols->symbols[i];
+// init sets up a symbol table holding the default types, which can be seen
+// from everywhere, and opens a scope for the program.
+void symbolTable_init(SymbolTable* symbols) {
+  symbols->symbols = array_Symbolp_initIn(compiler_arena);
+  bindings_init(&symbols->names);
 
-    if (s.nameLen != nameLen) {
-      continue;
-    }
+  Symbol Number = symbol_makeAtomic("number", VALUE_NUMBER);
+  Symbol Bool = symbol_makeAtomic("bool", VALUE_BOOL);
 
-    if (strncmp(s.name, name, nameLen) == 0) {
-      *sym = &symbols->symbols[i];
+  symbolTable_add(symbols, &Number);
+  symbolTable_add(symbols, &Bool);
 
-      return true;
-    }
-  }
+  Symbol_Atomic_Number = Number.id;
+  Symbol_Atomic_Bool = Bool.id;
+
+  bindings_push(&symbols->names);
+}
+
+void symbolTable_free(SymbolTable* symbols) {
+  bindings_free(&symbols->names);
+}
+
+// Opens a scope. Function bodies can't see the symbols of the scopes around
+// them, only the default types.
+void symbolTable_push(SymbolTable* symbols, bool function = false) {
+  bindings_push(&symbols->names, function);
+}
 
-  if (symbols->parent != 0) {
-    return symbolTable_get(symbols->parent, name, nameLen, sym);
+void symbolTable_pop(SymbolTable* symbols) {
+  bindings_pop(&symbols->names);
+}
+
+bool symbolTable_get(SymbolTable* symbols, char* name, int nameLen, Symbol** sym) {
+  int id = -1;
+  if (!bindings_get(&symbols->names, string_intern(name, nameLen), &id)) {
+    return false;
   }
 
-  return false;
+  *sym = symbols->symbols[id];
+
+  return true;
 }
 
-bool symbolTable_get(SymbolTable* symbols, Token t, Symbol** sym) {
-  return symbolTable_get(symbols, t.start, t.len, sym);
+bool symbolTable_get(SymbolTable* symbols, AST* ast, Span name, Symbol** sym) {
+  return symbolTable_get(symbols, ast_text(ast, name), name.len, sym);
 }
 
-SymbolTable symbolTable_makeDefaults() {
-  SymbolTable symbols = {};
+bool getType(AST* ast, ASTNodeId node, SymbolTable* symbols, Symbol** sym);
 
-  Symbol Number = symbol_makeAtomic("number", VALUE_NUMBER);
-  Symbol Bool = symbol_makeAtomic("bool", VALUE_BOOL);
+// Checks the arguments of the call node against the parameters of function.
+bool checkArguments(AST* ast, ASTNodeId node, Symbol* function, SymbolTable* symbols) {
+  if (array_count(function->info.function.parameterTypes) != ast->data[node].functionCall.argCount) {
+    logf("argument count mismatch\n");
+
+    return false;
+  }
 
-  symbolTable_add(&symbols, &Number);
-  symbolTable_add(&symbols, &Bool);
+  for (psize i = 0; i < array_count(function->info.function.parameterTypes); i++) {
+    ASTNodeId arg = ast_arg(ast, node, (uint32) i);
+    Symbol* paramType = function->info.function.parameterTypes[i];
 
-  Symbol_Atomic_Number = Number.id;
-  Symbol_Atomic_Bool = Bool.id;
+    Symbol* argType = 0;
+    if (!getType(ast, arg, symbols, &argType)) {
+      return false;
+    }
+
+    if (argType->id != paramType->id) {
+      logf("parameter has wrong type!\n");
 
-  return symbols;
+      return false;
+    }
+  }
+
+  return true;
 }
 
-SymbolTable DefaultSymbols = symbolTable_makeDefaults();
+void recordType(AST* ast, ASTNodeId node, Symbol* sym) {
+  if (sym->type == SYMBOL_ATOMIC) {
+    ast->types[node] = (uint8) sym->info.atomic.type;
+  }
+}
+
+// Works out the type of the binary operator node, given the types of its
+// operands.
+bool checkOperands(AST* ast, ASTNodeId node, SymbolTable* symbols, Symbol* lhs, Symbol* rhs, Symbol** sym) {
+  if (lhs->id != rhs->id) {
+    logf("left and right hand side are different types\n");
 
-bool getType(ASTNode* node, SymbolTable* symbols, Symbol** sym) {
-  switch (node->type) {
+    return false;
+  }
+
+  switch (ast_kind(ast, node)) {
     case AST_NODE_ADD:
     case AST_NODE_SUBTRACT:
     case AST_NODE_MULTIPLY:
     case AST_NODE_DIVIDE:
       {
-        Symbol* lhs = 0;
-        if (!getType(node->assignment.left, symbols, &lhs)) {
-          return false;
-        }
-
-        Symbol* rhs = 0;
-        if (!getType(node->assignment.right, symbols, &rhs)) {
-          return false;
-        }
-
-        if (lhs->id != rhs->id) {
-          logf("left and right hand side are different types\n");
-
-          return false;
-        }
-
         if (lhs->id != Symbol_Atomic_Number) {
           logf("one of the types is not a number\n");
 
@@ -198,63 +220,81 @@ bool getType(ASTNode* node, SymbolTable* symbols, Symbol** sym) {
         }
 
         *sym = rhs;
-
-        return true;
       } break;
     case AST_NODE_TEST_EQUAL:
     case AST_NODE_TEST_GREATER:
     case AST_NODE_TEST_LESSER:
     case AST_NODE_TEST_GREATER_EQUAL:
     case AST_NODE_TEST_LESSER_EQUAL:
-
       {
-        Symbol* lhs = 0;
-        if (!getType(node->assignment.left, symbols, &lhs)) {
-          return false;
-        }
+        char* Bool = (char*) "bool";
+        assert(symbolTable_get(symbols, Bool, 4, sym));
+      } break;
+    case AST_NODE_TEST_AND:
+    case AST_NODE_TEST_OR:
+      {
+        if (lhs->id != Symbol_Atomic_Bool) {
+          logf("one (or more) of the types is not a boolean\n");
 
-        Symbol* rhs = 0;
-        if (!getType(node->assignment.right, symbols, &rhs)) {
           return false;
         }
 
-        if (lhs->id != rhs->id) {
-          logf("left and right hand side are different types\n");
+        *sym = rhs;
+      } break;
+    default:
+      {
+        logf("not a binary operator: %d\n", ast_kind(ast, node));
 
-          return false;
-        }
+        return false;
+      } break;
+  }
 
-        char* Bool = (char*) "bool";
-        assert(symbolTable_get(symbols, Bool, 4, sym));
+  return true;
+}
 
-        return true;
-      } break;
+// Works out the type of the expression node. Use getType, which also records
+// the result on the node.
+bool resolveType(AST* ast, ASTNodeId node, SymbolTable* symbols, Symbol** sym) {
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_ADD:
+    case AST_NODE_SUBTRACT:
+    case AST_NODE_MULTIPLY:
+    case AST_NODE_DIVIDE:
+    case AST_NODE_TEST_EQUAL:
+    case AST_NODE_TEST_GREATER:
+    case AST_NODE_TEST_LESSER:
+    case AST_NODE_TEST_GREATER_EQUAL:
+    case AST_NODE_TEST_LESSER_EQUAL:
     case AST_NODE_TEST_AND:
     case AST_NODE_TEST_OR:
       {
-        Symbol* lhs = 0;
-        if (!getType(node->assignment.left, symbols, &lhs)) {
-          return false;
-        }
+        // NOTE: long chains are typed from the bottom up rather than
+        // by recursing; see ast_leftSpine. getType records the type of node
+        // itself, so only the operators below it are recorded here.
+        array(ASTNodeId) spine = ast_leftSpine(ast, node, ast_isBinary);
+        int last = (int) array_count(spine) - 1;
 
-        Symbol* rhs = 0;
-        if (!getType(node->assignment.right, symbols, &rhs)) {
+        Symbol* lhs = 0;
+        if (!getType(ast, ast->data[spine[last]].binary.left, symbols, &lhs)) {
           return false;
         }
 
-        if (lhs->id != rhs->id) {
-          logf("left and right hand side are different types\n");
-
-          return false;
-        }
+        for (int i = last; i >= 0; i--) {
+          Symbol* rhs = 0;
+          if (!getType(ast, ast->data[spine[i]].binary.right, symbols, &rhs)) {
+            return false;
+          }
 
-        if (lhs->id != Symbol_Atomic_Bool) {
-          logf("one (or more) of the types is not a boolean\n");
+          if (!checkOperands(ast, spine[i], symbols, lhs, rhs, &lhs)) {
+            return false;
+          }
 
-          return false;
+          if (i != 0) {
+            recordType(ast, spine[i], lhs);
+          }
         }
 
-        *sym = rhs;
+        *sym = lhs;
 
         return true;
       } break;
@@ -268,10 +308,8 @@ bool getType(ASTNode* node, SymbolTable* symbols, Symbol** sym) {
       } break;
     case AST_NODE_IDENTIFIER:
       {
-        Token tok = node->identifier.token;
-
         Symbol* decl = 0;
-        if (!symbolTable_get(symbols, tok.start, tok.len, &decl)) {
+        if (!symbolTable_get(symbols, ast, ast->data[node].identifier.name, &decl)) {
           logf("ident doesn't exist\n");
           return false;
         }
@@ -282,12 +320,12 @@ bool getType(ASTNode* node, SymbolTable* symbols, Symbol** sym) {
       } break;
     case AST_NODE_VALUE:
       {
-        Value v = node->value.val;
+        Value v = ast_value(ast, node);
 
         char* str;
         int len;
 
-        switch (v.type) {
+        switch (value_type(v)) {
           case VALUE_NUMBER:
             {
               str = (char*) "number";
@@ -314,39 +352,101 @@ bool getType(ASTNode* node, SymbolTable* symbols, Symbol** sym) {
       {
         Symbol* func = 0;
 
-        if (!symbolTable_get(symbols, node->functionCall.identifier, &func)) {
+        if (!symbolTable_get(symbols, ast, ast->data[node].functionCall.identifier, &func)) {
           logf("can't find function\n");
 
           return false;
         }
 
+        if (func->type != SYMBOL_FUNCTION) {
+          logf("symbol is not a function\n");
+
+          return false;
+        }
+
         if (func->info.function.returnType == 0) {
           logf("function does not have a return type\n");
 
           return false;
         }
 
+        // NOTE: the parameters are trusted inside the function body,
+        // so calls in expressions have to be checked too.
+        if (!checkArguments(ast, node, func, symbols)) {
+          return false;
+        }
+
         *sym = func->info.function.returnType;
 
         return true;
       } break;
     default:
       {
-        logf("can't get type of AST node type: %d\n", node->type);
+        logf("can't get type of AST node type: %d\n", ast_kind(ast, node));
       } break;
   }
 
   return false;
 }
 
-bool typeCheck(ASTNode* node, SymbolTable* symbols) {
-  switch (node->type) {
+// Gets the type of the expression node, and records it in the AST's types for
+// code generation.
+bool getType(AST* ast, ASTNodeId node, SymbolTable* symbols, Symbol** sym) {
+  if (!resolveType(ast, node, symbols, sym)) {
+    return false;
+  }
+
+  recordType(ast, node, *sym);
+
+  return true;
+}
+
+// Does running node always end in a return? Only the statements are looked
+// at, so an if counts only when both of its blocks return, whatever its
+// condition is.
+bool alwaysReturns(AST* ast, ASTNodeId node) {
+  switch (ast_kind(ast, node)) {
+    case AST_NODE_RETURN:
+      {
+        return true;
+      } break;
+    case AST_NODE_ROOT:
+      {
+        for (uint32 i = 0; i < ast->data[node].root.count; i++) {
+          if (alwaysReturns(ast, ast_child(ast, node, i))) {
+            return true;
+          }
+        }
+
+        return false;
+      } break;
+    case AST_NODE_BLOCK:
+      {
+        return alwaysReturns(ast, ast->data[node].block.block);
+      } break;
+    case AST_NODE_IF:
+      {
+        if (ast->data[node].cIf.elseBlock == AST_NODE_NONE) {
+          return false;
+        }
+
+        return alwaysReturns(ast, ast->data[node].cIf.block) && alwaysReturns(ast, ast->data[node].cIf.elseBlock);
+      } break;
+    default:
+      {
+        return false;
+      } break;
+  }
+}
+
+bool typeCheck(AST* ast, ASTNodeId node, SymbolTable* symbols) {
+  switch (ast_kind(ast, node)) {
     case AST_NODE_ROOT:
       {
-        for (psize i = 0; i < array_count(node->root.children); i++) {
-          ASTNode* child = node->root.children[i];
+        for (uint32 i = 0; i < ast->data[node].root.count; i++) {
+          ASTNodeId child = ast_child(ast, node, i);
 
-          if (!typeCheck(child, symbols)) {
+          if (!typeCheck(ast, child, symbols)) {
             return false;
           }
         }
@@ -364,9 +464,9 @@ bool typeCheck(ASTNode* node, SymbolTable* symbols) {
       {
         Symbol* type = 0;
         {
-          Token tok = node->declaration.type;
-          if (!symbolTable_get(symbols, tok.start, tok.len, &type)) {
-            logf("can't find type: %.*s\n", tok.len, tok.start);
+          Span name = ast->data[node].declaration.type;
+          if (!symbolTable_get(symbols, ast, name, &type)) {
+            logf("can't find type: %.*s\n", name.len, ast_text(ast, name));
 
             return false;
           }
@@ -375,24 +475,26 @@ bool typeCheck(ASTNode* node, SymbolTable* symbols) {
         // TODO(harrison): add symbol_getZero function when we add support for objects
         assert(type->type == SYMBOL_ATOMIC);
 
-        ASTNode n = ast_makeAssignmentDeclaration(
-            ast_makeIdentifier(node->declaration.identifier),
-            ast_makeValue(type->info.atomic.zero, node->declaration.type),
-            node->declaration.identifier);
+        uint32 pos = ast->positions[node];
+
+        ASTNodeId n = ast_makeAssignmentDeclaration(ast,
+            ast_makeIdentifier(ast, ast->data[node].declaration.identifier, pos),
+            ast_makeValue(ast, type->info.atomic.zero, pos),
+            pos);
 
-        *node = n;
+        ast_replace(ast, node, n);
 
-        return typeCheck(node, symbols);
+        return typeCheck(ast, node, symbols);
       } break;
     case AST_NODE_ASSIGNMENT:
       {
         Symbol* lhs = 0;
-        if (!getType(node->assignment.left, symbols, &lhs)) {
+        if (!getType(ast, ast->data[node].assignment.left, symbols, &lhs)) {
           return false;
         }
 
         Symbol* rhs = 0;
-        if (!getType(node->assignment.right, symbols, &rhs)) {
+        if (!getType(ast, ast->data[node].assignment.right, symbols, &rhs)) {
           return false;
         }
 
@@ -407,15 +509,16 @@ bool typeCheck(ASTNode* node, SymbolTable* symbols) {
     case AST_NODE_ASSIGNMENT_DECLARATION:
       {
         Symbol* type = 0;
-        if (!getType(node->assignmentDeclaration.right, symbols, &type)) {
+        if (!getType(ast, ast->data[node].assignmentDeclaration.right, symbols, &type)) {
           return false;
         }
 
-        assert(node->assignmentDeclaration.left->type == AST_NODE_IDENTIFIER);
+        ASTNodeId left = ast->data[node].assignmentDeclaration.left;
+        assert(ast_kind(ast, left) == AST_NODE_IDENTIFIER);
 
-        Token tok = node->assignmentDeclaration.left->identifier.token;
+        Span name = ast->data[left].identifier.name;
 
-        Symbol identifier = symbol_makeDeclaration(tok.start, tok.len, type);
+        Symbol identifier = symbol_makeDeclaration(ast_text(ast, name), name.len, type);
         if (!symbolTable_add(symbols, &identifier)) {
           logf("symbol '%.*s' already exists in current scope\n", identifier.nameLen, identifier.name);
 
@@ -430,14 +533,16 @@ bool typeCheck(ASTNode* node, SymbolTable* symbols) {
       } break;
     case AST_NODE_FUNCTION_DECLARATION:
       {
-        array(Symbol*) params = array_Symbolp_init();
+        array(Symbol*) params = array_Symbolp_initIn(compiler_arena);
+
+        ASTFunction* fn = ast_function(ast, node);
 
-        for (int i = 0; i < (int) array_count(node->functionDeclaration.parameters); i++) {
-          Parameter p = node->functionDeclaration.parameters[i];
+        for (uint32 i = 0; i < fn->parameterCount; i++) {
+          Parameter p = ast->parameters[fn->firstParameter + i];
 
           Symbol* type = 0;
-          if (!symbolTable_get(symbols, p.type.start, p.type.len, &type)) {
-            logf("unknown type: %.*s\n", p.type.len, p.type.start);
+          if (!symbolTable_get(symbols, ast, p.type, &type)) {
+            logf("unknown type: %.*s\n", p.type.len, ast_text(ast, p.type));
 
             return false;
           }
@@ -449,109 +554,106 @@ bool typeCheck(ASTNode* node, SymbolTable* symbols) {
 
         Symbol* ret = 0;
 
-        Token returnType = node->functionDeclaration.returnType;
+        Span returnType = fn->returnType;
         if (returnType.len != 0) {
-          if (!symbolTable_get(symbols, returnType.start, returnType.len, &ret)) {
-            logf("unknown ret: %.*s\n", returnType.len, returnType.start);
+          if (!symbolTable_get(symbols, ast, returnType, &ret)) {
+            logf("unknown ret: %.*s\n", returnType.len, ast_text(ast, returnType));
 
             return false;
           }
         }
 
-        Token tok = node->functionDeclaration.identifier;
+        Span name = ast->data[node].functionDeclaration.identifier;
 
-        Symbol function = symbol_makeFunction(tok.start, tok.len, params, ret);
+        Symbol function = symbol_makeFunction(ast_text(ast, name), name.len, params, ret);
         if (!symbolTable_add(symbols, &function)) {
           logf("symbol '%.*s' already exists in current scope\n", function.nameLen, function.name);
 
           return false;
         }
 
-        SymbolTable childSymbols = {};
-        symbolTable_init(&childSymbols, &DefaultSymbols);
+        symbolTable_push(symbols, true);
 
         // TODO(harrison): clean this the fuck up
-        if (!symbolTable_add(&childSymbols, &function)) {
+        if (!symbolTable_add(symbols, &function)) {
           logf("can't add this\n");
 
           return false;
         }
 
         Symbol* f = 0;
-        if (!symbolTable_get(&childSymbols, tok, &f)) {
+        if (!symbolTable_get(symbols, ast, name, &f)) {
           logf("not clue whtf\n");
 
           return false;
         }
 
-        Symbol me = symbol_makeDeclaration(0, 0, f);
+        Symbol me = symbol_makeDeclaration((char*) "", 0, f);
 
-        if (!symbolTable_add(&childSymbols, &me)) {
+        if (!symbolTable_add(symbols, &me)) {
           logf("can't add this\n");
 
           return false;
         }
 
-        for (int i = 0; i < (int) array_count(node->functionDeclaration.parameters); i++) {
-          Parameter p = node->functionDeclaration.parameters[i];
-          ASTNode temp = ast_makeDeclaration(p.identifier, p.type);
+        // NOTE: typeCheck can add nodes, which moves the AST's
+        // arrays around, so fn can't be used after this.
+        uint32 firstParameter = fn->firstParameter;
+        uint32 parameterCount = fn->parameterCount;
+        ASTNodeId block = fn->block;
+
+        for (uint32 i = 0; i < parameterCount; i++) {
+          Parameter p = ast->parameters[firstParameter + i];
+          ASTNodeId temp = ast_makeDeclaration(ast, p.identifier, p.type, ast->positions[node]);
 
-          if (!typeCheck(&temp, &childSymbols)) {
+          if (!typeCheck(ast, temp, symbols)) {
             logf("something failed setting up a parameter\n");
 
             return false;
           }
         }
 
-        return typeCheck(node->functionDeclaration.block, &childSymbols);
+        if (!typeCheck(ast, block, symbols)) {
+          return false;
+        }
+
+        // NOTE: calls are trusted to give back their return type, so a
+        // function which has one can't run off its end.
+        if (ret != 0 && !alwaysReturns(ast, block)) {
+          logf("function '%.*s' can end without returning a value\n", name.len, ast_text(ast, name));
+
+          return false;
+        }
+
+        symbolTable_pop(symbols);
+
+        return true;
       } break;
     case AST_NODE_FUNCTION_CALL:
       {
         Symbol* function = 0;
 
-        Token ident = node->functionCall.identifier;
+        Span ident = ast->data[node].functionCall.identifier;
         {
-          if (!symbolTable_get(symbols, ident.start, ident.len, &function)) {
-            logf("can't get symbol\n: %.*s", ident.len, ident.start);
+          if (!symbolTable_get(symbols, ast, ident, &function)) {
+            logf("can't get symbol\n: %.*s", ident.len, ast_text(ast, ident));
 
             return false;
           }
         }
 
         if (function->type != SYMBOL_FUNCTION) {
-          logf("symbol %.*s is not a function\n", ident.len, ident.start);
-
-          return false;
-        }
-
-        if (array_count(function->info.function.parameterTypes) != array_count(node->functionCall.args)) {
-          logf("argument count mismatch\n");
+          logf("symbol %.*s is not a function\n", ident.len, ast_text(ast, ident));
 
           return false;
         }
 
-        for (psize i = 0; i < array_count(function->info.function.parameterTypes); i++) {
-          ASTNode* arg = &node->functionCall.args[i];
-          Symbol* paramType = function->info.function.parameterTypes[i];
-
-          Symbol* argType = 0;
-          if (!getType(arg, symbols, &argType)) {
-            return false;
-          }
-
-          if (argType->id != paramType->id) {
-            logf("parameter has wrong type!\n");
-
-            return false;
-          }
-        }
-
-        return true;
+        return checkArguments(ast, node, function, symbols);
       } break;
     case AST_NODE_IF:
       {
         Symbol* condType = 0;
-        if (!getType(node->cIf.condition, symbols, &condType)) {
+        if (!getType(ast, ast->data[node].cIf.condition, symbols, &condType)) {
           return false;
         }
 
@@ -562,21 +664,23 @@ bool typeCheck(ASTNode* node, SymbolTable* symbols) {
         }
 
         {
-          SymbolTable childSymbols = {};
-          symbolTable_init(&childSymbols, symbols);
+          symbolTable_push(symbols);
 
-          if (!typeCheck(node->cIf.block, &childSymbols)) {
+          if (!typeCheck(ast, ast->data[node].cIf.block, symbols)) {
             return false;
           }
+
+          symbolTable_pop(symbols);
         }
 
-        if (node->cIf.elseBlock != 0) {
-          SymbolTable childSymbols = {};
-          symbolTable_init(&childSymbols, symbols);
+        if (ast->data[node].cIf.elseBlock != AST_NODE_NONE) {
+          symbolTable_push(symbols);
 
-          if (!typeCheck(node->cIf.elseBlock, &childSymbols)) {
+          if (!typeCheck(ast, ast->data[node].cIf.elseBlock, symbols)) {
             return false;
           }
+
+          symbolTable_pop(symbols);
         }
 
         return true;
@@ -585,7 +689,7 @@ bool typeCheck(ASTNode* node, SymbolTable* symbols) {
       {
         Symbol* me = 0;
 
-        if (!symbolTable_get(symbols, 0, 0, &me)) {
+        if (!symbolTable_get(symbols, (char*) "", 0, &me)) {
           logf("can't get this\n");
 
           return false;
@@ -603,10 +707,16 @@ bool typeCheck(ASTNode* node, SymbolTable* symbols) {
           return false;
         }
 
-        Symbol* realRetType = me->info.declaration.typeSymbol;
+        Symbol* realRetType = me->info.declaration.typeSymbol->info.function.returnType;
+
+        if (realRetType == 0) {
+          logf("function does not have a return type\n");
+
+          return false;
+        }
 
         Symbol* retType = 0;
-        if (!getType(node->Return.child, symbols, &retType)) {
+        if (!getType(ast, ast->data[node].Return.child, symbols, &retType)) {
           return false;
         }
 
@@ -626,7 +736,7 @@ bool typeCheck(ASTNode* node, SymbolTable* symbols) {
       } break;
     default:
       {
-        logf("can't typecheck: %d\n", node->type);
+        logf("can't typecheck: %d\n", ast_kind(ast, node));
       }
   }
 
@@ -10,61 +10,273 @@ enum ValueType {
   // VALUE_OBJ
 };
 
-#define VALUE_IS_NUMBER(v) ((v).type == VALUE_NUMBER)
-#define VALUE_IS_BOOL(v) ((v).type == VALUE_BOOL)
-
 struct Hunk;
 
 struct Function {
   Hunk* hunk;
 };
 
+// Strings are interned: there is only ever one String with the same
+// contents, so two strings are equal exactly when their str pointers are.
+// Get them through string_intern.
 struct String {
   char* str;
-  int len;
+  int len; // Includes the null terminator.
+
+  uint64 hash;
+};
+
+// From: http://www.cse.yorku.ca/~oz/hash.html
+uint64 string_hash(char* start, int len) {
+  uint64 hash = 5381;
+
+  for (int i = 0; i < len; i++) {
+    hash = ((hash << 5) + hash) + start[i]; /* hash * 33 + c */
+  }
+
+  // NOTE: tables take different parts of the hash for different
+  // things, so they all need to be well mixed. djb2 on its own barely
+  // changes the high bits of short strings.
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+
+  return hash;
+}
+
+#define STRING_POOL_MAX_LOAD(c) ((c) / 2)
+
+// Every interned string, in an open addressed set.
+struct StringPool {
+  String** slots;
+
+  int count;
+  int capacity;
 };
 
-void string_make(String* s, char* start, int len) {
+StringPool string_pool = {};
+
+// NOTE: INTERNAL USE ONLY.
+void string_poolInsert(StringPool* pool, String* s) {
+  int mask = pool->capacity - 1;
+
+  for (int i = (int) (s->hash & mask); ; i = (i + 1) & mask) {
+    if (pool->slots[i] == 0) {
+      pool->slots[i] = s;
+      pool->count += 1;
+
+      return;
+    }
+  }
+}
+
+void string_poolGrow(StringPool* pool) {
+  String** slots = pool->slots;
+  int capacity = pool->capacity;
+
+  pool->capacity = capacity < 64 ? 64 : capacity * 2;
+  pool->slots = (String**) calloc(pool->capacity, sizeof(String*));
+  pool->count = 0;
+
+  for (int i = 0; i < capacity; i++) {
+    if (slots[i] != 0) {
+      string_poolInsert(pool, slots[i]);
+    }
+  }
+
+  free(slots);
+}
+
+// Returns the String holding the len characters at start, making it if it
+// doesn't exist yet. Interned strings live for the rest of the program.
+String* string_intern(char* start, int len) {
+  StringPool* pool = &string_pool;
+  uint64 hash = string_hash(start, len);
+
+  if (pool->capacity > 0) {
+    int mask = pool->capacity - 1;
+
+    for (int i = (int) (hash & mask); pool->slots[i] != 0; i = (i + 1) & mask) {
+      String* s = pool->slots[i];
+
+      if (s->hash == hash && s->len == len + 1 && memcmp(s->str, start, len) == 0) {
+        return s;
+      }
+    }
+  }
+
+  if (pool->count + 1 > STRING_POOL_MAX_LOAD(pool->capacity)) {
+    string_poolGrow(pool);
+  }
+
+  // The characters are stored right after the String.
+  String* s = (String*) malloc(sizeof(String) + len + 1);
+  s->str = (char*) (s + 1);
   s->len = len + 1;
-  // TODO(harrison): free
-  s->str = (char*) malloc(s->len * sizeof(char));
+  s->hash = hash;
 
-  strncpy(s->str, start, len);
+  memcpy(s->str, start, len);
   s->str[len] = '\0';
+
+  string_poolInsert(pool, s);
+
+  return s;
+}
+
+// NOTE: Value has two encodings, picked at build time. By default a
+// Value is a type tag next to a union of every kind of value. Defining
+// VALUE_NAN_BOXING packs the whole thing into a single 64 bit word instead:
+//
+// - numbers are stored as plain doubles.
+// - everything else lives in the payload of a quiet NaN, which no arithmetic
+//   on numbers will produce. nil, false and true are small tags in the low
+//   bits, and strings and functions are pointers with the sign bit set.
+//
+// Either way a string Value points to its interned String.
+//
+// Outside of this file values should only be inspected and built through the
+// VALUE_IS_* and VALUE_AS_* macros, value_type and value_make, so that the
+// rest of the interpreter works unchanged with either encoding.
+//
+// A zeroed Value (ie. Value v = {}) is nil in the tagged encoding, but the
+// number 0 when NaN boxed.
+#ifdef VALUE_NAN_BOXING
+
+#define VALUE_SIGN_BIT ((uint64) 0x8000000000000000)
+#define VALUE_QNAN ((uint64) 0x7ffc000000000000)
+
+#define VALUE_TAG_NIL (1)
+#define VALUE_TAG_FALSE (2)
+#define VALUE_TAG_TRUE (3)
+
+// Pointers are at least 8 byte aligned, so the low bits say what they point to.
+#define VALUE_POINTER_MASK ((uint64) 7)
+#define VALUE_POINTER_STRING (1)
+#define VALUE_POINTER_FUNCTION (2)
+
+struct Value {
+  uint64 bits;
+};
+
+static_assert(sizeof(Value) == 8, "NaN boxed values should fit in a word");
+
+#define VALUE_BITS_NIL (VALUE_QNAN | VALUE_TAG_NIL)
+#define VALUE_BITS_FALSE (VALUE_QNAN | VALUE_TAG_FALSE)
+#define VALUE_BITS_TRUE (VALUE_QNAN | VALUE_TAG_TRUE)
+
+#define VALUE_IS_NIL(v) ((v).bits == VALUE_BITS_NIL)
+#define VALUE_IS_NUMBER(v) (((v).bits & VALUE_QNAN) != VALUE_QNAN)
+#define VALUE_IS_BOOL(v) (((v).bits | 1) == VALUE_BITS_TRUE)
+#define VALUE_IS_POINTER(v, Kind) \
+  (((v).bits & (VALUE_SIGN_BIT | VALUE_QNAN | VALUE_POINTER_MASK)) == (VALUE_SIGN_BIT | VALUE_QNAN | (Kind)))
+#define VALUE_IS_STRING(v) VALUE_IS_POINTER(v, VALUE_POINTER_STRING)
+#define VALUE_IS_FUNCTION(v) VALUE_IS_POINTER(v, VALUE_POINTER_FUNCTION)
+
+#define VALUE_AS_NUMBER(v) (value_asNumber((v)))
+#define VALUE_AS_BOOL(v) ((v).bits == VALUE_BITS_TRUE)
+#define VALUE_POINTER(v) ((void*) (uintptr_t) ((v).bits & ~(VALUE_SIGN_BIT | VALUE_QNAN | VALUE_POINTER_MASK)))
+#define VALUE_AS_STRING(v) (*(String*) VALUE_POINTER(v))
+#define VALUE_AS_FUNCTION(v) (*(Function*) VALUE_POINTER(v))
+
+double value_asNumber(Value v) {
+  double d;
+  memcpy(&d, &v.bits, sizeof(d));
+
+  return d;
+}
+
+Value value_fromPointer(void* ptr, uint64 kind) {
+  uint64 p = (uint64) (uintptr_t) ptr;
+
+  assert((p & (VALUE_SIGN_BIT | VALUE_QNAN | VALUE_POINTER_MASK)) == 0);
+
+  Value v;
+  v.bits = VALUE_SIGN_BIT | VALUE_QNAN | p | kind;
+
+  return v;
+}
+
+Value value_makeNil() {
+  Value v;
+  v.bits = VALUE_BITS_NIL;
+
+  return v;
+}
+
+Value value_make(double t) {
+  Value v;
+  memcpy(&v.bits, &t, sizeof(t));
+
+  return v;
+}
+
+Value value_make(bool t) {
+  Value v;
+  v.bits = t ? VALUE_BITS_TRUE : VALUE_BITS_FALSE;
+
+  return v;
+}
+
+Value value_make(Hunk* hunk) {
+  // TODO(harrison): free
+  Function* f = (Function*) malloc(sizeof(Function));
+  f->hunk = hunk;
+
+  return value_fromPointer(f, VALUE_POINTER_FUNCTION);
+}
+
+Value value_make(char* start, int len) {
+  return value_fromPointer(string_intern(start, len), VALUE_POINTER_STRING);
+}
+
+ValueType value_type(Value v) {
+  if (VALUE_IS_NUMBER(v)) {
+    return VALUE_NUMBER;
+  } else if (VALUE_IS_BOOL(v)) {
+    return VALUE_BOOL;
+  } else if (VALUE_IS_STRING(v)) {
+    return VALUE_STRING;
+  } else if (VALUE_IS_FUNCTION(v)) {
+    return VALUE_FUNCTION;
+  }
+
+  return VALUE_NIL;
 }
 
+#else
+
 struct Value {
   ValueType type;
 
   union {
-    float number; // VALUE_NUMBER
+    double number; // VALUE_NUMBER
     bool boolean; // VALUE_BOOL
     Function function; // VALUE_FUNCTION
-    String string; // VALUE_STRING
+    String* string; // VALUE_STRING
 
     // Object* object;
   } as;
 };
 
-Value value_make(ValueType type) {
-  Value v = {};
-  v.type = type;
+#define VALUE_IS_NIL(v) ((v).type == VALUE_NIL)
+#define VALUE_IS_NUMBER(v) ((v).type == VALUE_NUMBER)
+#define VALUE_IS_BOOL(v) ((v).type == VALUE_BOOL)
+#define VALUE_IS_STRING(v) ((v).type == VALUE_STRING)
+#define VALUE_IS_FUNCTION(v) ((v).type == VALUE_FUNCTION)
 
-  switch (v.type) {
-    case VALUE_NUMBER:
-      { v.as.number = 0; } break;
-    case VALUE_BOOL:
-      { v.as.boolean = false; } break;
-    default:
-      {
-        assert(!"Unknown value type");
-      }
-  }
+#define VALUE_AS_NUMBER(v) ((v).as.number)
+#define VALUE_AS_BOOL(v) ((v).as.boolean)
+#define VALUE_AS_STRING(v) (*(v).as.string)
+#define VALUE_AS_FUNCTION(v) ((v).as.function)
+
+Value value_makeNil() {
+  Value v = {};
+  v.type = VALUE_NIL;
 
   return v;
 }
 
-Value value_make(float t) {
+Value value_make(double t) {
   Value v = {};
   v.type = VALUE_NUMBER;
 
@@ -95,37 +307,60 @@ Value value_make(Hunk* hunk) {
 }
 
 Value value_make(char* start, int len) {
-  String s = {};
-  string_make(&s, start, len);
-
   Value v = {};
   v.type = VALUE_STRING;
-  v.as.string = s;
+  v.as.string = string_intern(start, len);
 
   return v;
 }
 
+ValueType value_type(Value v) {
+  return v.type;
+}
+
+#endif
+
+// Returns the zero value for type.
+Value value_make(ValueType type) {
+  switch (type) {
+    case VALUE_NUMBER:
+      {
+        return value_make(0.0);
+      } break;
+    case VALUE_BOOL:
+      {
+        return value_make(false);
+      } break;
+    default:
+      {
+        assert(!"Unknown value type");
+      }
+  }
+
+  return value_makeNil();
+}
+
 void value_printTo(PrintPtr f, Value v) {
-  switch (v.type) {
+  switch (value_type(v)) {
     case VALUE_NUMBER:
       {
-        f("%f", v.as.number);
+        f("%f", VALUE_AS_NUMBER(v));
       } break;
     case VALUE_BOOL:
       {
-        f(v.as.boolean ? "true" : "false");
+        f(VALUE_AS_BOOL(v) ? "true" : "false");
       } break;
     case VALUE_STRING:
       {
-        f("'%s'", v.as.string.str);
+        f("'%s'", VALUE_AS_STRING(v).str);
       } break;
     case VALUE_FUNCTION:
       {
-        f("[function @ %p]", v.as.function.hunk);
+        f("[function @ %p]", VALUE_AS_FUNCTION(v).hunk);
       } break;
     default:
       {
-        f("unknown: %d", v.type);
+        f("unknown: %d", value_type(v));
       }
   };
 }
@@ -142,21 +377,102 @@ void value_printlnTo(PrintPtr f, Value v) {
 #define value_log(v) value_printTo(logf, (v))
 #define value_logln(v) value_printlnTo(logf, (v))
 
+// Are left and right the same value, down to the bits? Unlike value_equals
+// this works on values of any type, never treats two different numbers
+// (ie. 0 and -0) as the same, and compares strings by their contents.
+bool value_identical(Value left, Value right) {
+  ValueType type = value_type(left);
+
+  if (type != value_type(right)) {
+    return false;
+  }
+
+  switch (type) {
+    case VALUE_NIL:
+      {
+        return true;
+      } break;
+    case VALUE_NUMBER:
+      {
+        double a = VALUE_AS_NUMBER(left);
+        double b = VALUE_AS_NUMBER(right);
+
+        return memcmp(&a, &b, sizeof(a)) == 0;
+      } break;
+    case VALUE_BOOL:
+      {
+        return VALUE_AS_BOOL(left) == VALUE_AS_BOOL(right);
+      } break;
+    case VALUE_STRING:
+      {
+        return VALUE_AS_STRING(left).str == VALUE_AS_STRING(right).str;
+      } break;
+    case VALUE_FUNCTION:
+      {
+        return VALUE_AS_FUNCTION(left).hunk == VALUE_AS_FUNCTION(right).hunk;
+      } break;
+  }
+
+  return false;
+}
+
+// Hashes v so that values which are value_identical hash the same.
+uint64 value_hash(Value v) {
+  uint64 bits = 0;
+
+  switch (value_type(v)) {
+    case VALUE_NIL:
+      {
+        bits = 0;
+      } break;
+    case VALUE_NUMBER:
+      {
+        double n = VALUE_AS_NUMBER(v);
+
+        memcpy(&bits, &n, sizeof(n));
+      } break;
+    case VALUE_BOOL:
+      {
+        bits = VALUE_AS_BOOL(v) ? 1 : 0;
+      } break;
+    case VALUE_STRING:
+      {
+        bits = VALUE_AS_STRING(v).hash;
+      } break;
+    case VALUE_FUNCTION:
+      {
+        bits = (uint64) (uintptr_t) VALUE_AS_FUNCTION(v).hunk;
+      } break;
+  }
+
+  // NOTE: mixed the same way as string_hash, with the type thrown
+  // in so that ie. 0, false and nil don't all collide.
+  uint64 hash = bits ^ ((uint64) value_type(v) << 56);
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+
+  return hash;
+}
+
 bool value_equals(Value left, Value right) {
-  if (left.type != right.type) {
+  ValueType type = value_type(left);
+
+  if (type != value_type(right)) {
     // TODO(harrison): this should not be possible. We need a type system.
 
     assert(!"Can't compare variables of different types");
   }
 
-  switch (left.type) {
+  switch (type) {
     case VALUE_BOOL:
       {
-        return left.as.boolean == right.as.boolean;
+        return VALUE_AS_BOOL(left) == VALUE_AS_BOOL(right);
       } break;
     case VALUE_NUMBER:
       {
-        return us_equals(left.as.number, right.as.number);
+        return us_equals(VALUE_AS_NUMBER(left), VALUE_AS_NUMBER(right));
       } break;
     default:
       {